@@ -0,0 +1,17 @@
+;Tight ALU loop: 40 x 5000 iterations of ADD/AND/NOT and a counted branch
+.ORIG x3000
+      LD  R1, OUTERN
+OUTER LD  R2, INNERN
+LOOP  ADD R3, R3, R2
+      AND R4, R3, R1
+      NOT R5, R4
+      ADD R3, R3, R5
+      ADD R2, R2, #-1
+      BRP LOOP
+      ADD R1, R1, #-1
+      BRP OUTER
+      TRAP x50
+
+OUTERN .FILL #40
+INNERN .FILL #5000
+.END
@@ -0,0 +1,28 @@
+;Memory copy: fills 1024 words at x4000, then copies them to x5000 200 times with LDR/STR
+.ORIG x3000
+      LD  R1, SRC
+      LD  R4, WORDS
+FILL  STR R4, R1, #0
+      ADD R1, R1, #1
+      ADD R4, R4, #-1
+      BRP FILL
+
+      LD  R5, PASSES
+PASS  LD  R1, SRC
+      LD  R2, DST
+      LD  R4, WORDS
+COPY  LDR R3, R1, #0
+      STR R3, R2, #0
+      ADD R1, R1, #1
+      ADD R2, R2, #1
+      ADD R4, R4, #-1
+      BRP COPY
+      ADD R5, R5, #-1
+      BRP PASS
+      TRAP x50
+
+SRC    .FILL x4000
+DST    .FILL x5000
+WORDS  .FILL #1024
+PASSES .FILL #200
+.END
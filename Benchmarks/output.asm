@@ -0,0 +1,12 @@
+;Output heavy: 2000 lines through the guest PUTS routine (TRAP x48)
+.ORIG x3000
+      LD  R1, LINES
+LOOP  LEA R0, LINE
+      TRAP x48
+      ADD R1, R1, #-1
+      BRP LOOP
+      TRAP x50
+
+LINES .FILL #2000
+LINE  .STRINGZ "The quick brown fox jumps over the lazy dog 0123456789\n"
+.END
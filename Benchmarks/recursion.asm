@@ -0,0 +1,33 @@
+;Recursive JSR/RET: fib(22) the slow way, with a stack of saved registers at R6
+.ORIG x3000
+      LD  R6, STACK
+      LD  R0, N
+      JSR FIB
+      ST  R1, RESULT
+      TRAP x50
+
+;R1 = fib(R0), R0, R2 and R7 are kept on the stack
+FIB   ADD R6, R6, #-3
+      STR R7, R6, #0
+      STR R0, R6, #1
+      STR R2, R6, #2
+      ADD R1, R0, #-2
+      BRZP RECUR
+      ADD R1, R0, #0
+      BR  DONE
+RECUR ADD R0, R0, #-1
+      JSR FIB
+      ADD R2, R1, #0
+      ADD R0, R0, #-1
+      JSR FIB
+      ADD R1, R1, R2
+DONE  LDR R2, R6, #2
+      LDR R0, R6, #1
+      LDR R7, R6, #0
+      ADD R6, R6, #3
+      RET
+
+STACK  .FILL x7000
+N      .FILL #22
+RESULT .FILL 0
+.END
@@ -1,508 +1,8734 @@
 /*
 	A simple simulation of LC3.
-	Includes all instructions except JMP, JSRR and RTI.
-	Supports DSR/DDR display output but not KBSR/KBDR keyboard output.
+	Includes all instructions, with device interrupts.
+	Supports DSR/DDR display output, KBSR/KBDR keyboard input and a TMR/TMI timer.
 	Authors: John Mayer, Dimitar Kumanov
 	Version: 5/26/2017
 */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE	//memfd_create()
+#endif
 #include <stdio.h>
 #include <stdint.h>
 #include <sys/stat.h>
 #include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <time.h>
+#include "lc3sim.h"
 
-//Determines whether the simulation will print additional information during execution.
-#define PRINT_ON (0)
+//Built with -DLC3SIM_LIBRARY this is the library lc3sim.h declares, without main()
+#ifndef LC3SIM_LIBRARY
+#define LC3SIM_LIBRARY (0)
+#endif
+
+//With mmap() machines are mapped rather than calloc'd, so only the pages a machine touches get zeroed.
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_MMAP (1)
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#define HAVE_MMAP (0)
+#endif
+
+//The JIT engine needs an x86-64 host that can map executable memory.
+#if defined(__x86_64__) && HAVE_MMAP
+#define HAVE_JIT (1)
+#else
+#define HAVE_JIT (0)
+#endif
+
+//Object files are byte-swapped into memory 8 words at a time where there's SSE2 or NEON.
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+//Batch mode runs its jobs on POSIX threads where they're available, one after another otherwise.
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_THREADS (1)
+#include <pthread.h>
+#else
+#define HAVE_THREADS (0)
+#endif
+
+//--gdb serves the debugger and --coordinator its workers over TCP where there are BSD sockets
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_SOCKETS (1)
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <poll.h>
+#else
+#define HAVE_SOCKETS (0)
+#endif
+
+//Machines started from a base image map it copy-on-write from a memfd on Linux, elsewhere they get a copy.
+#if defined(__linux__) && HAVE_MMAP
+#define HAVE_MEMFD (1)
+#else
+#define HAVE_MEMFD (0)
+#endif
+
+//--perf reads the host's hardware counters with perf_event_open(), which only Linux has
+#if defined(__linux__)
+#define HAVE_PERF (1)
+#include <linux/perf_event.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#else
+#define HAVE_PERF (0)
+#endif
 
 #define OPCODE(instr)  ((instr) >> 12 & 0x000F)
 #define REG1(instr)  ((instr) >> 9 & 0x0007)	//inst[11:9]
 #define REG2(instr)  ((instr) >> 6 & 0x0007)	//inst[8:6]
 #define REG3(instr)  ((instr) & 0x0007)			//inst[2:0]
 #define IMMBIT(instr)  (((instr) & 0x0020) >> 5)
-#define IMMVAL(instr)  (((instr) << 27 ) >> 27)
-#define PCOFFSET11(instr) (((instr) << 21) >> 21)
-#define PCOFFSET9(instr) (((instr) << 23) >> 23)
-#define PCOFFSET6(instr) (((instr) << 26) >> 26)
+//Sign-extends the low bits of val (without shifting negative values, which is undefined)
+#define SIGN_EXTEND(val, bits) ((int16_t) ((((val) & ((1 << (bits)) - 1)) ^ (1 << ((bits) - 1))) - (1 << ((bits) - 1))))
+#define IMMVAL(instr)  SIGN_EXTEND(instr, 5)
+#define PCOFFSET11(instr) SIGN_EXTEND(instr, 11)
+#define PCOFFSET9(instr) SIGN_EXTEND(instr, 9)
+#define PCOFFSET6(instr) SIGN_EXTEND(instr, 6)
 #define BRN(instr)  ((instr) >> 11 & 0x0001)
 #define BRZ(instr)  ((instr) >> 10 & 0x0001)
 #define BRP(instr)  ((instr) >> 9 & 0x0001)
-#define TRPVECT8(instr) (((instr) << 24) >> 24)
+#define TRPVECT8(instr) ((instr) & 0x00FF)	//trapvect8 is zero-extended
+
+#define REG_COUNT (8)
+#define ADD_OP (1)
+#define AND_OP (5)
+#define LD_OP (2)
+#define LDI_OP (10)
+#define LDR_OP (6)
+#define BR_OP (0)
+#define ST_OP (3)
+#define STI_OP (11)
+#define STR_OP (7)
+#define LEA_OP (14)
+#define JSR_OP (4)
+#define RET_OP (12)	//JMP, RET is JMP R7
+#define RTI_OP (8)
+#define TRAP_OP (15)
+#define NOT_OP (9)
+
+#define KBSR (0xFE00)
+#define KEYBOARD_READY (0x8000)
+#define KBDR (0xFE02)
+#define DSR (0xFE04)
+#define DISPLAY_READY (0x8000)
+#define DISPLAY_SET (0x0000)
+#define DDR (0xFE06)
+
+//Timer: TMR reads TIMER_FIRED once an interval has passed since it was last read (reading clears it),
+//TMI holds the interval in cycles (0 stops the timer).
+#define TMR (0xFE08)
+#define TIMER_FIRED (0x8000)
+#define TMI (0xFE0A)
+
+//Interrupt enable bit of the status registers
+#define INTERRUPT_ENABLE (0x4000)
+
+//Interrupts (and the privilege mode exception) go through the vector table at INTERRUPT_TABLE. Devices
+//interrupt when they're ready, their interrupt enable bit is set and their priority is above the PSR's.
+#define INTERRUPT_TABLE (0x0100)
+#define PRIVILEGE_VECTOR (0x00)	//RTI in user mode
+#define KEYBOARD_VECTOR (0x80)
+#define KEYBOARD_PRIORITY (4)
+#define TIMER_VECTOR (0x81)
+#define TIMER_PRIORITY (5)
+#define DISPLAY_VECTOR (0x82)
+#define DISPLAY_PRIORITY (3)
+
+//Supervisor stack pointer the machine starts with
+#define INITIAL_SSP (0x3000)
+
+#define MCR_ADRESS (0xFFFE)
+
+#define MEMORY_BYTES (65536 * sizeof(int16_t))
+
+//A segment container is several .obj images in one file: CONTAINER_MAGIC, a big endian segment count, then for
+//each segment its origin and length in words (big endian) followed by the words. A plain .obj is one segment.
+#define CONTAINER_MAGIC "LC3SEGS\001"
+#define CONTAINER_MAGIC_LEN (8)
+
+//loadFile() errors, loadError() describes them
+#define LOAD_CANT_READ (-1)
+#define LOAD_TRUNCATED (-2)
+#define LOAD_OUT_OF_RANGE (-3)
+#define LOAD_BAD_CONTAINER (-4)
+#define LOAD_BAD_SNAPSHOT (-5)
+#define LOAD_BAD_ASSEMBLY (-6)
+
+//A snapshot is SNAPSHOT_MAGIC, the machine_state fields (big endian, cycles first), then memory as a segment
+//container of its non-zero runs. loadFile() restores one like any other file; the version is the magic's last byte.
+#define SNAPSHOT_MAGIC "LC3SNAP\002"
+#define SNAPSHOT_MAGIC_LEN (8)
+#define SNAPSHOT_HEADER_LEN (SNAPSHOT_MAGIC_LEN + 8 + 4 + 2 * (REG_COUNT + 14))
+//Zero words between two non-zero runs of memory a snapshot stores rather than starting a new segment
+#define SNAPSHOT_MAX_GAP (2)
+#define MCR_POWER(mcr) (((mcr) & 0x8000) >> 15)
+
+//service_at of a machine, see there
+#define SERVICE_TIME(m) ((m)->irq_vector >= 0 ? 0 : (m)->next_event < (m)->stop_at ? (m)->next_event : (m)->stop_at)
+
+//nzp bits (n = 4, z = 2, p = 1) of the condition codes set from val
+#define CC_BITS(val) ((((val) < 0) << 2) | (((val) == 0) << 1) | ((val) > 0))
+
+//Characters written to DDR are collected in the console buffer and written out in bulk: on a newline, when
+//the buffer is full, when the machine is turned off, and when a character comes in more than flush_interval
+//cycles after the last flush (--flush-interval, 0 disables that).
+#define CONSOLE_BUF_SIZE (4096)
+
+//FNV-1a, 64 bit: what the display output is hashed with as it's written
+#define FNV_OFFSET (14695981039346656037u)
+#define FNV_PRIME (1099511628211u)
+
+//Keyboard input is read from its file this much at a time
+#define KEYBOARD_BUF_SIZE (4096)
+
+//Device events, scheduled on the cycle count. Each device has at most one pending.
+#define EVENT_DISPLAY (0)	//the display is ready for the next character
+#define EVENT_KEYBOARD (1)	//the next key comes in
+#define EVENT_TIMER (2)		//the timer's interval is over
+#define EVENT_WATCHDOG (3)	//time to look at the clock (--timeout)
+#define EVENT_LOCKSTEP (4)	//time to compare with the reference machine (--lockstep)
+#define EVENT_GDB (5)		//time to look for an interrupt from the debugger (--gdb)
+#define EVENT_KINDS (6)
+
+//Cycles between the watchdog's looks at the clock
+#define WATCHDOG_INTERVAL (1 << 20)
+
+//Exit statuses of runMachine() and of the simulator
+#define STATUS_HALTED (0)	//the program turned the machine off
+#define STATUS_ERROR (1)	//bad arguments, or a file that can't be loaded or written
+#define STATUS_ILLEGAL (2)	//illegal instruction
+#define STATUS_CYCLES (3)	//--max-cycles used up
+#define STATUS_TIMEOUT (4)	//--timeout went off
+#define STATUS_BAD_ADRESS (5)	//access to an adress of the device space that has no device
+#define STATUS_DIVERGED (6)	//the engine and the reference interpreter went apart (--lockstep)
+#define STATUS_MISMATCH (7)	//the display output isn't the one expected (--expect)
+
+//Instructions between two comparisons of --lockstep without a number
+#define LOCKSTEP_INTERVAL (65536)
+
+//Instructions between two checkpoints of --history without a number, and the megabytes the checkpoints and
+//the write log can take without --history-memory
+#define HISTORY_INTERVAL (1 << 20)
+#define HISTORY_MEMORY (256)
+
+//Longest packet the --gdb stub takes and sends, and the cycles between two looks for a ^C from the debugger
+#define GDB_PACKET_SIZE (4096)
+#define GDB_POLL_INTERVAL (1 << 18)
+
+//Why the engines stopped for the debugger (gdb_state.stop)
+#define GDB_STOP_BREAK (1)	//the next instruction has a breakpoint
+#define GDB_STOP_WATCH (2)	//the instruction run accessed a watched word
+#define GDB_STOP_INTERRUPT (3)	//the debugger sent a ^C
+
+//Accesses a watched word is watched for, as the debugger's Z2, Z3 and Z4 packets set them
+#define GDB_WATCH_WRITE (1)
+#define GDB_WATCH_READ (2)
+#define GDB_WATCH_ACCESS (4)
+
+//Host side versions of the OS trap routines (--fast-traps). They leave the registers and CC the way
+//out.asm, puts.asm and halt.asm do, but don't touch the routines' save slots in memory.
+#define TRAP_GUEST (0)	//run the routine the trap vector points to
+#define TRAP_OUT (1)	//print the char in R0
+#define TRAP_PUTS (2)	//print the zero terminated string R0 points to
+#define TRAP_HALT (3)	//print the halt message and turn the machine off
+
+//Memory is split in 256 pages of 256 words. Pages in the device register space (xFE00-xFFFF) can have
+//devices registered on their adresses, every other page always maps straight to memory[].
+#define PAGE_SHIFT (8)
+#define PAGE_COUNT (256)
+#define PAGE_SIZE (256)
+#define IO_SPACE_START (0xFE00)
+
+//All the state of one simulated LC3 (see below), every function working on a machine takes it as first argument.
+typedef struct machine machine;
+
+//Callbacks of a memory mapped device register, a NULL callback leaves that direction going to memory[].
+typedef struct {
+	int16_t (*read)(machine *, uint16_t);
+	void (*write)(machine *, uint16_t, int16_t);
+} device_register;
+
+//Execution engines, selected with --engine=<name>
+#define ENGINE_SWITCH LC3SIM_ENGINE_SWITCH	//reference interpreter: fetch, decode and switch on every instruction
+#define ENGINE_THREADED LC3SIM_ENGINE_THREADED	//predecoded instructions with direct-threaded dispatch
+#define ENGINE_BLOCK LC3SIM_ENGINE_BLOCK	//cached basic blocks of predecoded instructions and superinstructions
+#define ENGINE_JIT LC3SIM_ENGINE_JIT		//block engine that compiles hot blocks to native x86-64 code
+
+//Number of runs after which a block gets compiled by the JIT
+#define JIT_THRESHOLD (32)
+
+//Makes sure a function gets inlined where the compiler supports it
+#if defined(__GNUC__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+//Computed goto (labels as values) is a GCC/Clang extension, other compilers dispatch threaded code with a switch.
+#if defined(__GNUC__)
+#define USE_COMPUTED_GOTO (1)
+#else
+#define USE_COMPUTED_GOTO (0)
+#endif
+
+//Kinds of predecoded instructions
+enum {
+	OPK_DECODE,		//word not decoded yet (or written to since it was decoded)
+	OPK_ADD_IMM,
+	OPK_ADD_REG,
+	OPK_AND_IMM,
+	OPK_AND_REG,
+	OPK_NOT,
+	OPK_BR,
+	OPK_LD,
+	OPK_LDI,
+	OPK_LDR,
+	OPK_ST,
+	OPK_STI,
+	OPK_STR,
+	OPK_LEA,
+	OPK_JSR,
+	OPK_RET,		//JMP BaseR
+	OPK_JSRR,
+	OPK_RTI,
+	OPK_TRAP,
+	OPK_ILLEGAL,
+	OPK_BREAK,		//a breakpoint of the debugger (--gdb), decoded in place of the word
+	OPK_COUNT
+};
+
+//Kinds that only appear in basic blocks: the block's fallthrough exit and fused superinstructions
+enum {
+	OPK_FALLTHROUGH = OPK_COUNT,	//block was cut at BLOCK_MAX_INSTRS, continue at next_pc
+	OPK_LD_BR,		//LD   Rx, ... followed by BR
+	OPK_LDI_BR,		//LDI  Rx, ... followed by BR (device polling loops)
+	OPK_ADD_BR,		//ADD  Rx, Ry, #imm followed by BR (counted loops)
+	OPK_CLEAR_ADD,		//AND  Rx, Rx, #0 followed by ADD Rx, Rx, #imm, i.e. Rx = imm
+	OPK_BLOCK_COUNT
+};
+
+//One memory word decoded into its handler and operands, used by the threaded engine.
+//Operands are extracted and sign-extended once, when the word is first executed.
+typedef struct {
+	const void *handler;	//label of the instruction in runThreaded() (computed goto only)
+	uint8_t kind;		//OPK_*
+	uint8_t dr;		//inst[11:9]: DR/SR, or the nzp mask for BR
+	uint8_t sr1;		//inst[8:6]: SR1/BaseR
+	uint8_t sr2;		//inst[2:0]: SR2
+	int16_t imm;		//sign-extended imm5/offset6/PCoffset9/PCoffset11, zero-extended trapvect8
+	int16_t raw;		//the instruction word itself
+} decoded_op;
+
+//Longest straight-line run collected into one block. Must stay below a page (256 words)
+//since invalidation only looks for blocks starting in the written page and the one before it.
+#define BLOCK_MAX_INSTRS (64)
+
+//One op of a basic block: PC relative adresses and branch targets are resolved when the block is built.
+typedef struct {
+	const void *handler;	//label of the op in runBlocks() (computed goto only)
+	uint8_t kind;		//OPK_*
+	uint8_t dr;		//DR/SR
+	uint8_t sr1;		//SR1/BaseR
+	uint8_t sr2;		//SR2
+	uint8_t mask;		//nzp mask of the BR (fused or not)
+	int16_t imm;		//sign-extended imm5/offset6, zero-extended trapvect8
+	uint16_t adress;	//LD/LDI/ST/STI adress, LEA value
+	uint16_t target;	//branch or JSR target
+	uint16_t next_pc;	//adress of the instruction after this op
+	int16_t raw;		//(first) instruction word
+} block_op;
+
+//State passed to native code compiled from a block. The JIT addresses the fields with 8 bit displacements.
+typedef struct {
+	int16_t *regs;
+	int16_t *memory;
+	const uint8_t *code_map;
+	int16_t cc;		//value the CC was last set from, in and out
+	uint8_t side_exit;	//1 when the block stopped before an instruction the interpreter has to run
+	uint32_t executed;	//instructions the block completed
+} jit_state;
+
+//Compiled block, returns the next PC
+typedef uint16_t (*jit_fn)(jit_state *);
+
+typedef struct block {
+	uint16_t start_pc;
+	uint16_t end_pc;	//adress after the last instruction
+	uint16_t length;	//instructions, counting both halves of superinstructions
+	uint16_t op_count;
+	struct block *page_next;	//next block starting in the same page
+	uint32_t exec_count;	//runs, counted while the JIT is enabled
+	jit_fn native;		//compiled code, NULL when not (or not yet) compiled
+	block_op ops[];
+} block;
+
+//Deepest call stack --profile tells apart, deeper calls are counted in the frame at this depth
+#define PROFILE_MAX_DEPTH (256)
+
+//A frame of the --profile call tree: the routine called, from the frame parent
+typedef struct {
+	uint16_t target;	//entry adress
+	int16_t vector;		//trap vector of a TRAP routine, -1 for JSR
+	int parent, first_child, next_sibling;	//indexes into the tree, -1 for none
+	uint64_t self;		//instructions executed in this frame
+} profile_frame;
+
+//Host counters --perf reads: CPU cycles, instructions, branch misses and L1 instruction cache misses
+#define PERF_CYCLES (0)
+#define PERF_INSTRUCTIONS (1)
+#define PERF_BRANCH_MISSES (2)
+#define PERF_ICACHE_MISSES (3)
+#define PERF_COUNTERS (4)
+static const char *const counter_names[PERF_COUNTERS] = {"cycles", "instructions", "branch misses", "L1 icache misses"};
+
+//The --perf counters, opened as one perf_event group so they're read together with a single read()
+typedef struct {
+	int count;			//counters the host has, read in this order
+	int fds[PERF_COUNTERS];		//their file descriptors, fds[0] (the cycles) leads the group
+	int counters[PERF_COUNTERS];	//PERF_ of each
+	uint64_t overhead[PERF_COUNTERS];	//counted between two reads one right after the other
+} host_counters;
+
+//What the --perf counters counted so far, by PERF_ (0 for the ones the host doesn't have)
+typedef struct {
+	uint64_t values[PERF_COUNTERS];
+	uint64_t enabled, running;	//ns the group was enabled and counting, which differ when it's multiplexed
+} counter_values;
+
+//Counters of --profile, kept by the switch engine
+typedef struct {
+	uint64_t opcodes[16];
+	uint64_t pcs[65536];
+	uint64_t calls[65536];		//JSRs, TRAPs and interrupts into each adress
+	int16_t trap_vectors[65536];	//vector of the TRAP routine at an adress (INTERRUPT_TABLE plus the vector for
+					//an interrupt's routine), -1 when none
+	profile_frame *frames;		//call tree, frames[0] is the program's entry
+	int frame_count, frame_cap;
+	int current;			//frame the machine is in
+	int depth, overflow;		//depth of current, calls made past PROFILE_MAX_DEPTH
+	//--perf=N: one instruction in perf_interval runs between two reads of the host counters, what they count
+	//goes to its opcode
+	host_counters *perf;		//NULL when not sampling, the caller's
+	uint64_t perf_interval, perf_countdown;
+	uint64_t perf_samples[16];
+	uint64_t perf_counts[16][PERF_COUNTERS];
+} exec_profile;
+
+//A raw --trace file is TRACE_MAGIC, TRACE_BYTE_ORDER and the size of a record (both uint16_t, host order),
+//then one trace_record per instruction executed.
+#define TRACE_MAGIC "LC3TRAC\001"
+#define TRACE_MAGIC_LEN (8)
+#define TRACE_BYTE_ORDER (0x0102)
+#define TRACE_NO_REG (0xFF)
+
+//A delta trace (--trace-format=delta) is DELTA_MAGIC then blocks, each a DELTA_HEADER_LEN header followed by
+//its records, LZ compressed. The header holds the packed length (DELTA_STORED set when the records are stored
+//as they are), the unpacked length, then a keyframe: the cycle, pc, registers and CC before the block's first
+//record (all big endian). A header with a packed length of 0 ends the blocks; then comes the index, the
+//number of blocks and each one's first cycle and file offset (64 bits each), then the index's offset and
+//DELTA_INDEX_MAGIC. Traces cut short (the simulator was killed) have no index and are read block by block.
+#define DELTA_MAGIC "LC3DTRC\001"
+#define DELTA_INDEX_MAGIC "LC3INDEX"
+#define DELTA_HEADER_LEN (4 + 4 + 8 + 2 + 2 * REG_COUNT + 1)
+#define DELTA_STORED (0x80000000u)
+
+//A delta record is a tag byte then, when the tag says so, the pc (when it isn't the one after the last
+//record's), the register written (number, then value) and the memory written (adress, then value).
+#define DELTA_PC (0x01)
+#define DELTA_REG (0x02)
+#define DELTA_MEM (0x04)
+#define DELTA_CC_SHIFT (3)	//nzp in tag bits 5:3
+#define DELTA_MAX_RECORD (1 + 2 + 3 + 4)
+
+//Formats of --trace-format
+#define TRACE_RAW (0)
+#define TRACE_DELTA (1)
+
+//Bytes of records the machine collects before it hands them to the writer
+#define TRACE_BLOCK_BYTES (64 * 1024)
+
+//One executed instruction in a raw trace: where it was, what it was and what it changed
+typedef struct {
+	uint16_t pc;
+	int16_t ir;
+	int16_t value;		//new value of reg
+	uint8_t reg;		//register the instruction writes, TRACE_NO_REG for none
+	uint8_t cc;		//nzp bits after the instruction
+} trace_record;
+
+//Records collected by the machine, with the state before the first of them (the delta format's keyframe)
+typedef struct {
+	uint8_t *data;
+	size_t len;
+	uint64_t first_cycle;
+	uint16_t pc;
+	int16_t regs[REG_COUNT];
+	uint8_t cc;
+} trace_block;
+
+//--trace state, double buffered: the machine fills one block while the writer thread (or the machine itself,
+//without threads) compresses and writes out the other.
+typedef struct {
+	FILE *out;
+	int format;		//TRACE_RAW or TRACE_DELTA
+	trace_block blocks[2];
+	trace_block *filling;	//block the machine puts records in
+	trace_block *pending;	//block handed to the writer, NULL once it's written
+	uint16_t next_pc;	//pc a delta record leaves out
+	uint8_t *packed;	//the writer's compression buffer
+	uint64_t offset;	//file offset of the next block
+	uint64_t *index;	//first cycle and offset of each delta block written
+	size_t index_len, index_cap;
+	int done, failed;
+#if HAVE_THREADS
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t ready, space;
+#endif
+} trace_writer;
+
+//Labels of the assembled sources, sorted by adress. limit is the end of the label's .ORIG segment, an adress
+//past the last label before it is only named after that label up to there.
+typedef struct {
+	uint16_t adress;
+	uint32_t limit;
+	uint32_t name;		//offset of its name in names
+} symbol;
+
+typedef struct {
+	symbol *entries;
+	size_t count;
+	char *names;
+	size_t names_len;
+} symbol_table;
+
+//Control-flow graph of the code reachable from the entry point and the trap and interrupt vectors (--cfg).
+//A basic block is the instructions from start to end (inclusive), next the blocks it can go on to in its
+//routine (fall-through, branch target) and call the routine a JSR or TRAP ending it calls.
+typedef struct {
+	uint16_t start, end;
+	uint16_t next[2];
+	int next_count;
+	int32_t call;		//-1 for none (or JSRR, whose target isn't known)
+	uint16_t routine;	//entry of the routine it belongs to
+} cfg_block;
+
+typedef struct {
+	uint16_t entry;
+	cfg_block *blocks;	//by start adress
+	int count;
+	int32_t *block_at;	//index of the block holding each adress, -1 where there's no code
+} code_graph;
+
+//Every key read from a machine's input, so they can be read again: the machine and its reference of --lockstep
+//each read them at their own position, --history reads them again when it replays
+typedef struct {
+	size_t (*source)(void *, unsigned char *, size_t);	//the machine's own key source, NULL for in
+	void *source_context;
+	FILE *in;
+	unsigned char *keys;
+	size_t count, cap;
+} key_log;
+
+//Key source reading a key log from pos. Getting to the end of the log reads more keys from the input.
+typedef struct {
+	key_log *log;
+	size_t pos;
+} key_reader;
+
+//--lockstep: the reference machine run next to a machine, and what differed when they went apart
+typedef struct {
+	machine *machine, *reference;
+	uint64_t interval;	//instructions between two comparisons
+	uint64_t agreed_at;	//cycle count of the last comparison that matched
+	int adress;		//first memory adress that differs, -1 when something else does
+	char report[96];	//what differs
+	key_log keys;		//the keys both machines read
+	key_reader readers[2];	//the machine's and the reference's
+} lockstep_state;
+
+//--history: checkpoints a machine takes every interval instructions and the stores it makes, so it can go back
+//to an earlier cycle (historyTravel()). A checkpoint has the registers and devices of its cycle and, as undo
+//pages, the memory pages the stores before it changed since the checkpoint before, as they were at that one.
+//A store is logged with the cycle count after its instruction; an interrupt's pushes with the cycle count
+//after the first instruction of its routine (in which the interrupt was taken) and the interrupted pc.
+typedef struct {
+	uint64_t cycle;
+	uint16_t adress;
+	uint16_t pc;		//of the storing instruction, or of the one interrupted
+	int interrupt;
+} history_write;
+
+typedef struct {
+	uint64_t cycles;
+	int16_t regs[REG_COUNT];
+	uint16_t pc;
+	int16_t ir;
+	int16_t psr;		//readPSR()
+	int16_t cc_value;
+	int16_t mcr;
+	uint16_t saved_usp, saved_ssp;
+	int16_t display_status, display_data;
+	int16_t keyboard_status, keyboard_data;
+	int keyboard_primed;
+	unsigned int keyboard_len, keyboard_pos;
+	size_t keys_read;	//position of the history's key reader
+	int16_t timer_status;
+	uint16_t timer_interval;
+	uint64_t event_at[EVENT_KINDS];
+	int event_kind[EVENT_KINDS];
+	int event_count;
+	uint64_t skipped;
+	size_t first_write;	//writes logged before it (counting the ones dropped)
+	int page_count;
+	uint8_t pages[PAGE_COUNT];	//page numbers of the undo pages
+	int16_t *undo;		//page_count pages, malloc'd
+} history_checkpoint;
+
+typedef struct {
+	uint64_t interval;	//instructions between two checkpoints
+	uint64_t next_at;	//cycle count the next one is taken at
+	size_t budget;		//bytes the checkpoints and the write log can take, the oldest checkpoints go over it
+	size_t bytes;		//what they take
+	history_checkpoint *checkpoints;	//oldest first
+	int count, cap;
+	history_write *writes;
+	size_t write_count, write_cap;
+	size_t write_base;	//writes dropped before writes[0]
+	size_t step_first;	//first write of the instruction running
+	int16_t *shadow;	//memory at the last checkpoint
+	uint8_t dirty[PAGE_COUNT];	//pages stored to since then
+	key_log keys;
+	key_reader reader;
+} history_state;
+
+//--gdb: the debugger connected to a machine, its breakpoints and watchpoints. A watched word's page has its
+//accesses go through watchRead()/watchWrite() like a device's.
+typedef struct {
+	int fd;			//the connection
+	unsigned char buf[256];	//what was received and not read yet
+	size_t len, pos;
+	int no_ack;		//QStartNoAckMode, packets aren't acknowledged
+	int swbreak;		//the debugger takes "swbreak" stop replies
+	int stop;		//GDB_STOP_ why the engines stopped, 0 when they didn't for the debugger
+	uint16_t watch_adress;	//word of the watchpoint hit
+	int watch_kind;		//GDB_WATCH_ access it was hit by
+	uint8_t breakpoints[65536];
+	uint8_t watch[65536];	//GDB_WATCH_ bits of each word
+	uint16_t watched[PAGE_COUNT];	//words watched in each page
+	device_register *watch_pages[PAGE_COUNT];	//device tables of the pages with watched words
+	int watch_page_count;
+	char packet[GDB_PACKET_SIZE + 1];
+} gdb_state;
+
+struct machine {
+	//Machine Control Register. When mcr[15] == 0b machine turns off.
+	int16_t mcr;
+
+	int16_t *memory;	//65536 words, from newMachine()
+	int memory_mapped;	//memory was mmap()ed (anonymous or a private mapping of a base image's memfd)
+	int16_t regs[REG_COUNT];
+	uint16_t pc;
+	int16_t ir;
+
+	struct {
+		unsigned int user:1;		//PSR[15], 0 is supervisor mode
+		unsigned int priority:3;	//PSR[10:8]
+	} psr;   // process status register, the CC bits are in cc_value
+
+	//R6 of the mode that isn't running: the user stack pointer in supervisor mode and the other way round
+	uint16_t saved_usp, saved_ssp;
+
+	//Interrupt the devices have pending (vectors above the PSR's priority only), -1 for none, and its priority
+	int irq_vector;
+	int irq_priority;
+
+	//The loops call serviceMachine() before the instruction run at this cycle count (SERVICE_TIME()): next_event
+	//or stop_at, or 0 while an interrupt is pending. One comparison per instruction (per block for the block
+	//engine) covers all three.
+	uint64_t service_at;
+
+	//Value the condition codes were last set from. n/z/p are only worked out when something reads them
+	//(BR, printState(), readPSR()), most results are overwritten before that happens.
+	int16_t cc_value;
+
+	struct {
+		int16_t status;		//ready bit at status[15]
+		int16_t data;		//char to display
+	} display;	//display io
+
+	//Cycles the display stays busy after each character (--display-latency), 0 means it's ready right away
+	unsigned int display_latency;
+
+	struct {
+		int16_t status;		//ready bit at status[15], interrupt enable at status[14]
+		int16_t data;		//last key
+		int primed;		//the first key was looked for
+		FILE *in;		//where keys come from, NULL for none
+		size_t (*source)(void *, unsigned char *, size_t);	//when set, reads the keys instead of in
+		void *source_context;
+		unsigned char buf[KEYBOARD_BUF_SIZE];
+		unsigned int len, pos;	//keys read from in, the next one
+	} keyboard;	//keyboard io
+
+	//Cycles from a key being read to the next one coming in (--key-latency), 0 means right away
+	unsigned int key_latency;
+
+	struct {
+		int16_t status;
+		uint16_t interval;
+	} timer;
+
+	//Pending device events, a min-heap on the cycle they're due, and the cycle the first is due (UINT64_MAX for
+	//none). Devices run the ones due before they're accessed, so a device always shows the state of the
+	//cycle of the instruction accessing it.
+	struct {
+		uint64_t at;
+		int kind;
+	} events[EVENT_KINDS];
+	int event_count;
+	uint64_t next_event;
+
+	//A status register read just reported its device not ready (for skipPolling())
+	int waiting;
+
+	//Idle device polling loops are skipped over unless fast_forward is 0 (--no-fast-forward, profiling, tracing),
+	//but not past stop_at cycles, where the engines return (setStop()). skipped counts the cycles they'd have taken.
+	int fast_forward;
+	uint64_t stop_at;
+	uint64_t skipped;
+
+	//Why stopMachine() stopped the engines (STATUS_TIMEOUT, STATUS_BAD_ADRESS), 0 when it didn't, and the adress
+	//of a bad access
+	int fault;
+	uint16_t fault_adress;
+	uint64_t deadline;	//nowNs() the watchdog stops the machine at
+
+	struct {
+		char buf[CONSOLE_BUF_SIZE];
+		unsigned int len;
+		uint64_t flushed_at;	//cycles at the last flush
+		int capture;		//flush to out instead of stdout (batch jobs)
+		int discard;		//drop whatever is flushed (--bench)
+		void (*sink)(void *, const char *, size_t);	//when set, gets what is flushed instead of stdout
+		void *sink_context;
+		char *out;		//everything flushed so far when capturing, malloc'd
+		size_t out_len, out_cap;
+		uint64_t capture_limit;	//most display bytes captured (--capture-limit), 0 for all of them
+		uint64_t captured;
+	} console;
+	uint64_t flush_interval;
+
+	//Everything written to the display since init(): its FNV-1a hash and length, checked against the output
+	//expected (--expect) as it's written
+	struct {
+		uint64_t hash, bytes;
+		const uint8_t *expected;	//NULL for none, the caller's
+		size_t expected_len;
+		int differs;			//the output stopped matching at byte differs_at
+		uint64_t differs_at;
+	} output;
+
+	//Instructions executed since init()
+	uint64_t cycles;
+
+	//--profile counters, NULL when not profiling
+	exec_profile *profile;
+
+	//--trace output, NULL when not tracing
+	trace_writer *trace;
+
+	//--lockstep reference, NULL when not running in lockstep
+	lockstep_state *lockstep;
+
+	//--history checkpoints and write log, NULL when not keeping a history
+	history_state *history;
+
+	//--gdb debugger, NULL when no debugger is connected
+	gdb_state *gdb;
+
+	//Labels of the .asm files loaded, for the profile output
+	symbol_table symbols;
+
+	//Code reachable at load time (--cfg, --prewarm, --profile), NULL when not analyzed
+	code_graph *cfg;
+	int prewarm;	//build (and with the JIT compile) cfg's blocks at the start of runBlocks()
+
+	//Service run for each trap vector, all TRAP_GUEST unless fast traps are enabled
+	uint8_t trap_service[256];
+
+	//Per page device tables, NULL for pages without any registered device (the fast path).
+	device_register *io_pages[PAGE_COUNT];
+	device_register io_registers[(0x10000 - IO_SPACE_START)];	//backing store for the device space's tables
+
+	decoded_op decoded[65536];
+
+	//runThreaded()'s table of handler labels, indexed by OPK_* (NULL until it first runs).
+	const void *const *threaded_labels;
+	//decoded[] is kept between runs of the threaded engine (0 until it first runs: it marks every word for
+	//decoding then). Stores, markDirty() and init() mark the words written for decoding again.
+	int decoded_ready;
+	//Pages with words decoded since the page was last marked for decoding, the ones markDirty() and init() go over
+	uint8_t decoded_pages[PAGE_COUNT];
+
+	//Block cache keyed by entry PC, plus the blocks starting in each 256 word page.
+	block *block_map[65536];
+	block *page_blocks[256];
+
+	//Number of cached blocks containing each word. Stores to a word with a non zero count invalidate blocks.
+	uint8_t code_map[65536];
+	//Pages written since the machine was made or clearDirty(), a byte each so a store marks its page with one
+	//write. Right after code_map: native code reaches it from the code_map base.
+	uint8_t dirty_pages[PAGE_COUNT];
+
+	//Set by writeMemory() when a store invalidated blocks, so the running block stops.
+	int code_invalidated;
+
+	struct {
+		unsigned long long hits;
+		unsigned long long misses;
+		unsigned long long invalidations;
+		unsigned long long fused;
+	} block_stats;
+
+	//Compile hot blocks to native code in runBlocks(), set by --engine=jit
+	int jit_enabled;
+
+	//Set when the JIT ran out of code space, runBlocks() then drops every block and starts over.
+	int jit_flush_pending;
+
+	struct {
+		unsigned long long compiled;
+		unsigned long long native_runs;
+		unsigned long long native_instructions;
+		unsigned long long side_exits;
+		unsigned long long flushes;
+	} jit_stats;
+
+	//The JIT's code area, mapped by jitInit()
+	uint8_t *jit_arena, *jit_arena_pos;
+};
+
+//Everything a snapshot keeps besides memory
+typedef struct {
+	int16_t regs[REG_COUNT];
+	uint16_t pc;
+	int16_t ir;
+	int16_t psr;		//PSR without the CC bits
+	int16_t cc_value;
+	int16_t mcr;
+	int16_t display_status, display_data;
+	uint16_t saved_usp, saved_ssp;
+	int16_t keyboard_status, keyboard_data;
+	int16_t timer_status;
+	uint16_t timer_interval, timer_busy;	//timer_busy: cycles until the interval is over
+	uint32_t display_busy;	//cycles until the display is ready
+	uint64_t cycles;
+} machine_state;
+
+//Execution engines by ENGINE_ number, as --engine= names them
+static const char *const engine_names[] = {"switch", "threaded", "block", "jit"};
+#define ENGINE_COUNT (4)
+
+//Mnemonics by opcode, for the instruction mix of --bench
+static const char *const opcode_names[16] = {"BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR",
+	"RTI", "NOT", "LDI", "STI", "RET", "reserved", "LEA", "TRAP"};
+
+//Settings shared by every machine of a run, from the command line
+typedef struct {
+	int engine;
+	int print_stats;
+	unsigned int display_latency;
+	unsigned int key_latency;
+	int no_fast_forward;
+	uint64_t flush_interval;
+	uint64_t max_cycles;	//--max-cycles, 0 for no limit
+	uint64_t timeout_ns;	//--timeout, 0 for none
+	uint64_t lockstep;	//--lockstep interval, 0 when off
+	int prewarm;
+	int fast_traps;
+	uint8_t guest_traps[256];	//vectors kept on guest code with --fast-traps
+	int profile;	//--profile with --batch: count each job's instructions by opcode, for the --report
+	int hash_output;	//--hash-output: keep just the hash of the display output (and capture_limit bytes)
+	uint64_t capture_limit;	//--capture-limit, 0 for no limit
+	const char *expect;	//--expect's file, NULL for none
+	const uint8_t *expected;	//what it holds
+	size_t expected_len;
+} run_options;
+
+//Memory image with the files every job of a batch starts with, loaded once by buildBase().
+//Machines made from it only copy the pages they write to (HAVE_MEMFD) or get a copy of the whole image.
+typedef struct {
+	int fd;			//memfd holding the image, -1 when it's in image
+	int16_t *image;
+	int file_count;		//leading files of each job that are in the image
+	machine_state state;	//the machine after loading them (they can include a snapshot)
+} base_image;
+
+//Contents of a file, for the machines of a --worker, whose files come from the coordinator
+typedef struct {
+	const uint8_t *data;
+	size_t size;
+} file_data;
+
+//One program set of a batch manifest and what running it produced
+typedef struct {
+	char **files;		//OS images and the user program, loaded in order
+	int file_count;
+	char *input;		//keyboard input (--input= on the job's line), NULL for none
+	char *expect;		//output expected (--expect= on the job's line), NULL for the run's
+	uint64_t max_cycles;	//--max-cycles= on the job's line, 0 for the run's
+	const file_data *data;	//the files' contents then the input's and the expected output's, NULL when
+				//they're read from the files
+	char *output;		//captured console output, malloc'd
+	size_t output_len;
+	uint64_t output_bytes, output_hash;	//of everything the program wrote to the display
+	int status;		//runMachine()'s exit status, STATUS_ERROR when a file couldn't be loaded
+	uint64_t cycles;
+	uint64_t opcodes[16];	//instructions run by opcode, with the run's profile option
+} batch_job;
+
+//Allocates a machine with everything zeroed but its memory, which starts out as the base image passed
+//(empty for NULL). Exits when out of memory. freeMachine() releases it with its memory, cached blocks,
+//JIT code area and captured output.
+machine *newMachine(const base_image *);
+void freeMachine(machine *);
+
+//Loads the files given into a base image, from their contents when there are (NULL: reading them). Returns 0
+//when one of them can't be read.
+int buildBase(base_image *, char *const *, const file_data *, int);
+void freeBase(base_image *);
+
+//Loads the .obj file (or segment container) with the given name to LC3 mem and sets the pc to its starting
+//adress (the last segment's origin). The whole file is checked before anything is written to memory.
+//Files named .asm are assembled instead (assembleSource()).
+//A snapshot replaces memory and everything in machine_state, so it has to be loaded after init().
+//Returns the starting adress, or one of the LOAD_ errors.
+int loadFile(machine *, const char*);
+//loadFile() of a file already in memory (its bytes and size)
+int loadImage(machine *, const void *, size_t);
+//loadFile() of the contents of the file named: assembled for an .asm, loadImage()'d otherwise
+int loadData(machine *, const char *, const void *, size_t);
+
+//Reads the whole file named into a malloc'd buffer and sets its length. Returns NULL when it can't be read.
+uint8_t *readWholeFile(const char *, size_t *);
+const char *loadError(int);
+
+//Assembles LC3 source (labels, .ORIG/.FILL/.BLKW/.STRINGZ/.END and every instruction) into memory in two
+//passes, loadFile() does it for .asm files. Errors are reported to stderr as "name:line: message" and leave
+//memory alone. Adds the labels to the machine's symbols and returns the starting adress (the last .ORIG),
+//or LOAD_BAD_ASSEMBLY.
+int assembleSource(machine *, const char *, size_t, const char *);
+
+//Puts the label of the adress in text ("LOOP", or "LOOP+3" for an adress after it in its segment).
+//Returns 0 when the adress has none.
+int symbolize(const symbol_table *, uint16_t, char *, size_t);
+void freeSymbols(symbol_table *);
+
+//Reads/sets the machine_state part of a machine.
+void getState(const machine *, machine_state *);
+void setState(machine *, const machine_state *);
+
+//Writes the machine's state and memory to a snapshot file, flushing the console first. Returns 0 on errors.
+int saveSnapshot(machine *, const char *);
+
+//Runs the machine with the reference interpreter until it's run the number of instructions given in total
+//(or is turned off or stopped before). Returns STATUS_ILLEGAL after an illegal instruction, 0 otherwise.
+int runUntil(machine *, uint64_t);
+
+//Has the engines return once the machine has run the number of instructions given in total, UINT64_MAX for
+//never (the default). runMachine() then returns STATUS_CYCLES with the machine still on.
+void setStop(machine *, uint64_t);
+
+//Stops the engines after the instruction running, runMachine() returns the status given
+void stopMachine(machine *, int);
+
+//Puts why a run stopped before the program halted (runMachine()'s STATUS_CYCLES, STATUS_TIMEOUT,
+//STATUS_BAD_ADRESS, STATUS_DIVERGED or STATUS_MISMATCH) in text. Other statuses get no message. Returns its
+//length.
+int stopMessage(const machine *, int, char *, size_t);
+
+//Writes the segments of the .obj files given (plain or containers) to one segment container.
+//Returns 0 when a file can't be loaded or the container can't be written.
+int packFiles(const char *, const char *const *, int);
+
+//initializes LC3
+void init(machine *);
+
+//Applies the options to an initialized machine (fast traps, display, JIT, limits, lockstep). Returns the engine
+//to run. The limits count from here: --max-cycles from the machine's cycle count, --timeout from now.
+int configureMachine(machine *, const run_options *);
+
+//Runs machine until it's turned off or stopped, using the engine given. Returns the STATUS_ exit status for
+//main(): STATUS_HALTED, STATUS_ILLEGAL, or why it stopped.
+int runMachine(machine *, int);
+
+//The exit status of a machine an engine stopped (illegal: at an illegal instruction), after flushing its console
+int finishRun(machine *, int);
+
+//Starts running a copy of the loaded machine on the reference interpreter next to it (with the options given),
+//compared every interval instructions and when a run ends. The first comparison that doesn't match stops
+//the machine with STATUS_DIVERGED. Both machines get the same keys.
+void startLockstep(machine *, const run_options *, uint64_t);
+
+//Runs the reference up to the machine's cycle count and compares their registers, PC, PSR, stack pointers and
+//memory, and at the end of a run (final) IR. The engines don't keep IR while they run. Returns 0, noting what
+//differs, when they don't match.
+int lockstepCheck(machine *, int);
+
+//Prints the state of the machine and of the reference it went apart from (run up to where the machine
+//stopped, which can be a block after the comparison) and the memory around the first adress that differed.
+void printLockstep(machine *);
+
+//Starts keeping a history of the machine: a checkpoint now and every interval instructions, and a log of the
+//stores (and interrupt pushes), in the budget of bytes given. The oldest checkpoints are dropped to stay in
+//it, the last is always kept. The switch engine keeps the history, without skipping device polling.
+void startHistory(machine *, uint64_t, size_t);
+
+//Takes a checkpoint of the machine, between two instructions
+void historyCheckpoint(machine *);
+
+//Takes the machine back (or forward) to the cycle count given: restores the last checkpoint at or before it
+//and runs from there with the keys read the first time, dropping the output. The history after it is dropped
+//and logged again. Returns 0 when it doesn't go back that far.
+int historyTravel(machine *, uint64_t);
+
+//The last write to the adress given in the history, NULL when there's none since the oldest checkpoint
+const history_write *lastWrite(const machine *, uint16_t);
+
+//Serves the GDB remote serial protocol on the localhost TCP port given, for one debugger, which gets the machine
+//stopped before its first instruction. Breakpoints are decoded into the threaded engine (which runs for the
+//switch engine) and built into blocks. Watchpoints have their pages read and written like a device's, on the
+//threaded engine. When the debugger detaches or goes away the machine runs on and runMachine()'s status is
+//returned; when it kills the machine it's turned off.
+int gdbServe(machine *, int, int);
+
+//Whether the debugger sent a ^C (or went away) while the machine ran
+int gdbInterrupted(machine *);
+
+//Works out the control-flow graph of the code in memory reachable from the entry adress and the trap and
+//interrupt vectors, following branches, JSR and TRAP (which returns when its routine can). A zero word ends a
+//path: .BLKW leaves them and programs don't run through them. Data a path runs into counts as code.
+code_graph *analyzeCode(const machine *, uint16_t);
+void freeCodeGraph(code_graph *);
+
+//Writes the graph to the file named, as Graphviz DOT when the name ends in .dot and as JSON otherwise.
+//Returns 0 when it can't be written.
+int writeCodeGraph(const machine *, const code_graph *, const char *);
+
+//Prints LC3 state such as: registers, PC, PSR, CC
+void printState(machine *);
+
+//Prints memory from memory[arg1](inclusive) to memory[arg2](exclusive, up to 0x10000)
+void printMemory(machine *, uint32_t, uint32_t);
+
+//Prints the ranges of the memory pages written since clearDirty()
+void printWritten(const machine *);
+
+//Updates the psr's CC using the sign of the value passed
+void updatePSR_CC(machine *, int16_t);
+
+//Returns the whole PSR, with the CC bits evaluated from cc_value
+int16_t readPSR(machine *);
+
+//Sets the PSR, the CC from its nzp bits
+void writePSR(machine *, int16_t);
+
+//Works out the interrupt the devices have pending (irq_vector) and service_at, after a device's status or
+//the PSR's priority changed.
+void updateInterrupts(machine *);
+
+//Runs the device events due and takes the pending interrupt, the engines call it at service_at.
+void serviceMachine(machine *);
+
+//Enters the interrupt (or exception) routine of the vector given: switches to the supervisor stack, pushes
+//the PSR and PC and sets the priority given (-1 keeps it).
+void interrupt(machine *, uint8_t, int);
+
+//Reads/writes a word of LC3 memory, going to the registered device for memory mapped adresses.
+//Writes to ordinary memory also invalidate the predecoded copy of the word.
+int16_t readMemory(machine *, uint16_t);
+void writeMemory(machine *, uint16_t, int16_t);
+
+//Marks the pages of the len words from adress on as written, for what writes memory[] without writeMemory()
+//(loading, the debugger, the library), and has the engines decode them again. Every store the machine makes
+//marks its page.
+void markDirty(machine *, uint16_t, uint32_t);
+
+//Forgets the pages written: from here on they only count writes made after it
+void clearDirty(machine *);
+
+//Maps the device register at adress to the callbacks given, adress has to be in the device space (xFE00-xFFFF).
+//Returns 0 when the adress can't hold a device.
+int registerDevice(machine *, uint16_t, int16_t (*)(machine *, uint16_t), void (*)(machine *, uint16_t, int16_t));
+
+//Schedules the device event of the EVENT_ kind given for the cycle given, replacing the pending one
+void scheduleEvent(machine *, int, uint64_t);
+
+//Drops the pending device event of the kind given
+void cancelEvent(machine *, int);
+
+//Cycle the pending device event of the kind given is due, UINT64_MAX when there's none
+uint64_t eventTime(const machine *, int);
+
+//Runs the device events due by the current cycle, in the order they're due. between is 0 when a device access
+//runs them, in the middle of an instruction.
+void runEvents(machine *, int);
+
+//Device callbacks of the keyboard (KBSR/KBDR), the display (DSR/DDR), the timer (TMR/TMI) and the MCR.
+int16_t keyboardRead(machine *, uint16_t);
+void keyboardWrite(machine *, uint16_t, int16_t);
+int16_t displayRead(machine *, uint16_t);
+void displayWrite(machine *, uint16_t, int16_t);
+int16_t timerRead(machine *, uint16_t);
+void timerWrite(machine *, uint16_t, int16_t);
+int16_t mcrRead(machine *, uint16_t);
+void mcrWrite(machine *, uint16_t, int16_t);
+
+//Reads up to the number of keys given from the keyboard's input file (NULL for none), returns how many it read
+size_t readKeys(FILE *, unsigned char *, size_t);
+
+//Called after the LDI at the adress given read a device status register that reported it not ready. When
+//the LDI reads KBSR, DSR or TMR and the BR after it branches back to it on the status read, runs the loop to
+//the cycle the device's next event is due at once: the registers and CC are what they'd be and the cycles
+//of the iterations are counted.
+void skipPolling(machine *, uint16_t);
+
+//Fills in the decoded form of the instruction word passed (everything but the handler).
+void decodeOp(decoded_op*, int16_t);
+
+//Collects and caches the block starting at the adress given, handlers come from the label table passed.
+block *buildBlock(machine *, uint16_t, const void *const *);
+
+//Drops the cached blocks containing the adress given.
+void invalidateBlocks(machine *, uint16_t);
+
+//Drops the cached blocks holding a word of the page given.
+void invalidatePage(machine *, int);
+
+//Drops every cached block.
+void flushBlocks(machine *);
+
+//Drops what the engines made of memory (decoded words, blocks and their native code), for init()
+void forgetCode(machine *);
+
+//Prints the block cache counters to stderr.
+void printBlockStats(machine *);
+
+//Maps (or resets) the JIT's code area. Returns 0 when native code can't be run on this host.
+int jitInit(machine *);
+
+//Compiles b to native code, setting b->native. Returns 0 when the block can't (or can no longer) be compiled.
+int jitCompile(machine *, block *);
+
+//Run the loaded program until the machine is turned off, using the engine named.
+//Return the exit status for main().
+int runSwitch(machine *);
+int runThreaded(machine *);
+int runBlocks(machine *);
+
+//Fetches and executes a single instruction like runSwitch(). Returns 1 for an unrecognized instruction.
+int step(machine *);
+
+//Starts profiling the machine (with its pc as the entry of the call tree), the switch engine keeps the counts.
+void startProfile(machine *);
+
+//Counts the instruction just executed: from the adress given, ir and pc are what it left.
+void profileStep(exec_profile *, uint16_t, int16_t, uint16_t);
+
+//Prints the opcode counts and the hottest adresses and call targets.
+void printProfile(const machine *, FILE *);
+
+//Writes the call tree as collapsed stacks ("entry;x3010;TRAP_x22 count" lines) for flamegraph.pl.
+//Returns 0 when the file can't be written.
+int writeProfileStacks(const machine *, const char *);
+
+//Opens and starts the host's hardware counters for this thread (user space only), NULL with a message on stderr
+//when the host has none or doesn't let them be read. closeCounters() frees them.
+host_counters *openCounters(void);
+void closeCounters(host_counters *);
+void readCounters(const host_counters *, counter_values *);
+
+//Prints what the counters counted from before to after, in total and by guest instruction of the instructions
+//given, the counts scaled up when the group couldn't count all the time.
+void printCounters(const host_counters *, const counter_values *, const counter_values *, uint64_t, FILE *);
+
+//Has the profile sample the counters given every interval instructions (see exec_profile)
+void sampleCounters(exec_profile *, host_counters *, uint64_t);
+
+//step() between two reads of the profile's sampled counters, which go to the opcode of the instruction it ran
+int sampledStep(machine *);
+
+//Starts writing a trace of every instruction the machine executes to the file named, in the TRACE_ format
+//given (the switch engine records them). stopTrace() writes out the rest and closes the file. Both return 0 on errors.
+int startTrace(machine *, const char *, int);
+int stopTrace(machine *);
+
+//Hands the block the machine filled to the writer (waiting until it's done with the other one) and starts
+//the next block with the machine's current state as its keyframe.
+void publishTrace(machine *);
+
+//Prints a --trace file as text, one line per instruction, from the cycle given on (delta traces only, raw ones
+//print everything). Raw traces are disassembled. Adresses with a label in the symbols given (NULL for none) get
+//it after them. Returns 0 when it can't be read.
+int decodeTrace(const char *, uint64_t, const symbol_table *, FILE *);
+
+#define LZ_PACK_BOUND(len) ((len) + (len) / 255 + 16)
+
+//LZ77 compression in the LZ4 block format. lzPack() needs LZ_PACK_BOUND(len) bytes of room; lzUnpack()
+//returns the unpacked length, -1 when the data is corrupt or doesn't fit.
+size_t lzPack(const uint8_t *, size_t, uint8_t *);
+long lzUnpack(const uint8_t *, size_t, uint8_t *, size_t);
+
+//Writes the instruction as text ("ADD\tR1\tR2\t#5").
+void disassemble(int16_t, char *, size_t);
+
+//Reports the unrecognized instruction in ir to the captured output, the console's sink or stderr. The engines
+//then stop the run, which ends with STATUS_ILLEGAL.
+void illegalInstruction(machine *);
+
+//Adds the character to the console buffer, flushing it when needed.
+void consolePut(machine *, char);
+
+//Writes out whatever is in the console buffer.
+void consoleFlush(machine *);
+
+//Appends bytes to the captured output.
+void consoleCapture(machine *, const char *, size_t);
+
+//Maps the standard (x21/x22/x25) and the sample OS (x40/x48/x50) vectors to the host side routines,
+//except for the vectors flagged in the table passed, which keep running guest code.
+void enableFastTraps(machine *, const uint8_t *);
+
+//Runs the host side routine of the trap vector given, R7 must already hold the return adress.
+//Returns 0 when the vector uses guest code.
+int fastTrap(machine *, uint16_t);
+
+//Runs every job of the manifest file named on its own machine, spread over the number of threads given
+//(0: one per core), then prints each job's output in manifest order and writes the report named (NULL: none).
+//Returns the exit status for main().
+int runBatch(const char *, int, const run_options *, const char *);
+
+//runBatch() with the jobs run by the --worker processes that connect to the TCP port given: each gets the run
+//options and the files every job starts with once, then asks for jobs a batch at a time. Jobs a worker took
+//and didn't report when it went away go to the others.
+int runCoordinator(const char *, int, const run_options *, const char *);
+
+//Connects to the coordinator at "host:port" and runs the jobs it hands out on the number of threads given
+//(0: one per core) until there are none left. Returns the exit status for main().
+int runWorker(const char *, int);
+
+//Writes each job's exit status, instruction count, FNV-1a hash of its output and instruction mix (when it
+//was profiled) to the file named as JSON. Returns 0 when it can't be written.
+int writeReport(const char *, const batch_job *, int);
+
+//Runs the program of the files given once for each input file listed in the file named (one a line, '#' starts a
+//comment), LANE_COUNT machines at a time in SIMD lanes, then prints each run's output as --batch does. Returns
+//the exit status for main().
+int runLanes(const char *, const char *const *, int, const run_options *);
+
+//Times every job of the manifest named (NULL: the files given) on each engine flagged, discarding their output.
+//Each engine gets the warmup runs then the timed ones. Prints a summary to stderr and the results as JSON to
+//stdout. Returns the exit status for main().
+int runBench(const char *, const char *const *, int, const run_options *, const uint8_t *, int, int);
+
+//Reads a batch manifest: one job per line, listing the .obj files to load separated by whitespace, and
+//optionally its --input=file and --max-cycles=N; '#' starts a comment. Returns the number of jobs (in a
+//malloc'd array), -1 when the file can't be read.
+int readManifest(const char *, batch_job **);
+void freeManifest(batch_job *, int);
+
+//Runs a batch job on a fresh machine started from the base image (NULL for none), capturing its output.
+void runJob(batch_job *, const run_options *, const base_image *);
+
+//Number of leading files every job loads before its last one, i.e. what a base image can hold.
+int sharedFiles(const batch_job *, int);
+
+//These perform the specified instruction:
+void addImm(machine *);
+void addRegs(machine *);
+void andImm(machine *);
+void andRegs(machine *);
+void not(machine *);
+void br(machine *);
+void ld(machine *);
+void ldi(machine *);
+void ldr(machine *);
+void st(machine *);
+void sti(machine *);
+void str(machine *);
+void lea(machine *);
+void jsr(machine *);
+void ret(machine *);
+void rti(machine *);
+void trap(machine *);
+
+#if !LC3SIM_LIBRARY
+int main(int argc, const char* argv[]) {
+	const char* fName;
+	int load_start_addr = 0;
+	run_options opts;
+	const char *manifest = NULL;
+	const char *report = NULL;
+	const char *worker = NULL;
+	int coordinator_port = 0;
+	const char *lanes = NULL;
+	const char *pack = NULL;
+	const char *snapshot = NULL;
+	uint64_t snapshot_at = 0;
+	int bench = 0, bench_runs = 5, bench_warmup = 1;
+	int profile = 0;
+	const char *profile_stacks = NULL;
+	int perf = 0;
+	uint64_t perf_interval = 0;
+	host_counters *counters = NULL;
+	counter_values counted_from, counted_to;
+	uint64_t cycles_from = 0;
+	const char *trace = NULL;
+	const char *cfg = NULL;
+	int trace_format = TRACE_RAW;
+	const char *decode_trace = NULL;
+	const char *input = NULL;
+	uint64_t trace_from = 0;
+	int print_state = 0, print_written = 0;
+	uint64_t history = 0;
+	size_t history_memory = (size_t) HISTORY_MEMORY << 20;
+	uint64_t reverse_steps = 0;
+	long last_write = -1;
+	int gdb_port = 0;
+	unsigned long print_from = 0, print_to = 0;
+	const char *bench_manifest = NULL;
+	uint8_t bench_engines[ENGINE_COUNT] = {0};
+	int engine_given = 0;
+	const char **files = malloc(argc * sizeof(*files));
+	int threads = 0;
+	int files_loaded = 0;
+	int i, engine, status;
+	machine *m = newMachine(NULL);
+
+	//Initialize LC3 (before loading, a snapshot sets the registers init() resets):
+	init(m);
+
+	memset(&opts, 0, sizeof(opts));
+	opts.engine = ENGINE_SWITCH;
+	for(i = 1; i < argc; ++i){
+		if(strncmp(argv[i], "--engine=", 9) == 0){
+			for(opts.engine = 0; opts.engine < ENGINE_COUNT; ++opts.engine)
+				if(strcmp(argv[i] + 9, engine_names[opts.engine]) == 0)
+					break;
+			if(opts.engine == ENGINE_COUNT){
+				fprintf(stderr, "Unknown engine \"%s\" (expected switch, threaded, block or jit)\n", argv[i] + 9);
+				return 1;
+			}
+			bench_engines[opts.engine] = 1;
+			engine_given = 1;
+		}else if(strcmp(argv[i], "--stats") == 0){
+			opts.print_stats = 1;
+		}else if(strncmp(argv[i], "--display-latency=", 18) == 0){
+			opts.display_latency = strtoul(argv[i] + 18, NULL, 10);
+		}else if(strncmp(argv[i], "--key-latency=", 14) == 0){
+			opts.key_latency = strtoul(argv[i] + 14, NULL, 10);
+		}else if(strncmp(argv[i], "--input=", 8) == 0){
+			input = argv[i] + 8;
+		}else if(strcmp(argv[i], "--no-fast-forward") == 0){
+			opts.no_fast_forward = 1;
+		}else if(strncmp(argv[i], "--max-cycles=", 13) == 0){
+			opts.max_cycles = strtoull(argv[i] + 13, NULL, 10);
+		}else if(strncmp(argv[i], "--timeout=", 10) == 0){
+			opts.timeout_ns = (uint64_t) (strtod(argv[i] + 10, NULL) * 1e9);
+		}else if(strcmp(argv[i], "--lockstep") == 0 || strncmp(argv[i], "--lockstep=", 11) == 0){
+			opts.lockstep = argv[i][10] ? strtoull(argv[i] + 11, NULL, 10) : LOCKSTEP_INTERVAL;
+			if(opts.lockstep == 0)
+				opts.lockstep = 1;
+		}else if(strncmp(argv[i], "--flush-interval=", 17) == 0){
+			opts.flush_interval = strtoull(argv[i] + 17, NULL, 10);
+		}else if(strcmp(argv[i], "--fast-traps") == 0){
+			opts.fast_traps = 1;
+		}else if(strncmp(argv[i], "--guest-trap=", 13) == 0){
+			//vector in hex, written x21 or 21
+			opts.guest_traps[strtoul(argv[i] + 13 + (argv[i][13] == 'x'), NULL, 16) & 0xFF] = 1;
+		}else if(strncmp(argv[i], "--batch=", 8) == 0){
+			manifest = argv[i] + 8;
+		}else if(strncmp(argv[i], "--jobs=", 7) == 0){
+			threads = atoi(argv[i] + 7);
+		}else if(strncmp(argv[i], "--report=", 9) == 0){
+			report = argv[i] + 9;
+		}else if(strncmp(argv[i], "--expect=", 9) == 0){
+			opts.expect = argv[i] + 9;
+		}else if(strcmp(argv[i], "--hash-output") == 0){
+			opts.hash_output = 1;
+		}else if(strncmp(argv[i], "--capture-limit=", 16) == 0){
+			opts.capture_limit = strtoull(argv[i] + 16, NULL, 10);
+		}else if(strncmp(argv[i], "--coordinator=", 14) == 0){
+			coordinator_port = atoi(argv[i] + 14);
+			if(coordinator_port <= 0 || coordinator_port > 0xFFFF){
+				fprintf(stderr, "--coordinator needs a TCP port, 1-65535\n");
+				freeMachine(m);
+				return 1;
+			}
+		}else if(strncmp(argv[i], "--worker=", 9) == 0){
+			worker = argv[i] + 9;
+		}else if(strncmp(argv[i], "--pack=", 7) == 0){
+			pack = argv[i] + 7;
+		}else if(strcmp(argv[i], "--bench") == 0 || strncmp(argv[i], "--bench=", 8) == 0){
+			bench = 1;
+			bench_manifest = argv[i][7] ? argv[i] + 8 : NULL;
+		}else if(strncmp(argv[i], "--bench-runs=", 13) == 0){
+			bench_runs = atoi(argv[i] + 13);
+		}else if(strncmp(argv[i], "--bench-warmup=", 15) == 0){
+			bench_warmup = atoi(argv[i] + 15);
+		}else if(strcmp(argv[i], "--profile") == 0){
+			profile = 1;
+		}else if(strncmp(argv[i], "--profile-stacks=", 17) == 0){
+			profile = 1;
+			profile_stacks = argv[i] + 17;
+		}else if(strcmp(argv[i], "--perf") == 0 || strncmp(argv[i], "--perf=", 7) == 0){
+			perf = 1;
+			if(argv[i][6] == '='){
+				perf_interval = strtoull(argv[i] + 7, NULL, 10);
+				if(perf_interval == 0){
+					fprintf(stderr, "--perf=N samples one instruction in N, N > 0\n");
+					return 1;
+				}
+				profile = 1;	//the samples are shown with the profile
+			}
+		}else if(strncmp(argv[i], "--trace=", 8) == 0){
+			trace = argv[i] + 8;
+		}else if(strncmp(argv[i], "--trace-format=", 15) == 0){
+			if(strcmp(argv[i] + 15, "delta") == 0)
+				trace_format = TRACE_DELTA;
+			else if(strcmp(argv[i] + 15, "raw") == 0)
+				trace_format = TRACE_RAW;
+			else{
+				fprintf(stderr, "Unknown trace format \"%s\" (expected raw or delta)\n", argv[i] + 15);
+				return 1;
+			}
+		}else if(strncmp(argv[i], "--decode-trace=", 15) == 0){
+			decode_trace = argv[i] + 15;
+		}else if(strncmp(argv[i], "--trace-from=", 13) == 0){
+			trace_from = strtoull(argv[i] + 13, NULL, 10);
+		}else if(strcmp(argv[i], "--print-state") == 0){
+			print_state = 1;
+		}else if(strncmp(argv[i], "--lanes=", 8) == 0){
+			lanes = argv[i] + 8;
+		}else if(strncmp(argv[i], "--cfg=", 6) == 0){
+			cfg = argv[i] + 6;
+		}else if(strcmp(argv[i], "--prewarm") == 0){
+			opts.prewarm = 1;
+		}else if(strcmp(argv[i], "--print-written") == 0){
+			print_state = print_written = 1;
+		}else if(strncmp(argv[i], "--print-memory=", 15) == 0){
+			//xFROM-xTO, TO exclusive
+			char *end;
+			print_state = 1;
+			print_from = strtoul(argv[i] + 15 + (argv[i][15] == 'x'), &end, 16);
+			if(*end == '-')
+				print_to = strtoul(end + 1 + (end[1] == 'x'), NULL, 16);
+			if(print_to > 0x10000)
+				print_to = 0x10000;
+		}else if(strcmp(argv[i], "--history") == 0 || strncmp(argv[i], "--history=", 10) == 0){
+			history = argv[i][9] ? strtoull(argv[i] + 10, NULL, 10) : HISTORY_INTERVAL;
+			if(history == 0)
+				history = 1;
+		}else if(strncmp(argv[i], "--history-memory=", 17) == 0){
+			history_memory = (size_t) (strtod(argv[i] + 17, NULL) * (1 << 20));
+		}else if(strcmp(argv[i], "--reverse-step") == 0 || strncmp(argv[i], "--reverse-step=", 15) == 0){
+			reverse_steps = argv[i][14] ? strtoull(argv[i] + 15, NULL, 10) : 1;
+			print_state = 1;
+		}else if(strncmp(argv[i], "--last-write=", 13) == 0){
+			last_write = strtoul(argv[i] + 13 + (argv[i][13] == 'x'), NULL, 16) & 0xFFFF;
+			print_state = 1;
+		}else if(strncmp(argv[i], "--gdb=", 6) == 0){
+			gdb_port = atoi(argv[i] + 6);
+			if(gdb_port <= 0 || gdb_port > 0xFFFF){
+				fprintf(stderr, "--gdb needs a TCP port, 1-65535\n");
+				freeMachine(m);
+				return 1;
+			}
+		}else if(strncmp(argv[i], "--snapshot=", 11) == 0){
+			snapshot = argv[i] + 11;
+		}else if(strncmp(argv[i], "--snapshot-at=", 14) == 0){
+			snapshot_at = strtoull(argv[i] + 14, NULL, 10);
+		}else{  //File specified as console arg
+			fName = argv[i];
+			load_start_addr = loadFile(m, fName);
+			if(load_start_addr < 0){
+				fprintf(stderr, "Can't load \"%s\": %s\n", fName, loadError(load_start_addr));
+				free(files);
+				freeMachine(m);
+				return 1;
+			}
+			files[files_loaded++] = fName;
+		}
+	}
+	if(decode_trace){
+		free(files);
+		status = !decodeTrace(decode_trace, trace_from, &m->symbols, stdout);
+		freeMachine(m);
+		return status;
+	}
+	if(pack){
+		status = files_loaded ? !packFiles(pack, files, files_loaded) : 1;
+		if(files_loaded == 0)
+			fprintf(stderr, "--pack needs the .obj files to put in the container\n");
+		free(files);
+		freeMachine(m);
+		return status;
+	}
+	if(bench){
+		freeMachine(m);
+		if(!engine_given)	//every engine this host runs
+			for(i = 0; i < ENGINE_COUNT; ++i)
+				bench_engines[i] = i != ENGINE_JIT || HAVE_JIT;
+		if(bench_manifest ? files_loaded > 0 : files_loaded == 0){
+			fprintf(stderr, "--bench times the .obj files given, --bench=manifest the jobs listed in a manifest\n");
+			free(files);
+			return 1;
+		}
+		status = runBench(bench_manifest, files, files_loaded, &opts, bench_engines,
+			bench_runs > 0 ? bench_runs : 1, bench_warmup > 0 ? bench_warmup : 0);
+		free(files);
+		return status;
+	}
+	if(opts.expect && (opts.expected = readWholeFile(opts.expect, &opts.expected_len)) == NULL){
+		fprintf(stderr, "Can't read the expected output \"%s\"\n", opts.expect);
+		free(files);
+		freeMachine(m);
+		return 1;
+	}
+	if(lanes){
+		freeMachine(m);
+		status = files_loaded ? runLanes(lanes, files, files_loaded, &opts) : 1;
+		if(files_loaded == 0)
+			fprintf(stderr, "--lanes runs the .obj files given once for each input listed\n");
+		free(files);
+		free((void *) opts.expected);
+		return status;
+	}
+	free(files);
+	if(worker){
+		freeMachine(m);
+		free((void *) opts.expected);
+		return runWorker(worker, threads);
+	}
+	if(coordinator_port && !manifest){
+		fprintf(stderr, "--coordinator hands out the jobs of a --batch manifest\n");
+		freeMachine(m);
+		free((void *) opts.expected);
+		return 1;
+	}
+	if(manifest){
+		freeMachine(m);
+		if(files_loaded){
+			fprintf(stderr, "With --batch the .obj files are listed in the manifest\n");
+			free((void *) opts.expected);
+			return 1;
+		}
+		opts.profile = profile;
+		status = coordinator_port ? runCoordinator(manifest, coordinator_port, &opts, report)
+			: runBatch(manifest, threads, &opts, report);
+		free((void *) opts.expected);
+		return status;
+	}
+	if(files_loaded == 0){
+		printf("Please provide at least 1 .obj file using commmand line arguments\n");
+		freeMachine(m);
+		free((void *) opts.expected);
+		return 1;
+	}
+
+	if(gdb_port && (profile || trace || history || reverse_steps || last_write >= 0 || opts.lockstep)){
+		fprintf(stderr, "--gdb doesn't go with profiling, tracing, the history or --lockstep\n");
+		freeMachine(m);
+		free((void *) opts.expected);
+		return 1;
+	}
+	if(gdb_port)
+		opts.timeout_ns = 0;	//the time stopped in the debugger isn't the program's
+	m->keyboard.in = input ? fopen(input, "rb") : stdin;
+	if(m->keyboard.in == NULL){
+		fprintf(stderr, "Can't read the input \"%s\"\n", input);
+		freeMachine(m);
+		free((void *) opts.expected);
+		return 1;
+	}
+	engine = configureMachine(m, &opts);
+	if(opts.hash_output && opts.capture_limit)
+		m->console.capture = 1;	//printed after the run, with the hash
+	clearDirty(m);	//what the program writes, not what was loaded
+	status = 0;
+	if(cfg || profile){
+		if(m->cfg == NULL)
+			m->cfg = analyzeCode(m, m->pc);
+		if(cfg && !writeCodeGraph(m, m->cfg, cfg))
+			status = STATUS_ERROR;
+	}
+	if(snapshot){
+		status = runUntil(m, snapshot_at);
+		if(status == 0 && !saveSnapshot(m, snapshot))
+			status = STATUS_ERROR;
+		consoleFlush(m);
+	}
+	if((reverse_steps || last_write >= 0) && !history)
+		history = HISTORY_INTERVAL;
+	if(profile || trace || history){
+		if(engine != ENGINE_SWITCH)
+			fprintf(stderr, "Profiling, tracing and the history run the switch engine\n");
+		engine = ENGINE_SWITCH;
+		m->fast_forward = 0;	//they see every instruction
+	}
+	if(profile)
+		startProfile(m);
+	if(trace && !startTrace(m, trace, trace_format))
+		status = STATUS_ERROR;
+	if(history)
+		startHistory(m, history, history_memory);
+	if(perf && (counters = openCounters()) != NULL){
+		if(perf_interval)
+			sampleCounters(m->profile, counters, perf_interval);
+		cycles_from = m->cycles;
+		readCounters(counters, &counted_from);
+	}
+	if(status == 0)
+		status = gdb_port ? gdbServe(m, engine, gdb_port) : runMachine(m, engine);
+	if(counters){
+		readCounters(counters, &counted_to);
+		printCounters(counters, &counted_from, &counted_to, m->cycles - cycles_from, stderr);
+	}
+	if(m->trace && !stopTrace(m) && status == 0)
+		status = STATUS_ERROR;
+	if(opts.print_stats && (engine == ENGINE_BLOCK || engine == ENGINE_JIT))
+		printBlockStats(m);
+	if(opts.print_stats && m->skipped)
+		fprintf(stderr, "Fast-forward: %"PRIu64" cycles of device polling skipped\n", m->skipped);
+	if(profile){
+		printProfile(m, stderr);
+		if(profile_stacks && !writeProfileStacks(m, profile_stacks) && status == 0)
+			status = STATUS_ERROR;
+	}
+	if(counters)
+		closeCounters(counters);
+	if(opts.hash_output){
+		consoleFlush(m);
+		if(m->console.out_len){
+			fwrite(m->console.out, 1, m->console.out_len, stdout);
+			if(m->console.out[m->console.out_len - 1] != '\n')
+				putchar('\n');
+		}
+		printf("Output: %"PRIu64" bytes, hash %016"PRIx64"\n", m->output.bytes, m->output.hash);
+	}
+	free((void *) opts.expected);
+	//with a history, going back from an illegal instruction is what it's for
+	if(status == STATUS_ERROR || (status == STATUS_ILLEGAL && !m->history)){
+		freeMachine(m);
+		return status;
+	}
+	if(status != STATUS_HALTED && status != STATUS_ILLEGAL){
+		char message[256];
+		stopMessage(m, status, message, sizeof(message));
+		fprintf(stderr, "%s\n", message);
+	}
+	if(status == STATUS_DIVERGED)
+		printLockstep(m);
+	if(reverse_steps){
+		uint64_t oldest = m->history->checkpoints[0].cycles;
+		uint64_t to = m->cycles - oldest > reverse_steps ? m->cycles - reverse_steps : oldest;
+		if(to != m->cycles - reverse_steps)
+			printf("The history goes back to cycle %"PRIu64"\n", oldest);
+		historyTravel(m, to);
+		printf("Back at cycle %"PRIu64"\n", m->cycles);
+	}
+	if(last_write >= 0){
+		const history_write *w = lastWrite(m, last_write);
+		if(w){
+			history_write found = *w;	//the log is kept again from the checkpoint gone back to
+			printf("Last write to x%04lX: cycle %"PRIu64", by the %s x%04hX\n", last_write, found.cycle,
+				found.interrupt ? "interrupt taken at" : "instruction at", found.pc);
+			historyTravel(m, found.cycle);
+		}else
+			printf("No write to x%04lX since cycle %"PRIu64"\n", last_write, m->history->checkpoints[0].cycles);
+	}
+
+	if(print_state){
+		printState(m);
+		if(status == STATUS_HALTED && !MCR_POWER(m->mcr))
+			printf("Execution completed.\n");
+		if(print_from < print_to)
+			printMemory(m, print_from, print_to);
+		if(print_written)
+			printWritten(m);
+	}
+	freeMachine(m);
+	return status;
+}
+#endif
+
+//Register the instruction writes, for the trace
+static int traceDestination(int16_t ir){
+	switch(OPCODE(ir)){
+		case ADD_OP: case AND_OP: case NOT_OP: case LD_OP: case LDI_OP: case LDR_OP: case LEA_OP:
+			return REG1(ir);
+		case JSR_OP: case TRAP_OP:
+			return 7;
+		case RTI_OP:
+			return 6;
+	}
+	return TRACE_NO_REG;
+}
+
+//Adress the instruction at pc is going to store to, -1 when it isn't a store
+static ALWAYS_INLINE int32_t storeAdress(const machine *m){
+	int16_t ir = m->memory[m->pc];
+	uint16_t next = m->pc + 1;
+	switch(OPCODE(ir)){
+		case ST_OP:
+			return (uint16_t) (next + PCOFFSET9(ir));
+		case STI_OP:	//the pointer itself, as memory holds it
+			return (uint16_t) m->memory[(uint16_t) (next + PCOFFSET9(ir))];
+		case STR_OP:
+			return (uint16_t) (m->regs[REG2(ir)] + PCOFFSET6(ir));
+	}
+	return -1;
+}
+
+//Puts the record of the instruction just executed (it was at pc, stored to store) in the trace
+static ALWAYS_INLINE void traceStep(machine *m, uint16_t pc, int32_t store){
+	trace_writer *t = m->trace;
+	trace_block *b = t->filling;
+	int reg = traceDestination(m->ir);
+	if(t->format == TRACE_DELTA){
+		uint8_t *p = b->data + b->len, *tag = p++;
+		*tag = CC_BITS(m->cc_value) << DELTA_CC_SHIFT;
+		if(pc != t->next_pc){
+			*tag |= DELTA_PC;
+			*p++ = pc >> 8;
+			*p++ = pc & 0xFF;
+		}
+		if(reg != TRACE_NO_REG){
+			*tag |= DELTA_REG;
+			*p++ = reg;
+			*p++ = (uint16_t) m->regs[reg] >> 8;
+			*p++ = m->regs[reg] & 0xFF;
+		}
+		if(store >= 0){
+			int16_t value = m->regs[REG1(m->ir)];
+			*tag |= DELTA_MEM;
+			*p++ = store >> 8;
+			*p++ = store & 0xFF;
+			*p++ = (uint16_t) value >> 8;
+			*p++ = value & 0xFF;
+		}
+		t->next_pc = pc + 1;
+		b->len = p - b->data;
+	}else{
+		trace_record r;
+		r.pc = pc;
+		r.ir = m->ir;
+		r.reg = reg;
+		r.value = reg != TRACE_NO_REG ? m->regs[reg] : 0;
+		r.cc = CC_BITS(m->cc_value);
+		memcpy(b->data + b->len, &r, sizeof(r));
+		b->len += sizeof(r);
+	}
+	if(b->len > TRACE_BLOCK_BYTES - DELTA_MAX_RECORD)
+		publishTrace(m);
+}
+
+//Logs a write to the adress given (unless it's a device's) in the history, dirtying its page
+static void logWrite(machine *m, uint16_t adress, uint16_t pc, int pushed){
+	history_state *h = m->history;
+	history_write *w;
+	if(m->io_pages[adress >> PAGE_SHIFT])
+		return;
+	if(h->write_count == h->write_cap){
+		h->write_cap = h->write_cap ? 2 * h->write_cap : 4096;
+		h->writes = realloc(h->writes, h->write_cap * sizeof(history_write));
+		if(h->writes == NULL){
+			fprintf(stderr, "Out of memory keeping the history\n");
+			exit(1);
+		}
+	}
+	w = &h->writes[h->write_count++];
+	w->cycle = m->cycles + 1;	//an interrupt taken before the instruction, historyStep() sets the others
+	w->adress = adress;
+	w->pc = pc;
+	w->interrupt = pushed;
+	h->dirty[adress >> PAGE_SHIFT] = 1;
+}
+
+//Moves into the child of the current frame for a call of target, making it on the first call
+static void profileCall(exec_profile *p, uint16_t target, int16_t vector){
+	int child;
+	++p->calls[target];
+	if(vector >= 0)
+		p->trap_vectors[target] = vector;
+	if(p->depth == PROFILE_MAX_DEPTH){
+		++p->overflow;
+		return;
+	}
+	for(child = p->frames[p->current].first_child; child >= 0; child = p->frames[child].next_sibling)
+		if(p->frames[child].target == target && p->frames[child].vector == vector)
+			break;
+	if(child < 0){
+		profile_frame *frame;
+		if(p->frame_count == p->frame_cap){
+			p->frame_cap *= 2;
+			p->frames = realloc(p->frames, p->frame_cap * sizeof(profile_frame));
+			if(p->frames == NULL){
+				fprintf(stderr, "Out of memory growing the profile\n");
+				exit(1);
+			}
+		}
+		child = p->frame_count++;
+		frame = &p->frames[child];
+		frame->target = target;
+		frame->vector = vector;
+		frame->parent = p->current;
+		frame->first_child = -1;
+		frame->next_sibling = p->frames[p->current].first_child;
+		frame->self = 0;
+		p->frames[p->current].first_child = child;
+	}
+	p->current = child;
+	++p->depth;
+}
+
+//Before an instruction that's looked at (profiled, traced or kept in the history): takes the interrupt
+//pending as step() would, so the instruction's pc and store are the routine's, and the profile enters it
+static void serviceLooked(machine *m){
+	int vector;
+	if(m->cycles >= m->next_event)
+		runEvents(m, 1);
+	vector = m->irq_vector;
+	serviceMachine(m);
+	if(m->profile && vector >= 0 && !m->fault)
+		profileCall(m->profile, m->pc, INTERRUPT_TABLE + vector);
+}
+
+//Before an instruction of a machine keeping a history: takes the checkpoint due, then the interrupt pending
+static void historyService(machine *m){
+	history_state *h = m->history;
+	if(m->cycles >= h->next_at)
+		historyCheckpoint(m);
+	h->step_first = h->write_count;
+	if(m->cycles >= m->service_at)
+		serviceLooked(m);
+}
+
+//After the instruction at pc (which stored to store): logs the store, with the writes of the instruction
+//(an exception's pushes) at its cycle count
+static void historyStep(machine *m, uint16_t pc, int32_t store){
+	history_state *h = m->history;
+	size_t i;
+	if(store >= 0)
+		logWrite(m, store, pc, 0);
+	for(i = h->step_first; i < h->write_count; ++i)
+		h->writes[i].cycle = m->cycles;
+}
+
+//The switch engine's loop. runSwitch() calls it with constant profile and trace flags, so each combination
+//gets its own copy, with what isn't used left out by the compiler.
+static ALWAYS_INLINE int switchLoop(machine *m, const int profile, const int trace, const int history){
+	// main loop for fetching and executing instructions
+	   
+	while (MCR_POWER(m->mcr) && m->cycles < m->stop_at) {   // one instruction executed on each rep.
+		if(history)
+			historyService(m);
+		else if((profile || trace) && m->cycles >= m->service_at)
+			serviceLooked(m);
+		if((profile || trace || history) && m->fault)
+			break;	//the interrupt's pushes faulted, its routine doesn't start
+		uint16_t pc = m->pc;
+		uint64_t cycles = m->cycles;
+		int32_t store = trace || history ? storeAdress(m) : -1;
+		if(profile && m->profile->perf && --m->profile->perf_countdown == 0){
+			if(sampledStep(m))
+				return 1;
+		}else if(step(m))
+			return 1;
+		if((profile || trace || history) && m->cycles == cycles)
+			break;	//it stopped taking an interrupt, there's no instruction to look at
+		if(profile)
+			profileStep(m->profile, pc, m->ir, m->pc);
+		if(trace)
+			traceStep(m, pc, store);
+		if(history)
+			historyStep(m, pc, store);
+	}
+	return 0;
+}
+
+int runSwitch(machine *m){
+	if(m->history)	//a debugging run, the profile and trace are looked at as it goes
+		return switchLoop(m, m->profile != NULL, m->trace != NULL, 1);
+	if(m->trace)
+		return m->profile ? switchLoop(m, 1, 1, 0) : switchLoop(m, 0, 1, 0);
+	return m->profile ? switchLoop(m, 1, 0, 0) : switchLoop(m, 0, 0, 0);
+}
+
+void startProfile(machine *m){
+	exec_profile *p = calloc(1, sizeof(exec_profile));
+	if(p == NULL || (p->frames = malloc(64 * sizeof(profile_frame))) == NULL){
+		fprintf(stderr, "Out of memory allocating the profile\n");
+		exit(1);
+	}
+	memset(p->trap_vectors, 0xFF, sizeof(p->trap_vectors));
+	p->frame_cap = 64;
+	p->frame_count = 1;
+	p->frames[0].target = m->pc;
+	p->frames[0].vector = -1;
+	p->frames[0].parent = p->frames[0].first_child = p->frames[0].next_sibling = -1;
+	p->frames[0].self = 0;
+	m->profile = p;
+}
+
+void profileStep(exec_profile *p, uint16_t pc, int16_t ir, uint16_t next_pc){
+	++p->opcodes[OPCODE(ir)];
+	++p->pcs[pc];
+	++p->frames[p->current].self;
+	switch(OPCODE(ir)){
+		case JSR_OP:
+			profileCall(p, next_pc, -1);
+			break;
+		case TRAP_OP:
+			//host side (fast) traps come straight back
+			if(next_pc != (uint16_t) (pc + 1))
+				profileCall(p, next_pc, TRPVECT8(ir));
+			break;
+		case RET_OP:
+			if(REG2(ir) != 7)	//only JMP R7 returns
+				break;
+			if(p->overflow)
+				--p->overflow;
+			else if(p->current > 0){
+				p->current = p->frames[p->current].parent;
+				--p->depth;
+			}
+			break;
+		case RTI_OP:
+			//returns from an interrupt's routine (in user mode it's the exception, not a return)
+			if(p->overflow)
+				--p->overflow;
+			else if(p->current > 0 && p->frames[p->current].vector >= INTERRUPT_TABLE){
+				p->current = p->frames[p->current].parent;
+				--p->depth;
+			}
+			break;
+	}
+}
+
+//Sorts adresses by count, highest first
+static const uint64_t *sort_counts;
+static int compareCounts(const void *a, const void *b){
+	uint64_t x = sort_counts[*(const uint16_t *) a], y = sort_counts[*(const uint16_t *) b];
+	return (x < y) - (x > y);
+}
+
+//Prints " <LABEL+n>" after an adress that has a label in the symbols (NULL for none)
+static void printSymbol(FILE *out, const symbol_table *symbols, uint16_t adress){
+	char label[64];
+	if(symbols && symbolize(symbols, adress, label, sizeof(label)))
+		fprintf(out, " <%s>", label);
+}
+
+//Prints the count rows highest adresses of counts, as a percentage of total
+static void printHottest(const machine *m, FILE *out, const uint64_t *counts, uint64_t total, int rows,
+		uint64_t (*self)(const exec_profile *, uint16_t)){
+	uint16_t *order = malloc(65536 * sizeof(uint16_t));
+	int i, n = 0;
+	if(order == NULL)
+		return;
+	for(i = 0; i < 65536; ++i)
+		if(counts[i])
+			order[n++] = i;
+	sort_counts = counts;
+	qsort(order, n, sizeof(uint16_t), compareCounts);
+	for(i = 0; i < n && i < rows; ++i){
+		uint16_t adress = order[i];
+		int16_t word = m->memory[adress];
+		fprintf(out, "  x%04X %14" PRIu64 " %6.2f%%", adress, counts[adress], total ? 100.0 * counts[adress] / total : 0.0);
+		if(self)	//call targets
+			fprintf(out, " %14" PRIu64 " self", self(m->profile, adress));
+		else
+			fprintf(out, "  x%04hX %s", (uint16_t) word, opcode_names[OPCODE(word)]);
+		if(m->profile->trap_vectors[adress] >= INTERRUPT_TABLE)
+			fprintf(out, "  INT x%02X", m->profile->trap_vectors[adress] - INTERRUPT_TABLE);
+		else if(m->profile->trap_vectors[adress] >= 0)
+			fprintf(out, "  TRAP x%02X", m->profile->trap_vectors[adress]);
+		printSymbol(out, &m->symbols, adress);
+		fputc('\n', out);
+	}
+	free(order);
+}
+
+//Instructions executed in the frames of the routine at the adress given (not counting what it calls)
+static uint64_t selfCount(const exec_profile *p, uint16_t target){
+	uint64_t self = 0;
+	int i;
+	for(i = 1; i < p->frame_count; ++i)
+		if(p->frames[i].target == target)
+			self += p->frames[i].self;
+	return self;
+}
+
+void printProfile(const machine *m, FILE *out){
+	const exec_profile *p = m->profile;
+	uint64_t total = 0, calls = 0;
+	int i, j, order[16];
+
+	for(i = 0; i < 16; ++i){
+		total += p->opcodes[i];
+		order[i] = i;
+	}
+	for(i = 0; i < 65536; ++i)
+		calls += p->calls[i];
+	for(i = 1; i < 16; ++i)	//by count, highest first
+		for(j = i; j > 0 && p->opcodes[order[j]] > p->opcodes[order[j - 1]]; --j){
+			int swap = order[j];
+			order[j] = order[j - 1];
+			order[j - 1] = swap;
+		}
+	fprintf(out, "Profile: %" PRIu64 " instructions, %" PRIu64 " calls\nBy opcode:\n", total, calls);
+	for(i = 0; i < 16 && p->opcodes[order[i]]; ++i)
+		fprintf(out, "  %-8s %14" PRIu64 " %6.2f%%\n", opcode_names[order[i]], p->opcodes[order[i]],
+			100.0 * p->opcodes[order[i]] / total);
+	if(p->perf){
+		uint64_t samples = 0;
+		for(i = 0; i < 16; ++i)
+			samples += p->perf_samples[i];
+		fprintf(out, "Host counters by opcode, per instruction (%" PRIu64 " sampled, one in %" PRIu64 "):\n  %-8s %10s",
+			samples, p->perf_interval, "", "samples");
+		for(j = 0; j < p->perf->count; ++j)
+			fprintf(out, " %16s", counter_names[p->perf->counters[j]]);
+		fputc('\n', out);
+		for(i = 0; i < 16 && p->opcodes[order[i]]; ++i){
+			int op = order[i];
+			if(p->perf_samples[op] == 0)
+				continue;
+			fprintf(out, "  %-8s %10" PRIu64, opcode_names[op], p->perf_samples[op]);
+			for(j = 0; j < p->perf->count; ++j)
+				fprintf(out, " %16.2f", (double) p->perf_counts[op][p->perf->counters[j]] / p->perf_samples[op]);
+			fputc('\n', out);
+		}
+	}
+	fprintf(out, "Hottest adresses:\n");
+	printHottest(m, out, p->pcs, total, 20, NULL);
+	if(calls){
+		fprintf(out, "Most called routines (calls, share of calls, instructions in the routine itself):\n");
+		printHottest(m, out, p->calls, calls, 20, selfCount);
+	}
+	if(m->cfg){
+		//the routine the control flow puts each adress in, whichever way it was got to
+		uint64_t *routines = calloc(65536, sizeof(uint64_t));
+		if(routines == NULL)
+			return;
+		for(i = 0; i < 65536; ++i)
+			if(p->pcs[i] && m->cfg->block_at[i] >= 0)
+				routines[m->cfg->blocks[m->cfg->block_at[i]].routine] += p->pcs[i];
+		fprintf(out, "Instructions by routine of the control-flow graph (not counting what it calls):\n");
+		printHottest(m, out, routines, total, 20, NULL);
+		free(routines);
+	}
+}
+
+int writeProfileStacks(const machine *m, const char *fName){
+	const exec_profile *p = m->profile;
+	FILE *out = fopen(fName, "w");
+	int path[PROFILE_MAX_DEPTH + 1];
+	int i, depth, frame, ok;
+	char label[64];
+	if(out == NULL){
+		fprintf(stderr, "Can't write \"%s\"\n", fName);
+		return 0;
+	}
+	for(i = 0; i < p->frame_count; ++i){
+		if(p->frames[i].self == 0)
+			continue;
+		for(depth = 0, frame = i; frame >= 0; frame = p->frames[frame].parent)
+			path[depth++] = frame;
+		while(depth-- > 0){
+			const profile_frame *f = &p->frames[path[depth]];
+			if(f->vector >= INTERRUPT_TABLE)
+				fprintf(out, "INT_x%02X", f->vector - INTERRUPT_TABLE);
+			else if(f->vector >= 0)
+				fprintf(out, "TRAP_x%02X", f->vector);
+			else if(symbolize(&m->symbols, f->target, label, sizeof(label)))
+				fputs(label, out);
+			else
+				fprintf(out, "x%04X", f->target);
+			fputc(depth ? ';' : ' ', out);
+		}
+		fprintf(out, "%" PRIu64 "\n", p->frames[i].self);
+	}
+	ok = !ferror(out);
+	if(fclose(out) != 0 || !ok){
+		fprintf(stderr, "Can't write \"%s\"\n", fName);
+		return 0;
+	}
+	return 1;
+}
+
+#if HAVE_PERF
+//Opens the PERF_ counter of the group leader given (-1 to open the leader), -1 when the host doesn't count it
+static int openCounter(int counter, int leader){
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = counter == PERF_ICACHE_MISSES ? PERF_TYPE_HW_CACHE : PERF_TYPE_HARDWARE;
+	attr.config = counter == PERF_CYCLES ? PERF_COUNT_HW_CPU_CYCLES
+		: counter == PERF_INSTRUCTIONS ? PERF_COUNT_HW_INSTRUCTIONS
+		: counter == PERF_BRANCH_MISSES ? PERF_COUNT_HW_BRANCH_MISSES
+		: PERF_COUNT_HW_CACHE_L1I | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+	attr.disabled = leader < 0;	//the group starts when it's complete
+	attr.exclude_kernel = 1;	//what the simulator does, not the read() syscalls
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	return (int) syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+}
+#endif
+
+host_counters *openCounters(void){
+#if HAVE_PERF
+	host_counters *hc = calloc(1, sizeof(host_counters));
+	counter_values a, b;
+	int i, k;
+	if(hc == NULL){
+		fprintf(stderr, "Out of memory allocating the host counters\n");
+		exit(1);
+	}
+	hc->fds[0] = openCounter(PERF_CYCLES, -1);
+	if(hc->fds[0] < 0){
+		fprintf(stderr, "--perf: can't read the host's cycle counter (%s), running without it\n", strerror(errno));
+		free(hc);
+		return NULL;
+	}
+	hc->counters[hc->count++] = PERF_CYCLES;
+	for(i = 1; i < PERF_COUNTERS; ++i)
+		if((hc->fds[hc->count] = openCounter(i, hc->fds[0])) >= 0)
+			hc->counters[hc->count++] = i;
+	ioctl(hc->fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(hc->fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	//the least two reads in a row count is what each sample counts besides its instruction
+	for(i = 0; i < PERF_COUNTERS; ++i)
+		hc->overhead[i] = UINT64_MAX;
+	for(k = 0; k < 64; ++k){
+		readCounters(hc, &a);
+		readCounters(hc, &b);
+		for(i = 0; i < PERF_COUNTERS; ++i)
+			if(b.values[i] - a.values[i] < hc->overhead[i])
+				hc->overhead[i] = b.values[i] - a.values[i];
+	}
+	return hc;
+#else
+	fprintf(stderr, "--perf needs perf_event_open(), which this host doesn't have; running without it\n");
+	return NULL;
+#endif
+}
+
+void closeCounters(host_counters *hc){
+#if HAVE_PERF
+	int i;
+	for(i = hc->count - 1; i >= 0; --i)
+		close(hc->fds[i]);
+#endif
+	free(hc);
+}
+
+void readCounters(const host_counters *hc, counter_values *v){
+	memset(v, 0, sizeof(*v));
+#if HAVE_PERF
+	uint64_t data[3 + PERF_COUNTERS];	//how many, ns enabled, ns running, then the counts in group order
+	int i;
+	if(read(hc->fds[0], data, sizeof(data)) < (ssize_t) ((3 + hc->count) * sizeof(uint64_t)))
+		return;
+	v->enabled = data[1];
+	v->running = data[2];
+	for(i = 0; i < hc->count; ++i)
+		v->values[hc->counters[i]] = data[3 + i];
+#else
+	(void) hc;
+#endif
+}
+
+void printCounters(const host_counters *hc, const counter_values *from, const counter_values *to, uint64_t instructions,
+		FILE *out){
+	double scale = 1;
+	int i;
+	if(to->running > from->running && to->enabled - from->enabled > to->running - from->running)
+		scale = (double) (to->enabled - from->enabled) / (to->running - from->running);
+	fprintf(out, "Host counters, %"PRIu64" guest instructions", instructions);
+	if(scale > 1)
+		fprintf(out, " (counted %.1f%% of the time, scaled up)", 100 / scale);
+	fprintf(out, ":\n");
+	for(i = 0; i < hc->count; ++i){
+		int counter = hc->counters[i];
+		double count = scale * (to->values[counter] - from->values[counter]);
+		fprintf(out, "  %-16s %16.0f %12.3f per instruction\n", counter_names[counter], count,
+			instructions ? count / instructions : 0.0);
+	}
+}
+
+void sampleCounters(exec_profile *p, host_counters *hc, uint64_t interval){
+	p->perf = hc;
+	p->perf_interval = p->perf_countdown = interval;
+}
+
+int sampledStep(machine *m){
+	exec_profile *p = m->profile;
+	counter_values before, after;
+	int i, op, unknown;
+	p->perf_countdown = p->perf_interval;
+	readCounters(p->perf, &before);
+	unknown = step(m);
+	readCounters(p->perf, &after);
+	if(after.running == before.running)	//another group had the counters, there's nothing to go by
+		return unknown;
+	op = OPCODE(m->ir);
+	++p->perf_samples[op];
+	for(i = 0; i < PERF_COUNTERS; ++i){
+		uint64_t count = after.values[i] - before.values[i];
+		p->perf_counts[op][i] += count > p->perf->overhead[i] ? count - p->perf->overhead[i] : 0;
+	}
+	return unknown;
+}
+
+static uint16_t bigEndian(const uint8_t *p){
+	return (uint16_t) (p[0] << 8 | p[1]);
+}
+
+static void putBigEndian(uint8_t *p, uint16_t val){
+	p[0] = val >> 8;
+	p[1] = val & 0xFF;
+}
+
+static void putBigEndian32(uint8_t *p, uint32_t val){
+	putBigEndian(p, val >> 16);
+	putBigEndian(p + 2, val & 0xFFFF);
+}
+
+static void putBigEndian64(uint8_t *p, uint64_t val){
+	putBigEndian32(p, val >> 32);
+	putBigEndian32(p + 4, val & 0xFFFFFFFFu);
+}
+
+static uint32_t bigEndian32(const uint8_t *p){
+	return (uint32_t) bigEndian(p) << 16 | bigEndian(p + 2);
+}
+
+static uint64_t bigEndian64(const uint8_t *p){
+	return (uint64_t) bigEndian32(p) << 32 | bigEndian32(p + 4);
+}
+
+//Writes out a block the machine filled, compressed and with its header for delta traces
+static void writeTraceBlock(trace_writer *t, const trace_block *b){
+	uint8_t header[DELTA_HEADER_LEN];
+	const uint8_t *data = b->data;
+	size_t len = b->len;
+	uint32_t packed_len;
+	int i;
+	if(t->failed || len == 0)
+		return;
+	if(t->format == TRACE_DELTA){
+		len = lzPack(b->data, b->len, t->packed);
+		packed_len = len;
+		data = t->packed;
+		if(len >= b->len){	//doesn't compress
+			len = b->len;
+			packed_len = len | DELTA_STORED;
+			data = b->data;
+		}
+		putBigEndian32(header, packed_len);
+		putBigEndian32(header + 4, b->len);
+		putBigEndian64(header + 8, b->first_cycle);
+		putBigEndian(header + 16, b->pc);
+		for(i = 0; i < REG_COUNT; ++i)
+			putBigEndian(header + 18 + 2 * i, b->regs[i]);
+		header[18 + 2 * REG_COUNT] = b->cc;
+		if(t->index_len + 2 > t->index_cap){
+			t->index_cap = t->index_cap ? 2 * t->index_cap : 256;
+			t->index = realloc(t->index, t->index_cap * sizeof(uint64_t));
+			if(t->index == NULL){
+				fprintf(stderr, "Out of memory growing the trace index\n");
+				exit(1);
+			}
+		}
+		t->index[t->index_len++] = b->first_cycle;
+		t->index[t->index_len++] = t->offset;
+		if(fwrite(header, sizeof(header), 1, t->out) != 1)
+			t->failed = 1;
+		t->offset += sizeof(header);
+	}
+	if(fwrite(data, 1, len, t->out) != len)
+		t->failed = 1;
+	t->offset += len;
+}
+
+#if HAVE_THREADS
+static void *traceWriter(void *arg){
+	trace_writer *t = arg;
+	pthread_mutex_lock(&t->lock);
+	for(;;){
+		trace_block *b = t->pending;
+		if(b == NULL){
+			if(t->done)
+				break;
+			pthread_cond_wait(&t->ready, &t->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&t->lock);
+		writeTraceBlock(t, b);
+		pthread_mutex_lock(&t->lock);
+		t->pending = NULL;
+		pthread_cond_signal(&t->space);
+	}
+	pthread_mutex_unlock(&t->lock);
+	return NULL;
+}
+#endif
+
+//Starts the block with the machine's state as its keyframe
+static void startTraceBlock(machine *m, trace_block *b){
+	b->len = 0;
+	b->first_cycle = m->cycles;
+	b->pc = m->pc;
+	memcpy(b->regs, m->regs, sizeof(b->regs));
+	b->cc = CC_BITS(m->cc_value);
+	m->trace->next_pc = m->pc;
+}
+
+int startTrace(machine *m, const char *fName, int format){
+	trace_writer *t = calloc(1, sizeof(trace_writer));
+	uint16_t header[2] = {TRACE_BYTE_ORDER, sizeof(trace_record)};
+	int ok;
+	if(t == NULL || (t->blocks[0].data = malloc(TRACE_BLOCK_BYTES)) == NULL || (t->blocks[1].data = malloc(TRACE_BLOCK_BYTES)) == NULL
+		|| (t->packed = malloc(LZ_PACK_BOUND(TRACE_BLOCK_BYTES))) == NULL){
+		fprintf(stderr, "Out of memory allocating the trace buffers\n");
+		exit(1);
+	}
+	t->format = format;
+	t->out = fopen(fName, "wb");
+	if(format == TRACE_DELTA){
+		ok = t->out && fwrite(DELTA_MAGIC, TRACE_MAGIC_LEN, 1, t->out) == 1;
+		t->offset = TRACE_MAGIC_LEN;
+	}else
+		ok = t->out && fwrite(TRACE_MAGIC, TRACE_MAGIC_LEN, 1, t->out) == 1 && fwrite(header, sizeof(header), 1, t->out) == 1;
+	if(!ok){
+		fprintf(stderr, "Can't write the trace \"%s\"\n", fName);
+		if(t->out)
+			fclose(t->out);
+		free(t->blocks[0].data);
+		free(t->blocks[1].data);
+		free(t->packed);
+		free(t);
+		return 0;
+	}
+#if HAVE_THREADS
+	pthread_mutex_init(&t->lock, NULL);
+	pthread_cond_init(&t->ready, NULL);
+	pthread_cond_init(&t->space, NULL);
+	if(pthread_create(&t->thread, NULL, traceWriter, t) != 0){
+		fprintf(stderr, "Can't start the trace writer\n");
+		exit(1);
+	}
+#endif
+	m->trace = t;
+	t->filling = &t->blocks[0];
+	startTraceBlock(m, t->filling);
+	return 1;
+}
+
+void publishTrace(machine *m){
+	trace_writer *t = m->trace;
+	trace_block *full = t->filling;
+	t->filling = full == &t->blocks[0] ? &t->blocks[1] : &t->blocks[0];
+#if HAVE_THREADS
+	pthread_mutex_lock(&t->lock);
+	while(t->pending)	//the writer still has the other block
+		pthread_cond_wait(&t->space, &t->lock);
+	t->pending = full;
+	pthread_cond_signal(&t->ready);
+	pthread_mutex_unlock(&t->lock);
+#else
+	writeTraceBlock(t, full);
+#endif
+	startTraceBlock(m, t->filling);
+}
+
+int stopTrace(machine *m){
+	trace_writer *t = m->trace;
+	int ok;
+	publishTrace(m);
+#if HAVE_THREADS
+	pthread_mutex_lock(&t->lock);
+	t->done = 1;
+	pthread_cond_signal(&t->ready);
+	pthread_mutex_unlock(&t->lock);
+	pthread_join(t->thread, NULL);
+	pthread_mutex_destroy(&t->lock);
+	pthread_cond_destroy(&t->ready);
+	pthread_cond_destroy(&t->space);
+#endif
+	if(t->format == TRACE_DELTA && !t->failed){
+		//end of the blocks, then the index
+		uint8_t entry[16];
+		size_t i;
+		uint64_t index_offset = t->offset + DELTA_HEADER_LEN;
+		memset(entry, 0, sizeof(entry));
+		for(i = 0; i < DELTA_HEADER_LEN; i += 8)
+			fwrite(entry, DELTA_HEADER_LEN - i < 8 ? DELTA_HEADER_LEN - i : 8, 1, t->out);
+		putBigEndian64(entry, t->index_len / 2);
+		fwrite(entry, 8, 1, t->out);
+		for(i = 0; i < t->index_len; i += 2){
+			putBigEndian64(entry, t->index[i]);
+			putBigEndian64(entry + 8, t->index[i + 1]);
+			fwrite(entry, 16, 1, t->out);
+		}
+		putBigEndian64(entry, index_offset);
+		memcpy(entry + 8, DELTA_INDEX_MAGIC, 8);
+		if(fwrite(entry, 16, 1, t->out) != 1)
+			t->failed = 1;
+	}
+	ok = !t->failed && !ferror(t->out);
+	if(fclose(t->out) != 0)
+		ok = 0;
+	if(!ok)
+		fprintf(stderr, "Can't write the trace\n");
+	free(t->blocks[0].data);
+	free(t->blocks[1].data);
+	free(t->packed);
+	free(t->index);
+	free(t);
+	m->trace = NULL;
+	return ok;
+}
+
+//Hash of the 4 bytes at p, for finding matches
+#define LZ_HASH_BITS (13)
+static uint32_t lzHash(const uint8_t *p){
+	uint32_t seq = (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+	return (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+//Writes a length's 255 continuation bytes
+static uint8_t *lzLength(uint8_t *op, size_t len){
+	for(; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = (uint8_t) len;
+	return op;
+}
+
+size_t lzPack(const uint8_t *src, size_t len, uint8_t *dst){
+	uint32_t table[1 << LZ_HASH_BITS];
+	size_t ip = 0, anchor = 0;
+	uint8_t *op = dst;
+	memset(table, 0, sizeof(table));
+	//matches start 12 bytes or more before the end and leave the last 5 as literals
+	while(len > 12 && ip < len - 12){
+		uint32_t h = lzHash(src + ip);
+		size_t ref = table[h], match;
+		table[h] = ip;
+		if(ref >= ip || ip - ref > 0xFFFF || memcmp(src + ref, src + ip, 4) != 0){
+			++ip;
+			continue;
+		}
+		for(match = 4; ip + match < len - 5 && src[ref + match] == src[ip + match]; ++match);
+		size_t literals = ip - anchor;
+		uint8_t *token = op++;
+		*token = (literals < 15 ? literals : 15) << 4 | (match - 4 < 15 ? match - 4 : 15);
+		if(literals >= 15)
+			op = lzLength(op, literals - 15);
+		memcpy(op, src + anchor, literals);
+		op += literals;
+		*op++ = (ip - ref) & 0xFF;
+		*op++ = (ip - ref) >> 8;
+		if(match - 4 >= 15)
+			op = lzLength(op, match - 4 - 15);
+		ip += match;
+		anchor = ip;
+	}
+	//the rest as literals
+	size_t literals = len - anchor;
+	*op++ = (literals < 15 ? literals : 15) << 4;
+	if(literals >= 15)
+		op = lzLength(op, literals - 15);
+	memcpy(op, src + anchor, literals);
+	op += literals;
+	return op - dst;
+}
+
+long lzUnpack(const uint8_t *src, size_t len, uint8_t *dst, size_t cap){
+	size_t ip = 0, op = 0;
+	while(ip < len){
+		uint8_t token = src[ip++], b;
+		size_t literals = token >> 4, match = (token & 15) + 4, offset;
+		if(literals == 15)
+			do{
+				if(ip >= len)
+					return -1;
+				literals += b = src[ip++];
+			}while(b == 255);
+		if(literals > len - ip || literals > cap - op)
+			return -1;
+		memcpy(dst + op, src + ip, literals);
+		ip += literals;
+		op += literals;
+		if(ip == len)	//the last sequence has no match
+			break;
+		if(len - ip < 2)
+			return -1;
+		offset = src[ip] | src[ip + 1] << 8;
+		ip += 2;
+		if(offset == 0 || offset > op)
+			return -1;
+		if((token & 15) == 15)
+			do{
+				if(ip >= len)
+					return -1;
+				match += b = src[ip++];
+			}while(b == 255);
+		if(match > cap - op)
+			return -1;
+		for(; match; --match, ++op)	//may overlap what it's copying
+			dst[op] = dst[op - offset];
+	}
+	return op;
+}
+
+void disassemble(int16_t ir, char *text, size_t size){
+	switch(OPCODE(ir)){
+		case ADD_OP:
+		case AND_OP:
+			if(IMMBIT(ir))
+				snprintf(text, size, "%s\tR%d\tR%d\t#%d", OPCODE(ir) == ADD_OP ? "ADD" : "AND", REG1(ir), REG2(ir), IMMVAL(ir));
+			else
+				snprintf(text, size, "%s\tR%d\tR%d\tR%d", OPCODE(ir) == ADD_OP ? "ADD" : "AND", REG1(ir), REG2(ir), REG3(ir));
+			break;
+		case NOT_OP:
+			snprintf(text, size, "NOT\tR%d\tR%d", REG1(ir), REG2(ir));
+			break;
+		case BR_OP:
+			snprintf(text, size, "BR%s%s%s\t#%d", BRN(ir) ? "n" : "", BRZ(ir) ? "z" : "", BRP(ir) ? "p" : "", PCOFFSET9(ir));
+			break;
+		case LD_OP: case LDI_OP: case ST_OP: case STI_OP: case LEA_OP:
+			snprintf(text, size, "%s\tR%d\t#%d", opcode_names[OPCODE(ir)], REG1(ir), PCOFFSET9(ir));
+			break;
+		case LDR_OP: case STR_OP:
+			snprintf(text, size, "%s\tR%d\tR%d\t#%d", opcode_names[OPCODE(ir)], REG1(ir), REG2(ir), PCOFFSET6(ir));
+			break;
+		case JSR_OP:
+			if(ir & 0x0800)
+				snprintf(text, size, "JSR\t#%d", PCOFFSET11(ir));
+			else
+				snprintf(text, size, "JSRR\tR%d", REG2(ir));
+			break;
+		case RTI_OP:
+			snprintf(text, size, "RTI");
+			break;
+		case RET_OP:
+			if(REG2(ir) == 7)
+				snprintf(text, size, "RET");
+			else
+				snprintf(text, size, "JMP\tR%d", REG2(ir));
+			break;
+		case TRAP_OP:
+			snprintf(text, size, "TRAP\tx%02X", TRPVECT8(ir));
+			break;
+		default:
+			snprintf(text, size, ".FILL\tx%04hX", (uint16_t) ir);
+	}
+}
+
+
+int step(machine *m){
+	if(m->cycles >= m->service_at){
+		serviceMachine(m);
+		if(m->fault)	//the interrupt's pushes faulted, its routine doesn't start
+			return 0;
+	}
+	m->ir = m->memory[m->pc]; //fetched the instruction
+	m->pc++; 
+	++m->cycles;
+
+	int16_t opcode = OPCODE(m->ir);
+
+	switch(opcode) {
+		case ADD_OP:  // add instruction
+			if(IMMBIT(m->ir)){ //ADD immediate
+				addImm(m);
+			}else{  //ADD two regs
+				addRegs(m);
+			}
+			break;
+		case AND_OP:
+			if(IMMBIT(m->ir)){ //ADD immediate
+				andImm(m);
+			}else{  //ADD two regs
+				andRegs(m);
+			}
+			break; 
+		case NOT_OP:
+			not(m);
+			break;
+		case LD_OP:
+			ld(m);
+			break;
+		case LDI_OP:
+			ldi(m);
+			break;
+		case LDR_OP:
+			ldr(m);
+			break;
+		case BR_OP:
+			br(m);
+			break;
+		case ST_OP:
+			st(m);
+			break;
+		case STI_OP:
+			sti(m);
+			break;
+		case STR_OP:
+			str(m);
+			break;
+		case LEA_OP:
+			lea(m);
+			break;
+		case JSR_OP:
+			jsr(m);
+			break;
+		case RET_OP:
+			ret(m);
+			break;
+		case RTI_OP:
+			rti(m);
+			break;
+		case TRAP_OP:
+			trap(m);
+			break;			
+		default:
+			illegalInstruction(m);
+			return 1;
+	} // switch ends
+	return 0;
+}
+
+void consolePut(machine *m, char c){
+	m->output.hash = (m->output.hash ^ (uint8_t) c) * FNV_PRIME;
+	if(m->output.expected && !m->output.differs && (m->output.bytes >= m->output.expected_len
+		|| m->output.expected[m->output.bytes] != (uint8_t) c)){
+		//a program whose output is wrong already isn't worth running on
+		m->output.differs = 1;
+		m->output.differs_at = m->output.bytes;
+		stopMachine(m, STATUS_MISMATCH);
+	}
+	++m->output.bytes;
+	m->console.buf[m->console.len++] = c;
+	if(c == '\n' || m->console.len == CONSOLE_BUF_SIZE || (m->flush_interval && m->cycles - m->console.flushed_at >= m->flush_interval))
+		consoleFlush(m);
+}
+
+void consoleFlush(machine *m){
+	if(m->console.len){
+		if(m->console.discard)
+			;
+		else if(m->console.capture){
+			size_t len = m->console.len;
+			if(m->console.capture_limit && len > m->console.capture_limit - m->console.captured)
+				len = m->console.capture_limit - m->console.captured;
+			consoleCapture(m, m->console.buf, len);
+			m->console.captured += len;
+		}else if(m->console.sink)
+			m->console.sink(m->console.sink_context, m->console.buf, m->console.len);
+		else{
+			fwrite(m->console.buf, 1, m->console.len, stdout);
+			fflush(stdout);
+		}
+		m->console.len = 0;
+	}
+	m->console.flushed_at = m->cycles;
+}
+
+void consoleCapture(machine *m, const char *bytes, size_t len){
+	if(m->console.out_len + len > m->console.out_cap){
+		size_t cap = m->console.out_cap ? m->console.out_cap : CONSOLE_BUF_SIZE;
+		while(cap < m->console.out_len + len)
+			cap *= 2;
+		m->console.out = realloc(m->console.out, cap);
+		if(m->console.out == NULL){
+			fprintf(stderr, "Out of memory capturing output\n");
+			exit(1);
+		}
+		m->console.out_cap = cap;
+	}
+	memcpy(m->console.out + m->console.out_len, bytes, len);
+	m->console.out_len += len;
+}
+
+void illegalInstruction(machine *m){
+	char message[80];
+	int len = snprintf(message, sizeof(message), "\nUnrecognized instruction /w opcode %"PRId16"\nPC = x%04hX\nExiting...",
+		(int16_t) OPCODE(m->ir), m->pc);
+	consoleFlush(m);
+	if(m->console.capture){
+		consoleCapture(m, message, len);
+		return;
+	}
+	if(m->console.sink){
+		m->console.sink(m->console.sink_context, message, len);
+		return;
+	}
+	fputs(message, stderr);
+}
+
+void decodeOp(decoded_op *op, int16_t instr){
+	op->raw = instr;
+	op->dr = REG1(instr);
+	op->sr1 = REG2(instr);
+	op->sr2 = REG3(instr);
+	op->imm = 0;
+	switch(OPCODE(instr)){
+		case ADD_OP:
+			op->kind = IMMBIT(instr) ? OPK_ADD_IMM : OPK_ADD_REG;
+			op->imm = IMMVAL(instr);
+			break;
+		case AND_OP:
+			op->kind = IMMBIT(instr) ? OPK_AND_IMM : OPK_AND_REG;
+			op->imm = IMMVAL(instr);
+			break;
+		case NOT_OP:
+			op->kind = OPK_NOT;
+			break;
+		case BR_OP:
+			op->kind = OPK_BR;
+			op->imm = PCOFFSET9(instr);
+			break;
+		case LD_OP:
+			op->kind = OPK_LD;
+			op->imm = PCOFFSET9(instr);
+			break;
+		case LDI_OP:
+			op->kind = OPK_LDI;
+			op->imm = PCOFFSET9(instr);
+			break;
+		case LDR_OP:
+			op->kind = OPK_LDR;
+			op->imm = PCOFFSET6(instr);
+			break;
+		case ST_OP:
+			op->kind = OPK_ST;
+			op->imm = PCOFFSET9(instr);
+			break;
+		case STI_OP:
+			op->kind = OPK_STI;
+			op->imm = PCOFFSET9(instr);
+			break;
+		case STR_OP:
+			op->kind = OPK_STR;
+			op->imm = PCOFFSET6(instr);
+			break;
+		case LEA_OP:
+			op->kind = OPK_LEA;
+			op->imm = PCOFFSET9(instr);
+			break;
+		case JSR_OP:
+			op->kind = instr & 0x0800 ? OPK_JSR : OPK_JSRR;
+			op->imm = PCOFFSET11(instr);
+			break;
+		case RET_OP:
+			op->kind = OPK_RET;
+			break;
+		case RTI_OP:
+			op->kind = OPK_RTI;
+			break;
+		case TRAP_OP:
+			op->kind = OPK_TRAP;
+			op->imm = TRPVECT8(instr);
+			break;
+		default:
+			op->kind = OPK_ILLEGAL;
+			break;
+	}
+}
+
+//Has the threaded engine decode the word at adress again before it runs it
+static ALWAYS_INLINE void redecode(machine *m, uint16_t adress){
+	m->decoded[adress].kind = OPK_DECODE;
+	if(m->threaded_labels)
+		m->decoded[adress].handler = m->threaded_labels[OPK_DECODE];
+}
+
+//redecode() of the words of a page, when some were decoded
+static void redecodePage(machine *m, int page){
+	int i;
+	if(m->decoded_pages[page]){
+		for(i = page << PAGE_SHIFT; i < (page + 1) << PAGE_SHIFT; ++i)
+			redecode(m, i);
+		m->decoded_pages[page] = 0;
+	}
+}
+
+//redecodePage() of the pages marked in dirty_pages, for the stores of native code, which only mark their page
+static void redecodeDirty(machine *m){
+	int page;
+	for(page = 0; page < PAGE_COUNT; ++page)
+		if(m->dirty_pages[page])
+			redecodePage(m, page);
+}
+
+//Threaded code: every handler ends by fetching the next predecoded op and jumping straight to its handler,
+//so there is no central dispatch loop and no decoding once a word has been executed.
+//Only stores can turn the machine off, so the MCR is only looked at after a store.
+#if USE_COMPUTED_GOTO
+#define TARGET(kind) case kind: L_##kind:
+#define DISPATCH() do{ \
+		if(m->cycles >= m->service_at){ \
+			if(m->cycles >= m->stop_at) \
+				goto halted; \
+			serviceMachine(m); \
+			if(m->fault) \
+				goto halted; \
+		} \
+		op = &m->decoded[m->pc++]; \
+		++m->cycles; \
+		goto *op->handler; \
+	}while(0)
+#else
+#define TARGET(kind) case kind:
+#define DISPATCH() continue
+#endif
+
+#define AFTER_STORE() do{ \
+		if(!MCR_POWER(m->mcr)) goto halted; \
+	}while(0)
+
+int runThreaded(machine *m){
+	decoded_op *op = NULL;	//the last op run, for IR
+	int i;
+#if USE_COMPUTED_GOTO
+	static const void *labels[OPK_COUNT] = {
+		&&L_OPK_DECODE, &&L_OPK_ADD_IMM, &&L_OPK_ADD_REG, &&L_OPK_AND_IMM, &&L_OPK_AND_REG,
+		&&L_OPK_NOT, &&L_OPK_BR, &&L_OPK_LD, &&L_OPK_LDI, &&L_OPK_LDR, &&L_OPK_ST, &&L_OPK_STI,
+		&&L_OPK_STR, &&L_OPK_LEA, &&L_OPK_JSR, &&L_OPK_RET, &&L_OPK_JSRR, &&L_OPK_RTI, &&L_OPK_TRAP, &&L_OPK_ILLEGAL,
+		&&L_OPK_BREAK
+	};
+	m->threaded_labels = labels;
+#endif
+	//Words are decoded lazily, on their first execution, and stay decoded for the next runs: stores redecode
+	//their word, markDirty() the pages written otherwise. The JIT's stores (the debugger runs both engines)
+	//are found from the pages written.
+	if(m->decoded_ready){
+		if(m->jit_enabled)
+			redecodeDirty(m);
+	}else{
+		for(i = 0; i < 65536; ++i){
+			m->decoded[i].kind = OPK_DECODE;
+#if USE_COMPUTED_GOTO
+			m->decoded[i].handler = labels[OPK_DECODE];
+#endif
+		}
+		m->decoded_ready = 1;
+	}
+	if(!MCR_POWER(m->mcr))
+		return 0;
+
+	if(m->cycles >= m->stop_at)
+		return 0;
+	for(;;){
+		if(m->cycles >= m->service_at){
+			if(m->cycles >= m->stop_at)
+				goto halted;
+			serviceMachine(m);
+			if(m->fault)	//the interrupt's pushes faulted, as in step()
+				goto halted;
+		}
+		op = &m->decoded[m->pc++];
+		++m->cycles;
+#if USE_COMPUTED_GOTO
+		goto *op->handler;
+#endif
+		switch(op->kind){
+			TARGET(OPK_DECODE)
+				--m->pc;
+				--m->cycles;	//counted again by the dispatch below
+				decodeOp(op, m->memory[m->pc]);
+				m->decoded_pages[m->pc >> PAGE_SHIFT] = 1;
+				if(m->gdb && m->gdb->breakpoints[m->pc])
+					op->kind = OPK_BREAK;
+#if USE_COMPUTED_GOTO
+				op->handler = labels[op->kind];
+#endif
+				DISPATCH();
+			TARGET(OPK_ADD_IMM)
+				m->regs[op->dr] = m->regs[op->sr1] + op->imm;
+				updatePSR_CC(m, m->regs[op->dr]);
+				DISPATCH();
+			TARGET(OPK_ADD_REG)
+				m->regs[op->dr] = m->regs[op->sr1] + m->regs[op->sr2];
+				updatePSR_CC(m, m->regs[op->dr]);
+				DISPATCH();
+			TARGET(OPK_AND_IMM)
+				m->regs[op->dr] = m->regs[op->sr1] & op->imm;
+				updatePSR_CC(m, m->regs[op->dr]);
+				DISPATCH();
+			TARGET(OPK_AND_REG)
+				m->regs[op->dr] = m->regs[op->sr1] & m->regs[op->sr2];
+				updatePSR_CC(m, m->regs[op->dr]);
+				DISPATCH();
+			TARGET(OPK_NOT)
+				m->regs[op->dr] = ~m->regs[op->sr1];
+				updatePSR_CC(m, m->regs[op->dr]);
+				DISPATCH();
+			TARGET(OPK_BR)
+				if(CC_BITS(m->cc_value) & op->dr)
+					m->pc += op->imm;
+				DISPATCH();
+			TARGET(OPK_LD)
+				m->regs[op->dr] = readMemory(m, m->pc + op->imm);
+				updatePSR_CC(m, m->regs[op->dr]);
+				DISPATCH();
+			TARGET(OPK_LDI)
+				m->regs[op->dr] = readMemory(m, readMemory(m, m->pc + op->imm));
+				updatePSR_CC(m, m->regs[op->dr]);
+				if(m->waiting)
+					skipPolling(m, m->pc - 1);
+				DISPATCH();
+			TARGET(OPK_LDR)
+				m->regs[op->dr] = readMemory(m, m->regs[op->sr1] + op->imm);
+				updatePSR_CC(m, m->regs[op->dr]);
+				DISPATCH();
+			TARGET(OPK_ST)
+				writeMemory(m, m->pc + op->imm, m->regs[op->dr]);
+				AFTER_STORE();
+				DISPATCH();
+			TARGET(OPK_STI)
+				writeMemory(m, readMemory(m, m->pc + op->imm), m->regs[op->dr]);
+				AFTER_STORE();
+				DISPATCH();
+			TARGET(OPK_STR)
+				writeMemory(m, m->regs[op->sr1] + op->imm, m->regs[op->dr]);
+				AFTER_STORE();
+				DISPATCH();
+			TARGET(OPK_LEA)
+				m->regs[op->dr] = m->pc + op->imm;
+				updatePSR_CC(m, m->regs[op->dr]);
+				DISPATCH();
+			TARGET(OPK_JSR)
+				m->regs[7] = m->pc;
+				m->pc += op->imm;
+				DISPATCH();
+			TARGET(OPK_RET)
+				m->pc = m->regs[op->sr1];
+				DISPATCH();
+			TARGET(OPK_JSRR){
+				uint16_t target = m->regs[op->sr1];
+				m->regs[7] = m->pc;
+				m->pc = target;
+				DISPATCH();
+			}
+			TARGET(OPK_RTI)
+				m->ir = op->raw;
+				rti(m);
+				AFTER_STORE();	//the exception for user mode pushes on the stack
+				DISPATCH();
+			TARGET(OPK_TRAP)
+				m->regs[7] = m->pc;
+				if(!fastTrap(m, op->imm))
+					m->pc = m->memory[op->imm];
+				else if(!MCR_POWER(m->mcr))
+					goto halted;
+				DISPATCH();
+			TARGET(OPK_ILLEGAL)
+				m->ir = op->raw;
+				illegalInstruction(m);
+				return 1;
+			TARGET(OPK_BREAK)
+				--m->pc;
+				--m->cycles;	//the debugger steps over it when it goes on
+				m->gdb->stop = GDB_STOP_BREAK;
+				return 0;
+		}
+	}
+halted:
+	if(op)
+		m->ir = op->raw;
+	return 0;
+}
+
+#undef TARGET
+#undef DISPATCH
+#undef AHEAD
+#undef AFTER_LOAD
+#undef AFTER_STORE
+
+//Block engine: a block runs its ops back to back and only the op ending it sets the PC,
+//then the next block is looked up by entry PC (built on a miss).
+#if USE_COMPUTED_GOTO
+#define TARGET(kind) case kind: L_##kind:
+#define NEXT_OP() do{ ++op; goto *op->handler; }while(0)
+#else
+#define TARGET(kind) case kind:
+#define NEXT_OP() do{ ++op; goto dispatch; }while(0)
+#endif
+
+#define BRANCH(op) (m->pc = (CC_BITS(m->cc_value) & (op)->mask) ? (op)->target : (op)->next_pc)
+
+//A store ends the block early when it turned the machine off, rewrote cached code or made the machine need
+//servicing before the block's end (pc and last_ir are already set). The block's instructions were all counted
+//when it was entered, the ones after the store are taken back (using end_pc, the store may have freed the block).
+#define AFTER_STORE() do{ \
+		if(!MCR_POWER(m->mcr)){ \
+			m->cycles -= (uint16_t) (end_pc - m->pc); \
+			goto halted; \
+		} \
+		if(m->code_invalidated || m->service_at < m->cycles){ \
+			m->code_invalidated = 0; \
+			m->cycles -= (uint16_t) (end_pc - m->pc); \
+			goto next_block; \
+		} \
+	}while(0)
+
+//Reading a device can make an interrupt pending (the keyboard's next key), a load ends the block early then
+#define AFTER_LOAD(op) do{ \
+		if(m->service_at < m->cycles){ \
+			m->pc = (op)->next_pc; \
+			m->cycles -= (uint16_t) (end_pc - m->pc); \
+			last_ir = (op)->raw; \
+			goto next_block; \
+		} \
+	}while(0)
+
+//Instructions of the block after op, counted already
+#define AHEAD(op) ((uint16_t) (end_pc - (op)->next_pc))
+
+//Memory accesses of the block engine. A device sees the cycle of the instruction accessing it (ahead cycles
+//before the block's end), so the cycle count is wound back around device accesses.
+static ALWAYS_INLINE int16_t blockRead(machine *m, uint16_t adress, uint16_t ahead){
+	int16_t val;
+	if(adress < IO_SPACE_START)
+		return m->memory[adress];
+	m->cycles -= ahead;
+	val = readMemory(m, adress);
+	m->cycles += ahead;
+	return val;
+}
+
+static ALWAYS_INLINE void blockWrite(machine *m, uint16_t adress, int16_t val, uint16_t ahead){
+	if(adress < IO_SPACE_START){
+		writeMemory(m, adress, val);
+		return;
+	}
+	m->cycles -= ahead;
+	writeMemory(m, adress, val);
+	m->cycles += ahead;
+}
+
+static void blockSkipPolling(machine *m, uint16_t pc, uint16_t ahead){
+	m->cycles -= ahead;
+	skipPolling(m, pc);
+	m->cycles += ahead;
+}
+
+int runBlocks(machine *m){
+	block *b;
+	block_op *op;
+	uint16_t end_pc;
+	int16_t last_ir = m->ir;
+	jit_state js;
+#if USE_COMPUTED_GOTO
+	static const void *labels[OPK_BLOCK_COUNT] = {
+		NULL, &&L_OPK_ADD_IMM, &&L_OPK_ADD_REG, &&L_OPK_AND_IMM, &&L_OPK_AND_REG,
+		&&L_OPK_NOT, &&L_OPK_BR, &&L_OPK_LD, &&L_OPK_LDI, &&L_OPK_LDR, &&L_OPK_ST, &&L_OPK_STI,
+		&&L_OPK_STR, &&L_OPK_LEA, &&L_OPK_JSR, &&L_OPK_RET, &&L_OPK_JSRR, &&L_OPK_RTI, &&L_OPK_TRAP, &&L_OPK_ILLEGAL,
+		&&L_OPK_BREAK, &&L_OPK_FALLTHROUGH, &&L_OPK_LD_BR, &&L_OPK_LDI_BR, &&L_OPK_ADD_BR, &&L_OPK_CLEAR_ADD
+	};
+#else
+	static const void *const *labels = NULL;
+#endif
+	//Blocks (and their native code) are kept from one run to the next: stores into them, the pages written
+	//otherwise (markDirty()) and init() drop them.
+	memset(&m->block_stats, 0, sizeof(m->block_stats));
+	memset(&m->jit_stats, 0, sizeof(m->jit_stats));
+	m->code_invalidated = 0;
+	js.regs = m->regs;
+	js.memory = m->memory;
+	js.code_map = m->code_map;
+	if(m->prewarm){
+		int i;
+		for(i = 0; i < m->cfg->count; ++i){
+			uint16_t start = m->cfg->blocks[i].start;
+			if((b = m->block_map[start]) == NULL)
+				b = buildBlock(m, start, labels);
+			if(m->jit_enabled && b->native == NULL && !m->jit_flush_pending)
+				jitCompile(m, b);
+		}
+	}
+
+	while(MCR_POWER(m->mcr)){
+		if(m->cycles >= m->service_at){
+			if(m->cycles >= m->stop_at)
+				break;
+			serviceMachine(m);
+			m->code_invalidated = 0;
+			if(m->fault)	//the interrupt's pushes faulted, as in step()
+				break;
+		}
+		if(m->jit_flush_pending){
+			flushBlocks(m);
+			jitInit(m);
+			m->jit_flush_pending = 0;
+			++m->jit_stats.flushes;
+		}
+		b = m->block_map[m->pc];
+		if(b){
+			++m->block_stats.hits;
+		}else{
+			++m->block_stats.misses;
+			b = buildBlock(m, m->pc, labels);
+		}
+		if(m->cycles + b->length > m->service_at && b->ops[0].kind != OPK_BREAK){
+			//The machine needs servicing before the block's end, run it an instruction at a time
+			if(step(m))
+				return 1;
+			last_ir = m->ir;
+			m->code_invalidated = 0;
+			continue;
+		}
+		if(m->jit_enabled){
+			if(b->native == NULL && ++b->exec_count == JIT_THRESHOLD)
+				jitCompile(m, b);
+			if(b->native){
+				js.cc = m->cc_value;
+				m->pc = b->native(&js);
+				m->cc_value = js.cc;
+				++m->jit_stats.native_runs;
+				m->jit_stats.native_instructions += js.executed;
+				m->cycles += js.executed;
+				last_ir = m->memory[(uint16_t) (b->end_pc - 1)];
+				if(js.side_exit){
+					//The next instruction needs the interpreter (device access, store into cached code)
+					++m->jit_stats.side_exits;
+					if(step(m))
+						return 1;
+					last_ir = m->ir;
+					m->code_invalidated = 0;
+				}
+				continue;
+			}
+		}
+		m->cycles += b->length;
+		end_pc = b->end_pc;
+		op = b->ops;
+#if USE_COMPUTED_GOTO
+		goto *op->handler;
+#else
+dispatch:
+#endif
+		switch(op->kind){
+			TARGET(OPK_ADD_IMM)
+				m->regs[op->dr] = m->regs[op->sr1] + op->imm;
+				updatePSR_CC(m, m->regs[op->dr]);
+				NEXT_OP();
+			TARGET(OPK_ADD_REG)
+				m->regs[op->dr] = m->regs[op->sr1] + m->regs[op->sr2];
+				updatePSR_CC(m, m->regs[op->dr]);
+				NEXT_OP();
+			TARGET(OPK_AND_IMM)
+				m->regs[op->dr] = m->regs[op->sr1] & op->imm;
+				updatePSR_CC(m, m->regs[op->dr]);
+				NEXT_OP();
+			TARGET(OPK_AND_REG)
+				m->regs[op->dr] = m->regs[op->sr1] & m->regs[op->sr2];
+				updatePSR_CC(m, m->regs[op->dr]);
+				NEXT_OP();
+			TARGET(OPK_NOT)
+				m->regs[op->dr] = ~m->regs[op->sr1];
+				updatePSR_CC(m, m->regs[op->dr]);
+				NEXT_OP();
+			TARGET(OPK_LD)
+				m->regs[op->dr] = blockRead(m, op->adress, AHEAD(op));
+				updatePSR_CC(m, m->regs[op->dr]);
+				AFTER_LOAD(op);
+				NEXT_OP();
+			TARGET(OPK_LDI)
+				m->regs[op->dr] = blockRead(m, blockRead(m, op->adress, AHEAD(op)), AHEAD(op));
+				updatePSR_CC(m, m->regs[op->dr]);
+				if(m->waiting)
+					blockSkipPolling(m, op->next_pc - 1, AHEAD(op));
+				AFTER_LOAD(op);
+				NEXT_OP();
+			TARGET(OPK_LDR)
+				m->regs[op->dr] = blockRead(m, m->regs[op->sr1] + op->imm, AHEAD(op));
+				updatePSR_CC(m, m->regs[op->dr]);
+				AFTER_LOAD(op);
+				NEXT_OP();
+			TARGET(OPK_ST)
+				m->pc = op->next_pc;
+				last_ir = op->raw;
+				blockWrite(m, op->adress, m->regs[op->dr], AHEAD(op));
+				AFTER_STORE();
+				NEXT_OP();
+			TARGET(OPK_STI)
+				m->pc = op->next_pc;
+				last_ir = op->raw;
+				blockWrite(m, blockRead(m, op->adress, AHEAD(op)), m->regs[op->dr], AHEAD(op));
+				AFTER_STORE();
+				NEXT_OP();
+			TARGET(OPK_STR)
+				m->pc = op->next_pc;
+				last_ir = op->raw;
+				blockWrite(m, m->regs[op->sr1] + op->imm, m->regs[op->dr], AHEAD(op));
+				AFTER_STORE();
+				NEXT_OP();
+			TARGET(OPK_LEA)
+				m->regs[op->dr] = op->adress;
+				updatePSR_CC(m, m->regs[op->dr]);
+				NEXT_OP();
+			TARGET(OPK_CLEAR_ADD)
+				m->regs[op->dr] = op->imm;
+				updatePSR_CC(m, m->regs[op->dr]);
+				NEXT_OP();
+			TARGET(OPK_BR)
+				BRANCH(op);
+				break;
+			TARGET(OPK_LD_BR)
+				m->regs[op->dr] = blockRead(m, op->adress, AHEAD(op) + 1);
+				updatePSR_CC(m, m->regs[op->dr]);
+				BRANCH(op);
+				break;
+			TARGET(OPK_LDI_BR)
+				m->regs[op->dr] = blockRead(m, blockRead(m, op->adress, AHEAD(op) + 1), AHEAD(op) + 1);
+				updatePSR_CC(m, m->regs[op->dr]);
+				if(m->waiting)
+					blockSkipPolling(m, op->next_pc - 2, AHEAD(op) + 1);
+				BRANCH(op);
+				break;
+			TARGET(OPK_ADD_BR)
+				m->regs[op->dr] = m->regs[op->sr1] + op->imm;
+				updatePSR_CC(m, m->regs[op->dr]);
+				BRANCH(op);
+				break;
+			TARGET(OPK_JSR)
+				m->regs[7] = op->next_pc;
+				m->pc = op->target;
+				break;
+			TARGET(OPK_RET)
+				m->pc = m->regs[op->sr1];
+				break;
+			TARGET(OPK_JSRR)
+				m->pc = m->regs[op->sr1];
+				m->regs[7] = op->next_pc;
+				break;
+			TARGET(OPK_RTI)
+				m->ir = op->raw;
+				m->pc = op->next_pc;
+				rti(m);
+				break;
+			TARGET(OPK_TRAP)
+				m->regs[7] = op->next_pc;
+				m->pc = fastTrap(m, op->imm) ? op->next_pc : m->memory[op->imm];
+				break;
+			TARGET(OPK_FALLTHROUGH)
+				m->pc = op->next_pc;
+				break;
+			TARGET(OPK_ILLEGAL)
+				m->ir = op->raw;
+				m->pc = op->next_pc;
+				illegalInstruction(m);
+				return 1;
+			TARGET(OPK_BREAK)
+				--m->cycles;	//the debugger steps over it when it goes on
+				m->gdb->stop = GDB_STOP_BREAK;
+				m->ir = last_ir;
+				return 0;
+		}
+		last_ir = m->memory[(uint16_t) (end_pc - 1)];	//the last instruction, also of a superinstruction
+next_block:
+		;
+	}
+	m->ir = last_ir;
+	return 0;
+halted:
+	m->ir = op->raw;
+	return 0;
+}
+
+#undef TARGET
+#undef NEXT_OP
+#undef BRANCH
+#undef AFTER_STORE
+
+//Copies the decoded instruction at adress pc into a block op.
+static void blockOpFrom(block_op *bop, const decoded_op *d, uint16_t pc){
+	bop->kind = d->kind;
+	bop->dr = d->dr;
+	bop->sr1 = d->sr1;
+	bop->sr2 = d->sr2;
+	bop->mask = d->dr;
+	bop->imm = d->imm;
+	bop->raw = d->raw;
+	bop->next_pc = pc + 1;
+	bop->adress = pc + 1 + d->imm;
+	bop->target = pc + 1 + d->imm;
+}
+
+block *buildBlock(machine *m, uint16_t start, const void *const *labels){
+	decoded_op d[BLOCK_MAX_INSTRS];
+	int n = 0, i, ops = 0;
+	uint16_t adress = start;
+	int ends_block = 0;
+	block *b;
+
+	//Straight-line run up to (and including) the first control transfer. A breakpoint (--gdb) ends the block
+	//before it, a block starting at one is just the breakpoint.
+	while(n < BLOCK_MAX_INSTRS && !ends_block){
+		if(m->gdb && m->gdb->breakpoints[adress] && n > 0)
+			break;
+		decodeOp(&d[n], m->memory[adress]);
+		if(m->gdb && m->gdb->breakpoints[adress])
+			d[n].kind = OPK_BREAK;
+		switch(d[n].kind){
+			case OPK_BR: case OPK_JSR: case OPK_RET: case OPK_JSRR: case OPK_RTI: case OPK_TRAP: case OPK_ILLEGAL: case OPK_BREAK:
+				ends_block = 1;
+				break;
+		}
+		++n;
+		++adress;
+		if(adress == 0) //don't wrap around the adress space
+			break;
+	}
+
+	b = malloc(sizeof(block) + (n + 1) * sizeof(block_op));
+	if(b == NULL){
+		fprintf(stderr, "Out of memory building block at x%04hX\n", start);
+		exit(1);
+	}
+	b->start_pc = start;
+	b->end_pc = adress;
+	b->length = n;
+	b->exec_count = 0;
+	b->native = NULL;
+
+	for(i = 0; i < n; ++i){
+		uint16_t pc = start + i;
+		block_op *bop = &b->ops[ops++];
+		blockOpFrom(bop, &d[i], pc);
+		if(i + 1 >= n)
+			continue;
+
+		//Superinstructions
+		if(d[i + 1].kind == OPK_BR && (d[i].kind == OPK_LD || d[i].kind == OPK_LDI || d[i].kind == OPK_ADD_IMM)){
+			bop->kind = d[i].kind == OPK_LD ? OPK_LD_BR : d[i].kind == OPK_LDI ? OPK_LDI_BR : OPK_ADD_BR;
+			bop->mask = d[i + 1].dr;
+			bop->target = pc + 2 + d[i + 1].imm;
+			bop->next_pc = pc + 2;
+			++i;
+			++m->block_stats.fused;
+		}else if(d[i].kind == OPK_AND_IMM && d[i].imm == 0 && d[i].dr == d[i].sr1
+				&& d[i + 1].kind == OPK_ADD_IMM && d[i + 1].dr == d[i].dr && d[i + 1].sr1 == d[i].dr){
+			bop->kind = OPK_CLEAR_ADD;
+			bop->imm = d[i + 1].imm;
+			bop->next_pc = pc + 2;
+			++i;
+			++m->block_stats.fused;
+		}
+	}
+	if(!ends_block){
+		block_op *bop = &b->ops[ops++];
+		memset(bop, 0, sizeof(*bop));
+		bop->kind = OPK_FALLTHROUGH;
+		bop->next_pc = adress;
+	}
+	b->op_count = ops;
+#if USE_COMPUTED_GOTO
+	for(i = 0; i < ops; ++i)
+		b->ops[i].handler = labels[b->ops[i].kind];
+#else
+	(void) labels;
+#endif
+
+	m->block_map[start] = b;
+	b->page_next = m->page_blocks[start >> 8];
+	m->page_blocks[start >> 8] = b;
+	for(i = 0; i < n; ++i)
+		++m->code_map[(uint16_t) (start + i)];
+	return b;
+}
+
+//Unlinks and frees b, which starts in the page given.
+static void freeBlock(machine *m, block *b, int page){
+	block **link = &m->page_blocks[page];
+	int i;
+	while(*link != b)
+		link = &(*link)->page_next;
+	*link = b->page_next;
+	m->block_map[b->start_pc] = NULL;
+	for(i = 0; i < b->length; ++i)
+		--m->code_map[(uint16_t) (b->start_pc + i)];
+	free(b);
+}
+
+void invalidateBlocks(machine *m, uint16_t adress){
+	//Blocks are shorter than a page, so a block containing adress starts in its page or the previous one.
+	int pages[2] = { adress >> 8, ((adress >> 8) - 1) & 0xFF }, i;
+	for(i = 0; i < 2; ++i){
+		block *b = m->page_blocks[pages[i]], *next;
+		for(; b; b = next){
+			next = b->page_next;
+			if((uint16_t) (adress - b->start_pc) < b->length){
+				freeBlock(m, b, pages[i]);
+				++m->block_stats.invalidations;
+			}
+		}
+	}
+	m->code_invalidated = 1;
+}
+
+void invalidatePage(machine *m, int page){
+	//the blocks starting in the page, and the ones of the page before that run into it
+	int pages[2] = { page, (page - 1) & 0xFF }, i;
+	for(i = 0; i < 2; ++i){
+		block *b = m->page_blocks[pages[i]], *next;
+		for(; b; b = next){
+			next = b->page_next;
+			if(i == 0 || (uint16_t) (b->start_pc + b->length - 1) >> 8 == page){
+				freeBlock(m, b, pages[i]);
+				++m->block_stats.invalidations;
+			}
+		}
+	}
+}
+
+void flushBlocks(machine *m){
+	int page;
+	for(page = 0; page < 256; ++page)
+		while(m->page_blocks[page])
+			freeBlock(m, m->page_blocks[page], page);
+}
+
+void forgetCode(machine *m){
+	int page;
+	for(page = 0; page < PAGE_COUNT; ++page)
+		redecodePage(m, page);
+	flushBlocks(m);
+	if(m->jit_arena)
+		jitInit(m);	//the native code of the blocks flushed is dropped with them
+}
+
+void printBlockStats(machine *m){
+	fprintf(stderr, "Block cache: %llu hits, %llu misses, %llu invalidations, %llu superinstructions built\n",
+		m->block_stats.hits, m->block_stats.misses, m->block_stats.invalidations, m->block_stats.fused);
+	if(m->jit_enabled)
+		fprintf(stderr, "JIT: %llu blocks compiled, %llu native runs (%llu instructions), %llu side exits, %llu code flushes\n",
+			m->jit_stats.compiled, m->jit_stats.native_runs, m->jit_stats.native_instructions, m->jit_stats.side_exits, m->jit_stats.flushes);
+}
+
+#if HAVE_JIT
+//x86-64 JIT for hot blocks.
+//LC3 registers R0-R7 live in r8w-r15w for the whole block, rbx holds the memory base, rbp code_map and
+//rdi the jit_state. Condition codes are never computed in native code: the compiler tracks which register
+//holds the last CC value, BR tests that register and the exits store it to jit_state.cc.
+//Native code never touches the memory mapped page or a word of cached code, it leaves the block
+//(a side exit) right before any instruction that would, and the interpreter runs that instruction.
+
+#define JIT_ARENA_SIZE (8 << 20)
+#define JIT_MAX_BLOCK_CODE (16 << 10)	//worst case code size for one block, exit stubs included
+#define HR(r) (8 + (r))			//host register holding LC3 register r
+
+//Exit of a native block not yet emitted: rel32 fields jumping to it and the state to write back there.
+typedef struct {
+	uint8_t *patch[2];
+	int patches;
+	uint16_t pc;
+	uint8_t pc_in_eax;	//next PC computed at run time (RET, TRAP)
+	uint8_t written;	//registers written so far (bit mask)
+	int8_t cc_reg;		//register holding the CC value, -1 when jit_state.cc is still current
+	uint8_t side_exit;
+	uint16_t executed;
+} jit_exit;
+
+typedef struct {
+	uint8_t *p;
+	jit_exit exits[2 * BLOCK_MAX_INSTRS + 2];
+	int exit_count;
+} jit_emitter;
+
+static void emit8(jit_emitter *e, uint8_t b){ *e->p++ = b; }
+static void emit16(jit_emitter *e, uint16_t v){ memcpy(e->p, &v, 2); e->p += 2; }
+static void emit32(jit_emitter *e, uint32_t v){ memcpy(e->p, &v, 4); e->p += 4; }
+
+//REX prefix for a 16/32 bit operation, only emitted when one of the registers is r8-r15
+static void emitRex(jit_emitter *e, int reg, int rm){
+	if(reg >= 8 || rm >= 8)
+		emit8(e, 0x40 | ((reg >> 3) << 2) | (rm >> 3));
+}
+
+//16 bit register/register operation: 66 [REX] opc modrm(11, reg, rm)
+static void emitRR16(jit_emitter *e, uint8_t opc, int reg, int rm){
+	emit8(e, 0x66);
+	emitRex(e, reg, rm);
+	emit8(e, opc);
+	emit8(e, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+//16 bit operation between a register and [base + disp8], base being one of rax, rcx, rdi
+static void emitBaseDisp8_16(jit_emitter *e, uint8_t opc, int reg, int base, int8_t disp){
+	emit8(e, 0x66);
+	emitRex(e, reg, 0);
+	emit8(e, opc);
+	emit8(e, 0x40 | ((reg & 7) << 3) | base);
+	emit8(e, (uint8_t) disp);
+}
+
+//16 bit operation between a register and the LC3 word at a constant adress, [rbx + adress * 2]
+static void emitWord16(jit_emitter *e, uint8_t opc, int reg, uint16_t adress){
+	emit8(e, 0x66);
+	emitRex(e, reg, 0);
+	emit8(e, opc);
+	emit8(e, 0x80 | ((reg & 7) << 3) | 3);
+	emit32(e, (uint32_t) adress * 2);
+}
+
+//16 bit operation between a register and the LC3 word at the adress in eax, [rbx + rax * 2]
+static void emitWordAtEax16(jit_emitter *e, uint8_t opc, int reg){
+	emit8(e, 0x66);
+	emitRex(e, reg, 0);
+	emit8(e, opc);
+	emit8(e, 0x04 | ((reg & 7) << 3));
+	emit8(e, 0x43);
+}
+
+//Conditional (or, for cc == 0, unconditional) jump to an exit, patched when the exit is emitted
+static void emitJumpToExit(jit_emitter *e, uint8_t cc, jit_exit *x){
+	if(cc){
+		emit8(e, 0x0F);
+		emit8(e, cc);
+	}else
+		emit8(e, 0xE9);
+	x->patch[x->patches++] = e->p;
+	emit32(e, 0);
+}
+
+static jit_exit *newExit(jit_emitter *e, uint16_t pc, uint8_t written, int cc_reg, int side_exit, int executed){
+	jit_exit *x = &e->exits[e->exit_count++];
+	x->patches = 0;
+	x->pc = pc;
+	x->pc_in_eax = 0;
+	x->written = written;
+	x->cc_reg = cc_reg;
+	x->side_exit = side_exit;
+	x->executed = executed;
+	return x;
+}
+
+//Writes the registers and CC back to the jit_state, then returns the next PC
+static void emitExit(jit_emitter *e, jit_exit *x){
+	int i;
+	for(i = 0; i < x->patches; ++i){
+		int32_t rel = (int32_t) (e->p - (x->patch[i] + 4));
+		memcpy(x->patch[i], &rel, 4);
+	}
+	if(x->written){
+		emit8(e, 0x48); emit8(e, 0x8B); emit8(e, 0x4F); emit8(e, offsetof(jit_state, regs));	//mov rcx, [rdi+regs]
+		for(i = 0; i < REG_COUNT; ++i)
+			if(x->written & (1 << i))
+				emitBaseDisp8_16(e, 0x89, HR(i), 1, 2 * i);	//mov [rcx+2i], Ri
+	}
+	if(x->cc_reg >= 0)
+		emitBaseDisp8_16(e, 0x89, HR(x->cc_reg), 7, offsetof(jit_state, cc));	//mov [rdi+cc], Rcc
+	emit8(e, 0xC6); emit8(e, 0x47); emit8(e, offsetof(jit_state, side_exit)); emit8(e, x->side_exit);
+	emit8(e, 0xC7); emit8(e, 0x47); emit8(e, offsetof(jit_state, executed)); emit32(e, x->executed);
+	if(!x->pc_in_eax){
+		emit8(e, 0xB8);	//mov eax, pc
+		emit32(e, x->pc);
+	}
+	emit8(e, 0x41); emit8(e, 0x5F);	//pop r15
+	emit8(e, 0x41); emit8(e, 0x5E);	//pop r14
+	emit8(e, 0x41); emit8(e, 0x5D);	//pop r13
+	emit8(e, 0x41); emit8(e, 0x5C);	//pop r12
+	emit8(e, 0x5D);			//pop rbp
+	emit8(e, 0x5B);			//pop rbx
+	emit8(e, 0xC3);			//ret
+}
+
+//Sets the flags from the current CC value: test Rcc, Rcc or cmp word [rdi+cc], 0
+static void emitTestCC(jit_emitter *e, int cc_reg){
+	if(cc_reg >= 0)
+		emitRR16(e, 0x85, HR(cc_reg), HR(cc_reg));
+	else{
+		emit8(e, 0x66); emit8(e, 0x83); emit8(e, 0x7F); emit8(e, offsetof(jit_state, cc)); emit8(e, 0x00);
+	}
+}
+
+//eax = (uint16_t) (Rbase + offset)
+static void emitEffectiveAdress(jit_emitter *e, int base_reg, int16_t offset){
+	emit8(e, 0x41); emit8(e, 0x8B); emit8(e, 0xC0 | base_reg);	//mov eax, Rbase (32 bit)
+	emit8(e, 0x05); emit32(e, (uint32_t) (int32_t) offset);		//add eax, offset
+	emit8(e, 0x0F); emit8(e, 0xB7); emit8(e, 0xC0);			//movzx eax, ax
+}
+
+//Jumps to x when the adress in eax is in the memory mapped page
+static void emitCheckIO(jit_emitter *e, jit_exit *x){
+	emit8(e, 0x3D); emit32(e, IO_SPACE_START);	//cmp eax, xFE00
+	emitJumpToExit(e, 0x83, x);		//jae
+}
+
+//Jumps to x when the adress in eax holds cached code
+static void emitCheckCode(jit_emitter *e, jit_exit *x){
+	emit8(e, 0x80); emit8(e, 0x7C); emit8(e, 0x05); emit8(e, 0x00); emit8(e, 0x00);	//cmp byte [rbp+rax], 0
+	emitJumpToExit(e, 0x85, x);	//jne
+}
+
+//Offset of the machine's dirty_pages from its code_map, which rbp points to
+#define DIRTY_OFFSET ((uint32_t) (offsetof(machine, dirty_pages) - offsetof(machine, code_map)))
+
+//Marks the page of the adress in eax as written: shr eax, 8; mov byte [rbp+rax+dirty], 1
+static void emitMarkDirty(jit_emitter *e){
+	emit8(e, 0xC1); emit8(e, 0xE8); emit8(e, PAGE_SHIFT);
+	emit8(e, 0xC6); emit8(e, 0x84); emit8(e, 0x05); emit32(e, DIRTY_OFFSET); emit8(e, 0x01);
+}
+
+//jcc opcode (second byte) taken for a BR nzp mask after emitTestCC(), 0 for always and 1 for never
+static uint8_t branchCondition(int mask){
+	static const uint8_t conditions[8] = {
+		1,	//---: never
+		0x8F,	//--p: jg
+		0x84,	//-z-: je
+		0x8D,	//-zp: jge
+		0x8C,	//n--: jl
+		0x85,	//n-p: jne
+		0x8E,	//nz-: jle
+		0	//nzp: always
+	};
+	return conditions[mask & 7];
+}
+
+int jitCompile(machine *m, block *b){
+	jit_emitter e;
+	decoded_op d[BLOCK_MAX_INSTRS];
+	uint8_t *code = m->jit_arena_pos;
+	uint8_t read = 0, written = 0;
+	int cc_reg = -1, i, n = b->length, done = 0;
+
+	if(m->jit_arena == NULL || b->ops[0].kind == OPK_BREAK)
+		return 0;
+	if(m->jit_arena + JIT_ARENA_SIZE - m->jit_arena_pos < JIT_MAX_BLOCK_CODE){
+		m->jit_flush_pending = 1;
+		return 0;
+	}
+	for(i = 0; i < n; ++i){
+		decodeOp(&d[i], m->memory[(uint16_t) (b->start_pc + i)]);
+		switch(d[i].kind){
+			case OPK_ADD_REG: case OPK_AND_REG:
+				read |= 1 << d[i].sr2;
+			/* fall through */
+			case OPK_ADD_IMM: case OPK_AND_IMM: case OPK_NOT: case OPK_LDR:
+				read |= 1 << d[i].sr1;
+				break;
+			case OPK_STR:
+				read |= 1 << d[i].sr1;
+			/* fall through */
+			case OPK_ST: case OPK_STI:
+				read |= 1 << d[i].dr;
+				break;
+			case OPK_RET:
+				read |= 1 << d[i].sr1;
+				break;
+		}
+	}
+
+	e.p = code;
+	e.exit_count = 0;
+	emit8(&e, 0x53);			//push rbx
+	emit8(&e, 0x55);			//push rbp
+	emit8(&e, 0x41); emit8(&e, 0x54);	//push r12
+	emit8(&e, 0x41); emit8(&e, 0x55);	//push r13
+	emit8(&e, 0x41); emit8(&e, 0x56);	//push r14
+	emit8(&e, 0x41); emit8(&e, 0x57);	//push r15
+	emit8(&e, 0x48); emit8(&e, 0x8B); emit8(&e, 0x5F); emit8(&e, offsetof(jit_state, memory));	//mov rbx, [rdi+memory]
+	emit8(&e, 0x48); emit8(&e, 0x8B); emit8(&e, 0x6F); emit8(&e, offsetof(jit_state, code_map));	//mov rbp, [rdi+code_map]
+	emit8(&e, 0x48); emit8(&e, 0x8B); emit8(&e, 0x47); emit8(&e, offsetof(jit_state, regs));	//mov rax, [rdi+regs]
+	for(i = 0; i < REG_COUNT; ++i)
+		if(read & (1 << i))
+			emitBaseDisp8_16(&e, 0x8B, HR(i), 0, 2 * i);	//mov Ri, [rax+2i]
+
+	for(i = 0; i < n && !done; ++i){
+		const decoded_op *op = &d[i];
+		uint16_t pc = b->start_pc + i, next_pc = pc + 1, adress = next_pc + op->imm;
+		int dr = op->dr, sr1 = op->sr1, sr2 = op->sr2;
+		jit_exit *side = NULL;
+
+		switch(op->kind){
+			case OPK_ADD_IMM: case OPK_AND_IMM:
+				if(dr != sr1)
+					emitRR16(&e, 0x89, HR(sr1), HR(dr));
+				emitRR16(&e, 0x83, op->kind == OPK_ADD_IMM ? 0 : 4, HR(dr));	//add/and Rd, imm8
+				emit8(&e, (uint8_t) op->imm);
+				break;
+			case OPK_ADD_REG: case OPK_AND_REG:{
+				uint8_t opc = op->kind == OPK_ADD_REG ? 0x01 : 0x21;
+				if(dr == sr1)
+					emitRR16(&e, opc, HR(sr2), HR(dr));
+				else if(dr == sr2)
+					emitRR16(&e, opc, HR(sr1), HR(dr));
+				else{
+					emitRR16(&e, 0x89, HR(sr1), HR(dr));
+					emitRR16(&e, opc, HR(sr2), HR(dr));
+				}
+				break;
+			}
+			case OPK_NOT:
+				if(dr != sr1)
+					emitRR16(&e, 0x89, HR(sr1), HR(dr));
+				emitRR16(&e, 0xF7, 2, HR(dr));	//not Rd
+				break;
+			case OPK_LEA:
+				emit8(&e, 0x66); emit8(&e, 0x41); emit8(&e, 0xB8 | dr); emit16(&e, adress);	//mov Rd, imm16
+				break;
+			case OPK_LD:
+				if(adress >= IO_SPACE_START)
+					goto side_exit;
+				emitWord16(&e, 0x8B, HR(dr), adress);
+				break;
+			case OPK_LDI:
+				if(adress >= IO_SPACE_START)
+					goto side_exit;
+				side = newExit(&e, pc, written, cc_reg, 1, i);
+				emit8(&e, 0x0F); emit8(&e, 0xB7); emit8(&e, 0x83); emit32(&e, (uint32_t) adress * 2);	//movzx eax, word [rbx+adress*2]
+				emitCheckIO(&e, side);
+				emitWordAtEax16(&e, 0x8B, HR(dr));
+				break;
+			case OPK_LDR:
+				side = newExit(&e, pc, written, cc_reg, 1, i);
+				emitEffectiveAdress(&e, sr1, op->imm);
+				emitCheckIO(&e, side);
+				emitWordAtEax16(&e, 0x8B, HR(dr));
+				break;
+			case OPK_ST:
+				if(adress >= IO_SPACE_START)
+					goto side_exit;
+				side = newExit(&e, pc, written, cc_reg, 1, i);
+				emit8(&e, 0x80); emit8(&e, 0xBD); emit32(&e, adress); emit8(&e, 0x00);	//cmp byte [rbp+adress], 0
+				emitJumpToExit(&e, 0x85, side);
+				emitWord16(&e, 0x89, HR(dr), adress);
+				emit8(&e, 0xC6); emit8(&e, 0x85); emit32(&e, DIRTY_OFFSET + (adress >> PAGE_SHIFT)); emit8(&e, 0x01);	//mov byte [rbp+dirty+page], 1
+				break;
+			case OPK_STI:
+				if(adress >= IO_SPACE_START)
+					goto side_exit;
+				side = newExit(&e, pc, written, cc_reg, 1, i);
+				emit8(&e, 0x0F); emit8(&e, 0xB7); emit8(&e, 0x83); emit32(&e, (uint32_t) adress * 2);	//movzx eax, word [rbx+adress*2]
+				emitCheckIO(&e, side);
+				emitCheckCode(&e, side);
+				emitWordAtEax16(&e, 0x89, HR(dr));
+				emitMarkDirty(&e);
+				break;
+			case OPK_STR:
+				side = newExit(&e, pc, written, cc_reg, 1, i);
+				emitEffectiveAdress(&e, sr1, op->imm);
+				emitCheckIO(&e, side);
+				emitCheckCode(&e, side);
+				emitWordAtEax16(&e, 0x89, HR(dr));
+				emitMarkDirty(&e);
+				break;
+			case OPK_BR:{
+				uint8_t cond = branchCondition(dr);
+				if(cond != 1){
+					jit_exit *taken = newExit(&e, adress, written, cc_reg, 0, i + 1);
+					if(cond)
+						emitTestCC(&e, cc_reg);
+					emitJumpToExit(&e, cond, taken);
+				}
+				emitExit(&e, newExit(&e, next_pc, written, cc_reg, 0, i + 1));
+				done = 1;
+				break;
+			}
+			case OPK_JSR: case OPK_TRAP:{
+				jit_exit *x;
+				if(op->kind == OPK_TRAP && m->trap_service[op->imm] != TRAP_GUEST)
+					goto side_exit;
+				if(cc_reg == 7){	//R7 is about to be overwritten, save its CC value first
+					emitBaseDisp8_16(&e, 0x89, HR(7), 7, offsetof(jit_state, cc));
+					cc_reg = -1;
+				}
+				emit8(&e, 0x66); emit8(&e, 0x41); emit8(&e, 0xBF); emit16(&e, next_pc);	//mov r15w, next_pc
+				written |= 1 << 7;
+				x = newExit(&e, adress, written, cc_reg, 0, i + 1);
+				if(op->kind == OPK_TRAP){
+					emit8(&e, 0x0F); emit8(&e, 0xB7); emit8(&e, 0x83); emit32(&e, (uint32_t) op->imm * 2);	//movzx eax, word [rbx+vect*2]
+					x->pc_in_eax = 1;
+				}
+				emitExit(&e, x);
+				done = 1;
+				break;
+			}
+			case OPK_RET:{
+				jit_exit *x = newExit(&e, 0, written, cc_reg, 0, i + 1);
+				emit8(&e, 0x41); emit8(&e, 0x0F); emit8(&e, 0xB7); emit8(&e, 0xC0 | op->sr1);	//movzx eax, HR(BaseR)w
+				x->pc_in_eax = 1;
+				emitExit(&e, x);
+				done = 1;
+				break;
+			}
+			default:
+side_exit:		//let the interpreter run this instruction
+				if(i == 0)
+					return 0;
+				emitExit(&e, newExit(&e, pc, written, cc_reg, 1, i));
+				done = 1;
+				break;
+		}
+		//Every instruction left, except stores, writes DR and sets the CC from it
+		if(!done && op->kind != OPK_ST && op->kind != OPK_STI && op->kind != OPK_STR){
+			written |= 1 << dr;
+			cc_reg = dr;
+		}
+	}
+	if(!done)	//block cut at BLOCK_MAX_INSTRS
+		emitExit(&e, newExit(&e, b->end_pc, written, cc_reg, 0, n));
+
+	//Out of line exits
+	for(i = 0; i < e.exit_count; ++i)
+		if(e.exits[i].patches)
+			emitExit(&e, &e.exits[i]);
+
+	b->native = (jit_fn) (void *) code;
+	m->jit_arena_pos = e.p;
+	++m->jit_stats.compiled;
+	return 1;
+}
+
+int jitInit(machine *m){
+	if(m->jit_arena == NULL){
+		void *arena = mmap(NULL, JIT_ARENA_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(arena == MAP_FAILED)
+			return 0;
+		m->jit_arena = arena;
+	}
+	m->jit_arena_pos = m->jit_arena;
+	return 1;
+}
+
+#undef HR
+#else
+int jitCompile(machine *m, block *b){
+	(void) m;
+	(void) b;
+	return 0;
+}
+
+int jitInit(machine *m){
+	(void) m;
+	return 0;
+}
+#endif
+
+//Maps zeroed memory for a machine or its memory, NULL when out of memory.
+static void *mapZeroed(size_t size){
+#if HAVE_MMAP
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return p == MAP_FAILED ? NULL : p;
+#else
+	return calloc(1, size);
+#endif
+}
+
+static void unmapZeroed(void *p, size_t size){
+#if HAVE_MMAP
+	munmap(p, size);
+#else
+	(void) size;
+	free(p);
+#endif
+}
+
+machine *newMachine(const base_image *base){
+	machine *m = mapZeroed(sizeof(machine));
+	if(m){
+#if HAVE_MEMFD
+		if(base && base->fd >= 0){
+			void *memory = mmap(NULL, MEMORY_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE, base->fd, 0);
+			if(memory != MAP_FAILED){
+				m->memory = memory;
+				m->memory_mapped = 1;
+			}
+		}else
+#endif
+		if(base){
+			m->memory = malloc(MEMORY_BYTES);
+			if(m->memory)
+				memcpy(m->memory, base->image, MEMORY_BYTES);
+		}else{
+			m->memory = mapZeroed(MEMORY_BYTES);
+			m->memory_mapped = 1;
+		}
+	}
+	if(m == NULL || m->memory == NULL){
+		fprintf(stderr, "Out of memory allocating a machine\n");
+		exit(1);
+	}
+	return m;
+}
+
+void freeMachine(machine *m){
+	flushBlocks(m);
+#if HAVE_JIT
+	if(m->jit_arena)
+		munmap(m->jit_arena, JIT_ARENA_SIZE);
+#endif
+	if(m->memory_mapped){
+		if(m->memory)
+			unmapZeroed(m->memory, MEMORY_BYTES);
+	}else
+		free(m->memory);
+	free(m->console.out);
+	freeSymbols(&m->symbols);
+	if(m->lockstep){
+		freeMachine(m->lockstep->reference);
+		free(m->lockstep->keys.keys);
+		free(m->lockstep);
+	}
+	if(m->history){
+		int i;
+		for(i = 0; i < m->history->count; ++i)
+			free(m->history->checkpoints[i].undo);
+		free(m->history->checkpoints);
+		free(m->history->writes);
+		free(m->history->shadow);
+		free(m->history->keys.keys);
+		free(m->history);
+	}
+	if(m->profile){
+		free(m->profile->frames);
+		free(m->profile);
+	}
+	freeCodeGraph(m->cfg);
+	unmapZeroed(m, sizeof(machine));
+}
+
+int buildBase(base_image *base, char *const *files, const file_data *data, int count){
+	machine *m = newMachine(NULL);
+	int i, ok = 1;
+	base->fd = -1;
+	base->image = NULL;
+	base->file_count = count;
+#if HAVE_MEMFD
+	//The files are loaded straight into a shared mapping of the memfd.
+	base->fd = memfd_create("lc3-base", MFD_CLOEXEC);
+	if(base->fd >= 0){
+		void *image = MAP_FAILED;
+		if(ftruncate(base->fd, MEMORY_BYTES) == 0)
+			image = mmap(NULL, MEMORY_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, base->fd, 0);
+		if(image == MAP_FAILED){
+			close(base->fd);
+			base->fd = -1;
+		}else{
+			unmapZeroed(m->memory, MEMORY_BYTES);
+			m->memory = image;
+		}
+	}
+#endif
+	init(m);
+	for(i = 0; i < count && ok; ++i)
+		ok = (data ? loadData(m, files[i], data[i].data, data[i].size) : loadFile(m, files[i])) >= 0;
+	getState(m, &base->state);
+	if(base->fd < 0){
+		//keep a malloc'd copy, the machine's memory goes with it
+		base->image = malloc(MEMORY_BYTES);
+		if(base->image == NULL){
+			fprintf(stderr, "Out of memory building the base image\n");
+			exit(1);
+		}
+		memcpy(base->image, m->memory, MEMORY_BYTES);
+	}
+	freeMachine(m);
+	if(!ok)
+		freeBase(base);
+	return ok;
+}
+
+void freeBase(base_image *base){
+#if HAVE_MEMFD
+	if(base->fd >= 0)
+		close(base->fd);
+#endif
+	free(base->image);
+	base->fd = -1;
+	base->image = NULL;
+	base->file_count = 0;
+}
+
+//Nanoseconds on a monotonic clock (processor time where there's none)
+static uint64_t nowNs(void){
+#if defined(CLOCK_MONOTONIC)
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t) t.tv_sec * 1000000000u + t.tv_nsec;
+#else
+	return (uint64_t) clock() * (1000000000u / CLOCKS_PER_SEC);
+#endif
+}
+
+int configureMachine(machine *m, const run_options *opts){
+	m->display_latency = opts->display_latency;
+	m->key_latency = opts->key_latency;
+	m->fast_forward = !opts->no_fast_forward;
+	m->flush_interval = opts->flush_interval;
+	if(opts->fast_traps)
+		enableFastTraps(m, opts->guest_traps);
+	if(opts->engine == ENGINE_JIT){
+		m->jit_enabled = jitInit(m);
+		if(!m->jit_enabled)
+			fprintf(stderr, "JIT not available on this host, running the block engine\n");
+	}
+	if(opts->max_cycles)
+		setStop(m, m->cycles + opts->max_cycles);
+	if(opts->timeout_ns){
+		m->deadline = nowNs() + opts->timeout_ns;
+		scheduleEvent(m, EVENT_WATCHDOG, m->cycles + WATCHDOG_INTERVAL);
+	}
+	if(opts->lockstep)
+		startLockstep(m, opts, opts->lockstep);
+	if(opts->prewarm && (opts->engine == ENGINE_BLOCK || opts->engine == ENGINE_JIT)){
+		if(m->cfg == NULL)
+			m->cfg = analyzeCode(m, m->pc);
+		m->prewarm = 1;
+	}
+	m->output.expected = opts->expected;
+	m->output.expected_len = opts->expected_len;
+	m->console.capture_limit = opts->capture_limit;
+	if(opts->hash_output && !opts->capture_limit)
+		m->console.discard = 1;	//none of the output is kept, just its hash
+	//a snapshot can come with the keyboard interrupt enabled, which has the input looked at
+	keyboardWrite(m, KBSR, m->keyboard.status);
+	return opts->engine;
+}
+
+int runMachine(machine *m, int engine){
+	int illegal;
+	if(engine == ENGINE_THREADED)
+		illegal = runThreaded(m);
+	else if(engine == ENGINE_BLOCK || engine == ENGINE_JIT)
+		illegal = runBlocks(m);
+	else
+		illegal = runSwitch(m);
+	return finishRun(m, illegal);
+}
+
+int finishRun(machine *m, int illegal){
+	int status;
+	consoleFlush(m);
+	status = illegal ? STATUS_ILLEGAL : m->fault ? m->fault : MCR_POWER(m->mcr) ? STATUS_CYCLES : STATUS_HALTED;
+	if(m->lockstep && status != STATUS_DIVERGED && !lockstepCheck(m, 1))	//where it ended has to match too
+		status = STATUS_DIVERGED;
+	if(status == STATUS_HALTED && m->output.expected && m->output.bytes < m->output.expected_len)
+		status = STATUS_MISMATCH;	//it ended short of the output expected
+	return status;
+}
+
+//Key source of a key_reader: the keys of its log from its position, read from the machine's input by the
+//first reader to get there
+static size_t logKeys(void *context, unsigned char *buf, size_t size){
+	key_reader *reader = context;
+	key_log *log = reader->log;
+	if(reader->pos == log->count){
+		if(log->cap - log->count < KEYBOARD_BUF_SIZE){
+			unsigned char *keys = realloc(log->keys, log->cap + KEYBOARD_BUF_SIZE);
+			if(keys == NULL)
+				return 0;
+			log->keys = keys;
+			log->cap += KEYBOARD_BUF_SIZE;
+		}
+		log->count += log->source ? log->source(log->source_context, log->keys + log->count, KEYBOARD_BUF_SIZE)
+			: readKeys(log->in, log->keys + log->count, KEYBOARD_BUF_SIZE);
+	}
+	if(size > log->count - reader->pos)
+		size = log->count - reader->pos;
+	memcpy(buf, log->keys + reader->pos, size);
+	reader->pos += size;
+	return size;
+}
+
+//Starts a key log of the machine's input (its key source or keyboard.in)
+static void startKeyLog(key_log *log, const machine *m){
+	log->source = m->keyboard.source;
+	log->source_context = m->keyboard.source_context;
+	log->in = m->keyboard.in;
+}
+
+static void dropOutput(void *context, const char *bytes, size_t len){
+	(void) context;
+	(void) bytes;
+	(void) len;
+}
+
+void startLockstep(machine *m, const run_options *opts, uint64_t interval){
+	lockstep_state *ls = calloc(1, sizeof(lockstep_state));
+	run_options reference_opts = *opts;
+	machine *r;
+	machine_state state;
+	if(ls == NULL){
+		fprintf(stderr, "Out of memory allocating a machine\n");
+		exit(1);
+	}
+	r = newMachine(NULL);
+	init(r);
+	memcpy(r->memory, m->memory, MEMORY_BYTES);
+	getState(m, &state);
+	setState(r, &state);
+	r->keyboard.primed = m->keyboard.primed;
+	r->console.discard = 1;
+	r->console.sink = dropOutput;	//illegalInstruction()'s message too
+
+	ls->machine = m;
+	ls->reference = r;
+	ls->interval = interval;
+	ls->agreed_at = m->cycles;
+	startKeyLog(&ls->keys, m);
+	ls->readers[0].log = ls->readers[1].log = &ls->keys;
+	m->keyboard.source = r->keyboard.source = logKeys;
+	m->keyboard.source_context = &ls->readers[0];
+	r->keyboard.source_context = &ls->readers[1];
+	m->lockstep = ls;
+	scheduleEvent(m, EVENT_LOCKSTEP, m->cycles + interval);
+
+	//the switch engine, one instruction at a time (and without the limits, the machine has them)
+	reference_opts.engine = ENGINE_SWITCH;
+	reference_opts.no_fast_forward = 1;
+	reference_opts.max_cycles = 0;
+	reference_opts.timeout_ns = 0;
+	reference_opts.lockstep = 0;
+	configureMachine(r, &reference_opts);
+}
+
+int lockstepCheck(machine *m, int final){
+	lockstep_state *ls = m->lockstep;
+	machine *r = ls->reference;
+	int illegal = 0, i;
+
+	if(r->cycles < m->cycles)
+		illegal = runUntil(r, m->cycles) == STATUS_ILLEGAL;
+	//a machine that faulted taking an interrupt (its pushes) stopped after servicing at this cycle, which the
+	//reference does at its next step: it's serviced too, so the fault is what the run ends with if they agree
+	if(final && m->fault && m->fault != STATUS_DIVERGED && !r->fault && r->cycles == m->cycles
+		&& MCR_POWER(r->mcr) && r->cycles >= r->service_at)
+		serviceMachine(r);
+	for(i = 0; i < REG_COUNT && m->regs[i] == r->regs[i]; ++i)
+		;
+	ls->adress = -1;
+	ls->report[0] = '\0';
+	if(r->cycles != m->cycles)
+		snprintf(ls->report, sizeof(ls->report), "the reference %s after %"PRIu64" instructions",
+			illegal ? "ran into an illegal instruction" : MCR_POWER(r->mcr) ? "stopped" : "halted", r->cycles);
+	else if(MCR_POWER(m->mcr) != MCR_POWER(r->mcr))
+		snprintf(ls->report, sizeof(ls->report), "the reference %s", MCR_POWER(r->mcr) ? "is still on" : "halted");
+	else if(i < REG_COUNT)
+		snprintf(ls->report, sizeof(ls->report), "R%d is x%04hX, the reference's x%04hX", i, (uint16_t) m->regs[i],
+			(uint16_t) r->regs[i]);
+	else if(m->pc != r->pc)
+		snprintf(ls->report, sizeof(ls->report), "PC is x%04hX, the reference's x%04hX", m->pc, r->pc);
+	else if(readPSR(m) != readPSR(r))
+		snprintf(ls->report, sizeof(ls->report), "PSR is x%04hX, the reference's x%04hX", (uint16_t) readPSR(m), (uint16_t) readPSR(r));
+	else if(final && m->ir != r->ir)
+		snprintf(ls->report, sizeof(ls->report), "IR is x%04hX, the reference's x%04hX", (uint16_t) m->ir, (uint16_t) r->ir);
+	else if(m->saved_usp != r->saved_usp || m->saved_ssp != r->saved_ssp)
+		snprintf(ls->report, sizeof(ls->report), "the saved stack pointers are x%04hX/x%04hX, the reference's x%04hX/x%04hX",
+			m->saved_usp, m->saved_ssp, r->saved_usp, r->saved_ssp);
+	else if(memcmp(m->memory, r->memory, MEMORY_BYTES) != 0){
+		for(i = 0; m->memory[i] == r->memory[i]; ++i)
+			;
+		ls->adress = i;
+		snprintf(ls->report, sizeof(ls->report), "memory at x%04X is x%04hX, the reference's x%04hX", i,
+			(uint16_t) m->memory[i], (uint16_t) r->memory[i]);
+	}
+	if(ls->report[0])
+		return 0;
+	ls->agreed_at = m->cycles;
+	return 1;
+}
+
+void printLockstep(machine *m){
+	machine *r = m->lockstep->reference;
+	int adress = m->lockstep->adress;
+	uint16_t from = adress < 8 ? 0 : adress - 8;
+	uint32_t to = adress + 8 > 0x10000 ? 0x10000 : adress + 8;
+	if(r->cycles < m->cycles)
+		runUntil(r, m->cycles);
+	printf("Machine:\n");
+	printState(m);
+	if(adress >= 0)
+		printMemory(m, from, to);
+	printf("Reference:\n");
+	printState(r);
+	if(adress >= 0)
+		printMemory(r, from, to);
+}
+
+void startHistory(machine *m, uint64_t interval, size_t budget){
+	history_state *h = calloc(1, sizeof(history_state));
+	if(h == NULL || (h->shadow = malloc(MEMORY_BYTES)) == NULL){
+		fprintf(stderr, "Out of memory keeping the history\n");
+		exit(1);
+	}
+	h->interval = interval;
+	h->budget = budget;
+	memcpy(h->shadow, m->memory, MEMORY_BYTES);
+	startKeyLog(&h->keys, m);
+	//keys the keyboard has read already (a snapshot's interrupt enable has it look) start the log
+	if(m->keyboard.len){
+		h->keys.keys = malloc(KEYBOARD_BUF_SIZE);
+		if(h->keys.keys == NULL){
+			fprintf(stderr, "Out of memory keeping the history\n");
+			exit(1);
+		}
+		memcpy(h->keys.keys, m->keyboard.buf, m->keyboard.len);
+		h->keys.cap = KEYBOARD_BUF_SIZE;
+		h->keys.count = m->keyboard.len;
+	}
+	h->reader.log = &h->keys;
+	h->reader.pos = h->keys.count;
+	m->keyboard.source = logKeys;
+	m->keyboard.source_context = &h->reader;
+	m->history = h;
+	historyCheckpoint(m);
+}
+
+//Drops the oldest checkpoint and the writes before the one after it. The undo pages of that one, which
+//went back to the checkpoint dropped, can't be used any longer.
+static void dropCheckpoint(history_state *h){
+	size_t first;
+	h->bytes -= sizeof(history_checkpoint) + (size_t) (h->checkpoints[0].page_count + h->checkpoints[1].page_count)
+		* PAGE_SIZE * sizeof(int16_t);
+	free(h->checkpoints[0].undo);
+	free(h->checkpoints[1].undo);
+	h->checkpoints[1].undo = NULL;
+	h->checkpoints[1].page_count = 0;
+	memmove(h->checkpoints, h->checkpoints + 1, --h->count * sizeof(history_checkpoint));
+	//the log is moved down once half of it is dropped
+	first = h->checkpoints[0].first_write - h->write_base;
+	if(first > h->write_count / 2){
+		memmove(h->writes, h->writes + first, (h->write_count - first) * sizeof(history_write));
+		h->write_count -= first;
+		h->write_base += first;
+	}
+}
+
+void historyCheckpoint(machine *m){
+	history_state *h = m->history;
+	history_checkpoint *c;
+	int i;
+	if(h->count == h->cap){
+		h->cap = h->cap ? 2 * h->cap : 64;
+		h->checkpoints = realloc(h->checkpoints, h->cap * sizeof(history_checkpoint));
+		if(h->checkpoints == NULL){
+			fprintf(stderr, "Out of memory keeping the history\n");
+			exit(1);
+		}
+	}
+	c = &h->checkpoints[h->count++];
+	c->cycles = m->cycles;
+	memcpy(c->regs, m->regs, sizeof(c->regs));
+	c->pc = m->pc;
+	c->ir = m->ir;
+	c->psr = readPSR(m);
+	c->cc_value = m->cc_value;
+	c->mcr = m->mcr;
+	c->saved_usp = m->saved_usp;
+	c->saved_ssp = m->saved_ssp;
+	c->display_status = m->display.status;
+	c->display_data = m->display.data;
+	c->keyboard_status = m->keyboard.status;
+	c->keyboard_data = m->keyboard.data;
+	c->keyboard_primed = m->keyboard.primed;
+	c->keyboard_len = m->keyboard.len;
+	c->keyboard_pos = m->keyboard.pos;
+	c->keys_read = h->reader.pos;
+	c->timer_status = m->timer.status;
+	c->timer_interval = m->timer.interval;
+	for(i = 0; i < m->event_count; ++i){
+		c->event_at[i] = m->events[i].at;
+		c->event_kind[i] = m->events[i].kind;
+	}
+	c->event_count = m->event_count;
+	c->skipped = m->skipped;
+	c->first_write = h->write_base + h->write_count;
+
+	//the pages that changed since the last checkpoint, as they were there
+	c->page_count = 0;
+	for(i = 0; i < PAGE_COUNT; ++i)
+		if(h->dirty[i] && memcmp(h->shadow + (i << PAGE_SHIFT), m->memory + (i << PAGE_SHIFT), PAGE_SIZE * sizeof(int16_t)) != 0)
+			c->pages[c->page_count++] = i;
+	c->undo = NULL;
+	if(c->page_count && (c->undo = malloc(c->page_count * PAGE_SIZE * sizeof(int16_t))) == NULL){
+		fprintf(stderr, "Out of memory keeping the history\n");
+		exit(1);
+	}
+	for(i = 0; i < c->page_count; ++i){
+		memcpy(c->undo + i * PAGE_SIZE, h->shadow + (c->pages[i] << PAGE_SHIFT), PAGE_SIZE * sizeof(int16_t));
+		memcpy(h->shadow + (c->pages[i] << PAGE_SHIFT), m->memory + (c->pages[i] << PAGE_SHIFT), PAGE_SIZE * sizeof(int16_t));
+	}
+	memset(h->dirty, 0, sizeof(h->dirty));
+	h->bytes += sizeof(history_checkpoint) + (size_t) c->page_count * PAGE_SIZE * sizeof(int16_t);
+	h->next_at = m->cycles + h->interval;
+
+	while(h->count > 1 && h->bytes + (h->write_base + h->write_count - h->checkpoints[0].first_write)
+		* sizeof(history_write) > h->budget)
+		dropCheckpoint(h);
+}
+
+int historyTravel(machine *m, uint64_t cycles){
+	history_state *h = m->history;
+	history_checkpoint *c;
+	exec_profile *profile = m->profile;
+	trace_writer *trace = m->trace;
+	uint64_t stop_at = m->stop_at;
+	int fault = m->fault, discard = m->console.discard, i, j;
+	if(cycles < h->checkpoints[0].cycles)
+		return 0;
+	for(j = h->count - 1; h->checkpoints[j].cycles > cycles; --j)
+		;
+	//memory at the last checkpoint, undone back to checkpoint j
+	for(i = h->count - 1; i > j; --i){
+		int k;
+		c = &h->checkpoints[i];
+		for(k = 0; k < c->page_count; ++k)
+			memcpy(h->shadow + (c->pages[k] << PAGE_SHIFT), c->undo + k * PAGE_SIZE, PAGE_SIZE * sizeof(int16_t));
+		h->bytes -= sizeof(history_checkpoint) + (size_t) c->page_count * PAGE_SIZE * sizeof(int16_t);
+		free(c->undo);
+	}
+	h->count = j + 1;
+	for(i = 0; i < PAGE_COUNT; ++i)
+		if(memcmp(m->memory + (i << PAGE_SHIFT), h->shadow + (i << PAGE_SHIFT), PAGE_SIZE * sizeof(int16_t)) != 0)
+			markDirty(m, i << PAGE_SHIFT, PAGE_SIZE);
+	memcpy(m->memory, h->shadow, MEMORY_BYTES);
+	memset(h->dirty, 0, sizeof(h->dirty));
+
+	c = &h->checkpoints[j];
+	m->cycles = m->console.flushed_at = c->cycles;
+	memcpy(m->regs, c->regs, sizeof(m->regs));
+	m->pc = c->pc;
+	m->ir = c->ir;
+	writePSR(m, c->psr);
+	m->cc_value = c->cc_value;
+	m->mcr = c->mcr;
+	m->saved_usp = c->saved_usp;
+	m->saved_ssp = c->saved_ssp;
+	m->display.status = c->display_status;
+	m->display.data = c->display_data;
+	m->keyboard.status = c->keyboard_status;
+	m->keyboard.data = c->keyboard_data;
+	m->keyboard.primed = c->keyboard_primed;
+	m->keyboard.len = c->keyboard_len;
+	m->keyboard.pos = c->keyboard_pos;
+	if(c->keyboard_len)
+		memcpy(m->keyboard.buf, h->keys.keys + c->keys_read - c->keyboard_len, c->keyboard_len);
+	h->reader.pos = c->keys_read;
+	m->timer.status = c->timer_status;
+	m->timer.interval = c->timer_interval;
+	for(i = 0; i < c->event_count; ++i){
+		m->events[i].at = c->event_at[i];
+		m->events[i].kind = c->event_kind[i];
+	}
+	m->event_count = c->event_count;
+	m->next_event = m->event_count ? m->events[0].at : UINT64_MAX;
+	//the run is over, the clock and the reference aren't looked at again
+	cancelEvent(m, EVENT_WATCHDOG);
+	cancelEvent(m, EVENT_LOCKSTEP);
+	m->skipped = c->skipped;
+	m->waiting = 0;
+	h->write_count = c->first_write - h->write_base;
+	h->next_at = c->cycles + h->interval;
+
+	//the output was written the first time, the profile and trace have seen these instructions
+	m->console.len = 0;
+	m->console.discard = 1;
+	m->profile = NULL;
+	m->trace = NULL;
+	m->fault = 0;
+	setStop(m, cycles);
+	updateInterrupts(m);
+	runSwitch(m);
+	m->console.len = 0;
+	m->console.discard = discard;
+	m->profile = profile;
+	m->trace = trace;
+	m->fault = fault;
+	setStop(m, stop_at);
+	return m->cycles == cycles;
+}
+
+const history_write *lastWrite(const machine *m, uint16_t adress){
+	const history_state *h = m->history;
+	size_t i;
+	for(i = h->write_count; i > h->checkpoints[0].first_write - h->write_base; --i)
+		if(h->writes[i - 1].adress == adress)
+			return &h->writes[i - 1];
+	return NULL;
+}
+
+//Writes a word of ordinary memory: its predecoded copy has to be decoded again and the blocks holding it go
+static ALWAYS_INLINE void storeWord(machine *m, uint16_t adress, int16_t val){
+	m->memory[adress] = val;
+	m->dirty_pages[adress >> PAGE_SHIFT] = 1;
+	redecode(m, adress);
+	if(m->code_map[adress])
+		invalidateBlocks(m, adress);
+}
+
+//LC3 registers as the debugger numbers them: R0-R7, then the PC and the PSR, 16 bits each
+static const char gdb_target_xml[] =
+	"<?xml version=\"1.0\"?>\n"
+	"<!DOCTYPE target SYSTEM \"gdb-target.dtd\">\n"
+	"<target version=\"1.0\">\n"
+	"<feature name=\"org.lc3.core\">\n"
+	"<reg name=\"r0\" bitsize=\"16\" type=\"int16\"/>\n"
+	"<reg name=\"r1\" bitsize=\"16\" type=\"int16\"/>\n"
+	"<reg name=\"r2\" bitsize=\"16\" type=\"int16\"/>\n"
+	"<reg name=\"r3\" bitsize=\"16\" type=\"int16\"/>\n"
+	"<reg name=\"r4\" bitsize=\"16\" type=\"int16\"/>\n"
+	"<reg name=\"r5\" bitsize=\"16\" type=\"int16\"/>\n"
+	"<reg name=\"r6\" bitsize=\"16\" type=\"data_ptr\"/>\n"
+	"<reg name=\"r7\" bitsize=\"16\" type=\"code_ptr\"/>\n"
+	"<reg name=\"pc\" bitsize=\"16\" type=\"code_ptr\"/>\n"
+	"<reg name=\"psr\" bitsize=\"16\" type=\"int16\"/>\n"
+	"</feature>\n"
+	"</target>\n";
+#define GDB_REG_COUNT (REG_COUNT + 2)
+
+static int readGdbReg(machine *m, int reg){
+	return (uint16_t) (reg < REG_COUNT ? m->regs[reg] : reg == REG_COUNT ? m->pc : readPSR(m));
+}
+
+static void writeGdbReg(machine *m, int reg, uint16_t val){
+	if(reg < REG_COUNT)
+		m->regs[reg] = val;
+	else if(reg == REG_COUNT)
+		m->pc = val;
+	else{
+		writePSR(m, val);
+		updateInterrupts(m);
+	}
+}
+
+//A watched word was accessed: the engines stop after the instruction
+static void watchHit(machine *m, uint16_t adress, int kind){
+	gdb_state *g = m->gdb;
+	if(!(g->watch[adress] & (kind | GDB_WATCH_ACCESS)))
+		return;
+	g->stop = GDB_STOP_WATCH;
+	g->watch_adress = adress;
+	g->watch_kind = g->watch[adress] & kind ? kind : GDB_WATCH_ACCESS;
+	setStop(m, m->cycles);
+}
+
+static int16_t watchRead(machine *m, uint16_t adress){
+	watchHit(m, adress, GDB_WATCH_READ);
+	return m->memory[adress];
+}
+
+static void watchWrite(machine *m, uint16_t adress, int16_t val){
+	watchHit(m, adress, GDB_WATCH_WRITE);
+	storeWord(m, adress, val);
+}
+
+//Sets (or clears) the watch bits given on a word, routing its page through watchRead()/watchWrite() while
+//it has watched words. Returns 0 for the device space, whose pages are the devices'.
+static int setWatch(machine *m, uint16_t adress, int kind, int set){
+	gdb_state *g = m->gdb;
+	int page = adress >> PAGE_SHIFT, was = g->watch[adress] != 0, i;
+	if(adress >= IO_SPACE_START)
+		return 0;
+	g->watch[adress] = set ? g->watch[adress] | kind : g->watch[adress] & ~kind;
+	if(was == (g->watch[adress] != 0))
+		return 1;
+	if(!was && g->watched[page]++ == 0){
+		device_register *table = malloc(PAGE_SIZE * sizeof(device_register));
+		if(table == NULL){
+			fprintf(stderr, "Out of memory setting a watchpoint\n");
+			exit(1);
+		}
+		for(i = 0; i < PAGE_SIZE; ++i){
+			table[i].read = watchRead;
+			table[i].write = watchWrite;
+		}
+		g->watch_pages[page] = m->io_pages[page] = table;
+		++g->watch_page_count;
+	}else if(was && --g->watched[page] == 0){
+		free(g->watch_pages[page]);
+		g->watch_pages[page] = m->io_pages[page] = NULL;
+		--g->watch_page_count;
+	}
+	return 1;
+}
+
+#if HAVE_SOCKETS
+//Next byte from the debugger, -1 when the connection is gone
+static int gdbGetChar(gdb_state *g){
+	if(g->pos == g->len){
+		ssize_t len = recv(g->fd, g->buf, sizeof(g->buf), 0);
+		if(len <= 0)
+			return -1;
+		g->len = len;
+		g->pos = 0;
+	}
+	return g->buf[g->pos++];
+}
+
+//Reads the next packet into g->packet, acknowledging it. Returns its length, -1 when the connection is gone.
+static int gdbReadPacket(gdb_state *g){
+	for(;;){
+		int c, len = 0, sum = 0, check;
+		char hex[3] = {0};
+		while((c = gdbGetChar(g)) != '$')
+			if(c < 0)
+				return -1;	//acks, and ^C while stopped, are skipped
+		while((c = gdbGetChar(g)) != '#'){
+			if(c < 0)
+				return -1;
+			sum += c;
+			if(len < GDB_PACKET_SIZE)
+				g->packet[len++] = c;
+		}
+		if((c = gdbGetChar(g)) < 0 || (hex[0] = c, c = gdbGetChar(g)) < 0)
+			return -1;
+		hex[1] = c;
+		check = strtol(hex, NULL, 16);
+		g->packet[len] = '\0';
+		if(g->no_ack)
+			return len;
+		if((sum & 0xFF) == check){
+			send(g->fd, "+", 1, 0);
+			return len;
+		}
+		send(g->fd, "-", 1, 0);
+	}
+}
+
+//Sends the packet given, again until the debugger acknowledges it. Returns 0 when the connection is gone.
+static int gdbSend(gdb_state *g, const char *data){
+	char frame[GDB_PACKET_SIZE + 4];
+	size_t len = strlen(data), i;
+	unsigned int sum = 0;
+	int c;
+	for(i = 0; i < len; ++i)
+		sum += (unsigned char) data[i];
+	frame[0] = '$';
+	memcpy(frame + 1, data, len);
+	snprintf(frame + 1 + len, 4, "#%02x", sum & 0xFF);
+	do{
+		if(send(g->fd, frame, len + 4, 0) < 0)
+			return 0;
+		if(g->no_ack)
+			return 1;
+		while((c = gdbGetChar(g)) != '+' && c != '-')
+			if(c < 0)
+				return 0;
+	}while(c == '-');
+	return 1;
+}
+
+int gdbInterrupted(machine *m){
+	gdb_state *g = m->gdb;
+	struct pollfd p;
+	while(g->pos < g->len)
+		if(g->buf[g->pos++] == 0x03)
+			return 1;
+	p.fd = g->fd;
+	p.events = POLLIN;
+	while(poll(&p, 1, 0) > 0){
+		int c = gdbGetChar(g);
+		if(c < 0 || c == 0x03)
+			return 1;	//a debugger gone stops the program too
+	}
+	return 0;
+}
+
+//Runs the machine for the debugger's c or s packet and puts the stop reply in reply
+static void gdbResume(machine *m, int engine, int single, char *reply, size_t size){
+	gdb_state *g = m->gdb;
+	uint64_t stop_at = m->stop_at;
+	int illegal = 0;
+	g->stop = 0;
+	if(MCR_POWER(m->mcr)){
+		//the instruction at a breakpoint runs on its own, so it isn't hit again
+		if(single || g->breakpoints[m->pc])
+			illegal = step(m);
+		if(!single && !illegal && !g->stop && !m->fault && MCR_POWER(m->mcr) && m->cycles < m->stop_at){
+			if((engine == ENGINE_BLOCK || engine == ENGINE_JIT) && g->watch_page_count == 0)
+				illegal = runBlocks(m);
+			else	//breakpoints are decoded into the threaded engine's instructions, watched pages read as devices
+				illegal = runThreaded(m);
+		}
+	}
+	consoleFlush(m);
+	if(g->stop == GDB_STOP_WATCH || g->stop == GDB_STOP_INTERRUPT)
+		setStop(m, stop_at);
+	if(illegal)
+		snprintf(reply, size, "S04");	//SIGILL
+	else if(!MCR_POWER(m->mcr))
+		snprintf(reply, size, "W00");
+	else if(m->fault){
+		snprintf(reply, size, m->fault == STATUS_BAD_ADRESS ? "S0b" : "S18");	//SIGSEGV, SIGXCPU
+		m->fault = 0;
+		setStop(m, stop_at);
+	}else if(g->stop == GDB_STOP_WATCH)
+		snprintf(reply, size, "T05%s:%x;", g->watch_kind == GDB_WATCH_WRITE ? "watch" : g->watch_kind == GDB_WATCH_READ
+			? "rwatch" : "awatch", 2 * g->watch_adress);
+	else if(g->stop == GDB_STOP_INTERRUPT)
+		snprintf(reply, size, "S02");	//SIGINT
+	else if(g->stop == GDB_STOP_BREAK && g->swbreak)
+		snprintf(reply, size, "T05swbreak:;");
+	else
+		snprintf(reply, size, "S05");	//SIGTRAP: a breakpoint, a step or the end of --max-cycles
+}
+
+//Reads the "addr,len" of a packet (from p) as hex, returns the character after them
+static const char *gdbRange(const char *p, unsigned long *adress, unsigned long *len){
+	char *end;
+	*adress = strtoul(p, &end, 16);
+	*len = *end == ',' ? strtoul(end + 1, &end, 16) : 0;
+	return end;
+}
+
+//Handles the debugger's packets until it lets the machine go (D, or the connection closing: returns 1) or
+//kills it (k: returns 0)
+static int gdbSession(machine *m, int engine){
+	gdb_state *g = m->gdb;
+	char *reply = malloc(GDB_PACKET_SIZE + 1);
+	int len, ret = 1;
+	if(reply == NULL){
+		fprintf(stderr, "Out of memory serving the debugger\n");
+		exit(1);
+	}
+	while((len = gdbReadPacket(g)) >= 0){
+		char *p = g->packet;
+		unsigned long adress, count, i, number;
+		int reg;
+		reply[0] = '\0';
+		switch(p[0]){
+			case '?':
+				snprintf(reply, GDB_PACKET_SIZE, MCR_POWER(m->mcr) ? "S05" : "W00");
+				break;
+			case 'g':
+				for(reg = 0; reg < GDB_REG_COUNT; ++reg)
+					sprintf(reply + 4 * reg, "%02x%02x", readGdbReg(m, reg) & 0xFF, readGdbReg(m, reg) >> 8);
+				break;
+			case 'G':
+				for(reg = 0; reg < GDB_REG_COUNT && (size_t) len >= 1 + 4 * (size_t) (reg + 1); ++reg){
+					char hex[5] = {p[3 + 4 * reg], p[4 + 4 * reg], p[1 + 4 * reg], p[2 + 4 * reg], 0};
+					writeGdbReg(m, reg, strtoul(hex, NULL, 16));
+				}
+				strcpy(reply, "OK");
+				break;
+			case 'p':
+				number = strtoul(p + 1, NULL, 16);	//range checked before it's narrowed to a register
+				if(number < GDB_REG_COUNT)
+					sprintf(reply, "%02x%02x", readGdbReg(m, number) & 0xFF, readGdbReg(m, number) >> 8);
+				else
+					strcpy(reply, "E01");
+				break;
+			case 'P':{
+				char *end, hex[5] = {0};
+				number = strtoul(p + 1, &end, 16);
+				if(number < GDB_REG_COUNT && *end == '=' && strlen(end + 1) >= 4){
+					memcpy(hex, end + 3, 2);
+					memcpy(hex + 2, end + 1, 2);
+					writeGdbReg(m, number, strtoul(hex, NULL, 16));
+					strcpy(reply, "OK");
+				}else
+					strcpy(reply, "E01");
+				break;
+			}
+			case 'm':	//byte adresses: word w is bytes 2w (its low byte) and 2w + 1
+				gdbRange(p + 1, &adress, &count);
+				if(count > GDB_PACKET_SIZE / 2)
+					count = GDB_PACKET_SIZE / 2;
+				for(i = 0; i < count; ++i){
+					uint16_t word = m->memory[(uint16_t) ((adress + i) >> 1)];
+					sprintf(reply + 2 * i, "%02x", ((adress + i) & 1 ? word >> 8 : word) & 0xFF);
+				}
+				break;
+			case 'M':{
+				const char *data = gdbRange(p + 1, &adress, &count);
+				if(*data++ != ':' || strlen(data) < 2 * count){
+					strcpy(reply, "E01");
+					break;
+				}
+				for(i = 0; i < count; ++i){
+					uint16_t w = (adress + i) >> 1, word = m->memory[w];
+					char hex[3] = {data[2 * i], data[2 * i + 1], 0};
+					unsigned int byte = strtoul(hex, NULL, 16);
+					word = (adress + i) & 1 ? (word & 0x00FF) | byte << 8 : (word & 0xFF00) | byte;
+					storeWord(m, w, word);
+				}
+				strcpy(reply, "OK");
+				break;
+			}
+			case 'c': case 's':
+				if(p[1])
+					m->pc = strtoul(p + 1, NULL, 16) >> 1;
+				gdbResume(m, engine, p[0] == 's', reply, GDB_PACKET_SIZE);
+				break;
+			case 'Z': case 'z':{
+				//Breakpoints take effect as the engines decode and build blocks: the word is decoded again
+				//and the blocks holding it built again
+				int kind = p[1] == '2' ? GDB_WATCH_WRITE : p[1] == '3' ? GDB_WATCH_READ : GDB_WATCH_ACCESS;
+				if(p[2] != ',' || p[1] < '0' || p[1] > '4' || p[1] == '1')
+					break;	//hardware breakpoints aren't supported
+				gdbRange(p + 3, &adress, &count);
+				strcpy(reply, "OK");
+				if(p[1] == '0'){
+					g->breakpoints[(uint16_t) (adress >> 1)] = p[0] == 'Z';
+					redecode(m, adress >> 1);
+					invalidateBlocks(m, adress >> 1);
+				}
+				else
+					for(i = adress >> 1; i <= (adress + (count ? count : 1) - 1) >> 1 && i < 0x10000; ++i)
+						if(!setWatch(m, i, kind, p[0] == 'Z'))
+							strcpy(reply, "E01");
+				break;
+			}
+			case 'k':
+				ret = 0;
+				break;
+			case 'D':
+				strcpy(reply, "OK");
+				break;
+			case 'H':
+				strcpy(reply, "OK");
+				break;
+			case 'q':
+				if(strncmp(p, "qSupported", 10) == 0){
+					g->swbreak = strstr(p, "swbreak+") != NULL;
+					snprintf(reply, GDB_PACKET_SIZE, "PacketSize=%x;qXfer:features:read+;swbreak+;QStartNoAckMode+",
+						GDB_PACKET_SIZE);
+				}else if(strncmp(p, "qXfer:features:read:target.xml:", 31) == 0){
+					gdbRange(p + 31, &adress, &count);
+					if(count > GDB_PACKET_SIZE - 1)
+						count = GDB_PACKET_SIZE - 1;
+					if(adress >= sizeof(gdb_target_xml) - 1)
+						strcpy(reply, "l");
+					else{
+						size_t left = sizeof(gdb_target_xml) - 1 - adress;
+						reply[0] = left > count ? 'm' : 'l';
+						memcpy(reply + 1, gdb_target_xml + adress, left > count ? count : left);
+						reply[1 + (left > count ? count : left)] = '\0';
+					}
+				}else if(strcmp(p, "qAttached") == 0)
+					strcpy(reply, "1");
+				else if(strcmp(p, "qC") == 0)
+					strcpy(reply, "QC1");
+				else if(strcmp(p, "qfThreadInfo") == 0)
+					strcpy(reply, "m1");
+				else if(strcmp(p, "qsThreadInfo") == 0)
+					strcpy(reply, "l");
+				break;
+			case 'Q':
+				if(strcmp(p, "QStartNoAckMode") == 0)
+					strcpy(reply, "OK");
+				break;
+			case 'v':
+				if(strncmp(p, "vKill", 5) == 0){
+					strcpy(reply, "OK");
+					ret = 0;
+				}
+				break;
+		}
+		if(!gdbSend(g, reply))
+			break;
+		if(strcmp(p, "QStartNoAckMode") == 0)
+			g->no_ack = 1;
+		if(p[0] == 'D' || ret == 0)
+			break;
+	}
+	free(reply);
+	return ret;
+}
+#endif
+
+int gdbServe(machine *m, int engine, int port){
+#if HAVE_SOCKETS
+	struct sockaddr_in adress;
+	int listener = socket(AF_INET, SOCK_STREAM, 0), one = 1, fd, page, ok;
+	gdb_state *g;
+	memset(&adress, 0, sizeof(adress));
+	adress.sin_family = AF_INET;
+	adress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	adress.sin_port = htons(port);
+	if(listener >= 0)
+		setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if(listener < 0 || bind(listener, (struct sockaddr *) &adress, sizeof(adress)) < 0 || listen(listener, 1) < 0){
+		fprintf(stderr, "Can't listen for the debugger on port %d\n", port);
+		if(listener >= 0)
+			close(listener);
+		return STATUS_ERROR;
+	}
+	fprintf(stderr, "Waiting for the debugger on port %d\n", port);
+	fd = accept(listener, NULL, NULL);
+	close(listener);
+	if(fd < 0){
+		fprintf(stderr, "Can't accept the debugger's connection\n");
+		return STATUS_ERROR;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	g = calloc(1, sizeof(gdb_state));
+	if(g == NULL){
+		fprintf(stderr, "Out of memory serving the debugger\n");
+		exit(1);
+	}
+	g->fd = fd;
+	m->gdb = g;
+	scheduleEvent(m, EVENT_GDB, m->cycles + GDB_POLL_INTERVAL);
+	ok = gdbSession(m, engine);
+	cancelEvent(m, EVENT_GDB);
+	for(page = 0; page < PAGE_COUNT; ++page)
+		if(g->watch_pages[page]){
+			free(g->watch_pages[page]);
+			m->io_pages[page] = NULL;
+		}
+	close(fd);
+	free(g);
+	m->gdb = NULL;
+	if(!ok){	//killed
+		m->mcr = 0;
+		return STATUS_HALTED;
+	}
+	return runMachine(m, engine);
+#else
+	(void) m;
+	(void) engine;
+	fprintf(stderr, "--gdb needs BSD sockets, which this host doesn't have (port %d)\n", port);
+	return STATUS_ERROR;
+#endif
+}
+
+#define CFG_CODE (1)	//an instruction reached
+#define CFG_LEADER (2)	//a block starts there
+#define CFG_ENDS (4)	//a control transfer, the block ends with it
+#define CFG_ROUTINE (8)	//the entry of a routine
+
+//Routines' returns: unknown, being worked out (counts as returning), returning, not returning
+#define CFG_RETURNS_UNKNOWN (0)
+#define CFG_RETURNS_PENDING (1)
+#define CFG_RETURNS (2)
+#define CFG_NO_RETURN (3)
+
+static int routineReturns(const machine *, uint16_t, uint8_t *);
+
+//Where the instruction at pc can go on to in its routine (next, the count returned; -1 for a zero word,
+//which isn't code), the routine it calls (call) and whether it transfers control (ends)
+static int cfgSuccessors(const machine *m, uint16_t pc, uint8_t *returns, uint16_t next[2], int32_t *call, int *ends){
+	int16_t ir = m->memory[pc];
+	uint16_t target;
+	*call = -1;
+	*ends = 1;
+	if(ir == 0)
+		return -1;
+	switch(OPCODE(ir)){
+		case BR_OP:
+			target = pc + 1 + PCOFFSET9(ir);
+			if((ir >> 9 & 7) == 0){	//never taken
+				*ends = 0;
+				next[0] = pc + 1;
+				return 1;
+			}
+			next[0] = target;
+			if((ir >> 9 & 7) == 7)
+				return 1;
+			next[1] = pc + 1;
+			return 2;
+		case JSR_OP:
+			if(ir & 0x0800)
+				*call = (uint16_t) (pc + 1 + PCOFFSET11(ir));
+			next[0] = pc + 1;	//taken to return
+			return 1;
+		case TRAP_OP:
+			target = m->memory[ir & 0xFF];
+			if(target == 0)
+				return 0;
+			*call = target;
+			next[0] = pc + 1;
+			return routineReturns(m, target, returns) != CFG_NO_RETURN;
+		case RET_OP: case RTI_OP:
+			return 0;
+		case 13:	//reserved
+			return 0;
+	}
+	*ends = 0;
+	next[0] = pc + 1;
+	return 1;
+}
+
+//Whether some path from the routine at entry reaches a JMP (RET, or a jump that can go anywhere) or RTI,
+//remembered in returns
+static int routineReturns(const machine *m, uint16_t entry, uint8_t *returns){
+	uint8_t *seen;
+	uint16_t *stack;
+	int depth = 0, result = CFG_NO_RETURN;
+	if(returns[entry] != CFG_RETURNS_UNKNOWN)
+		return returns[entry];
+	seen = calloc(0x10000, 1);
+	stack = malloc(0x10000 * sizeof(uint16_t));
+	if(seen == NULL || stack == NULL){
+		fprintf(stderr, "Out of memory analyzing the code\n");
+		exit(1);
+	}
+	returns[entry] = CFG_RETURNS_PENDING;
+	seen[entry] = 1;
+	stack[depth++] = entry;
+	while(depth > 0 && result == CFG_NO_RETURN){
+		uint16_t pc = stack[--depth], next[2];
+		int32_t call;
+		int ends, n = cfgSuccessors(m, pc, returns, next, &call, &ends), i;
+		int op = OPCODE(m->memory[pc]);
+		if(n == 0 && (op == RET_OP || op == RTI_OP))
+			result = CFG_RETURNS;
+		for(i = 0; i < n; ++i)
+			if(!seen[next[i]]){
+				seen[next[i]] = 1;
+				stack[depth++] = next[i];
+			}
+	}
+	free(seen);
+	free(stack);
+	returns[entry] = result;
+	return result;
+}
+
+static void addCfgBlock(code_graph *g, const cfg_block *b, int *cap){
+	if(g->count == *cap){
+		*cap = *cap ? 2 * *cap : 256;
+		g->blocks = realloc(g->blocks, *cap * sizeof(cfg_block));
+		if(g->blocks == NULL){
+			fprintf(stderr, "Out of memory analyzing the code\n");
+			exit(1);
+		}
+	}
+	g->blocks[g->count++] = *b;
+}
+
+//Gives the blocks the routine at root gets to without calls, and that no routine has yet, to it
+static void claimRoutine(code_graph *g, uint16_t root, int32_t *queue){
+	int head = 0, tail = 0, i;
+	int32_t first = g->block_at[root];
+	if(first < 0 || g->blocks[first].routine != 0xFFFF)
+		return;
+	g->blocks[first].routine = root;
+	queue[tail++] = first;
+	while(head < tail){
+		const cfg_block *b = &g->blocks[queue[head++]];
+		for(i = 0; i < b->next_count; ++i){
+			int32_t k = g->block_at[b->next[i]];
+			if(k >= 0 && g->blocks[k].routine == 0xFFFF){
+				g->blocks[k].routine = root;
+				queue[tail++] = k;
+			}
+		}
+	}
+}
+
+code_graph *analyzeCode(const machine *m, uint16_t entry){
+	code_graph *g = calloc(1, sizeof(code_graph));
+	uint8_t *flags = calloc(0x10000, 1), *returns = calloc(0x10000, 1);
+	uint16_t *work = malloc(2 * 0x10000 * sizeof(uint16_t));	//an adress goes on it as a leader and as a routine
+	int32_t *queue = malloc(0x10000 * sizeof(int32_t));
+	int depth = 0, cap = 0, i;
+	uint32_t a;
+	if(g == NULL || flags == NULL || returns == NULL || work == NULL || queue == NULL
+		|| (g->block_at = malloc(0x10000 * sizeof(int32_t))) == NULL){
+		fprintf(stderr, "Out of memory analyzing the code\n");
+		exit(1);
+	}
+	g->entry = entry;
+
+	//the routines it starts from: the entry point, the trap routines, the interrupt routines
+	flags[entry] |= CFG_LEADER | CFG_ROUTINE;
+	work[depth++] = entry;
+	for(i = 0; i < 0x200; ++i){
+		uint16_t target = m->memory[i];
+		if((i < 0x100 || i >= INTERRUPT_TABLE) && target && m->memory[target] && !(flags[target] & CFG_ROUTINE)){
+			flags[target] |= CFG_LEADER | CFG_ROUTINE;
+			work[depth++] = target;
+		}
+	}
+
+	//the instructions reached, in straight runs up to their control transfers
+	while(depth > 0){
+		uint16_t pc = work[--depth];
+		while(!(flags[pc] & CFG_CODE)){
+			uint16_t next[2];
+			int32_t call;
+			int ends, n = cfgSuccessors(m, pc, returns, next, &call, &ends);
+			if(n < 0)
+				break;
+			flags[pc] |= CFG_CODE;
+			if(call >= 0 && m->memory[call] && !(flags[call] & CFG_ROUTINE)){
+				flags[call] |= CFG_LEADER | CFG_ROUTINE;
+				work[depth++] = call;
+			}
+			if(!ends){
+				++pc;
+				continue;
+			}
+			flags[pc] |= CFG_ENDS;
+			for(i = 0; i < n; ++i)
+				if(!(flags[next[i]] & CFG_LEADER)){
+					flags[next[i]] |= CFG_LEADER;
+					work[depth++] = next[i];
+				}
+			break;
+		}
+	}
+
+	//the basic blocks, in adress order
+	for(a = 0; a < 0x10000; ++a)
+		g->block_at[a] = -1;
+	for(a = 0; a < 0x10000; ){
+		cfg_block b;
+		int ends;
+		if(!(flags[a] & CFG_CODE)){
+			++a;
+			continue;
+		}
+		b.start = a;
+		while(!(flags[a] & CFG_ENDS) && a + 1 < 0x10000 && (flags[a + 1] & (CFG_CODE | CFG_LEADER)) == CFG_CODE)
+			g->block_at[a++] = g->count;
+		g->block_at[a] = g->count;
+		b.end = a;
+		b.next_count = cfgSuccessors(m, b.end, returns, b.next, &b.call, &ends);
+		if(!ends)	//up to a leader: it goes on there, if that's code
+			b.next_count = a + 1 < 0x10000 && (flags[a + 1] & CFG_CODE);
+		b.routine = b.start;
+		addCfgBlock(g, &b, &cap);
+		++a;
+	}
+
+	//each block belongs to the first routine that gets to it, the entry point's first
+	for(i = 0; i < g->count; ++i)
+		g->blocks[i].routine = 0xFFFF;
+	claimRoutine(g, entry, queue);
+	for(a = 0; a < 0x10000; ++a)
+		if(flags[a] & CFG_ROUTINE)
+			claimRoutine(g, a, queue);
+	free(flags);
+	free(returns);
+	free(work);
+	free(queue);
+	return g;
+}
+void freeCodeGraph(code_graph *g){
+	if(g == NULL)
+		return;
+	free(g->blocks);
+	free(g->block_at);
+	free(g);
+}
+
+static void jsonString(FILE *, const char *);
+
+int writeCodeGraph(const machine *m, const code_graph *g, const char *fName){
+	FILE *out = fopen(fName, "w");
+	size_t len = strlen(fName);
+	int dot = len >= 4 && strcmp(fName + len - 4, ".dot") == 0, i, j, ok, first = 1;
+	char label[64];
+	if(out == NULL){
+		fprintf(stderr, "Can't write \"%s\"\n", fName);
+		return 0;
+	}
+	if(dot){
+		//a cluster for each routine, the calls dashed
+		fprintf(out, "digraph cfg {\n\tnode [shape=box, fontname=monospace];\n");
+		for(i = 0; i < g->count; ++i){
+			const cfg_block *b = &g->blocks[i];
+			if(b->start != b->routine || g->blocks[g->block_at[b->routine]].routine != b->routine)
+				continue;
+			fprintf(out, "\tsubgraph cluster_x%04X {\n\t\tlabel=\"", b->routine);
+			if(symbolize(&m->symbols, b->routine, label, sizeof(label)))
+				fprintf(out, "%s ", label);
+			fprintf(out, "x%04X\";\n", b->routine);
+			for(j = 0; j < g->count; ++j)
+				if(g->blocks[j].routine == b->routine)
+					fprintf(out, "\t\tx%04X [label=\"x%04X-x%04X\"];\n", g->blocks[j].start, g->blocks[j].start, g->blocks[j].end);
+			fprintf(out, "\t}\n");
+		}
+		for(i = 0; i < g->count; ++i){
+			const cfg_block *b = &g->blocks[i];
+			for(j = 0; j < b->next_count; ++j)
+				if(g->block_at[b->next[j]] >= 0)
+					fprintf(out, "\tx%04X -> x%04X;\n", b->start, g->blocks[g->block_at[b->next[j]]].start);
+			if(b->call >= 0 && g->block_at[b->call] >= 0)
+				fprintf(out, "\tx%04X -> x%04X [style=dashed];\n", b->start, (uint16_t) b->call);
+		}
+		fprintf(out, "}\n");
+	}else{
+		fprintf(out, "{\"entry\": \"x%04X\", \"routines\": [", g->entry);
+		for(i = 0; i < g->count; ++i){
+			const cfg_block *b = &g->blocks[i];
+			int blocks = 0, instructions = 0;
+			if(b->start != b->routine || g->blocks[g->block_at[b->routine]].routine != b->routine)
+				continue;
+			for(j = 0; j < g->count; ++j)
+				if(g->blocks[j].routine == b->routine){
+					++blocks;
+					instructions += g->blocks[j].end - g->blocks[j].start + 1;
+				}
+			fprintf(out, "%s\n  {\"entry\": \"x%04X\", \"label\": ", first ? "" : ",", b->routine);
+			if(symbolize(&m->symbols, b->routine, label, sizeof(label)))
+				jsonString(out, label);
+			else
+				fprintf(out, "null");
+			fprintf(out, ", \"blocks\": %d, \"instructions\": %d}", blocks, instructions);
+			first = 0;
+		}
+		fprintf(out, "\n], \"blocks\": [");
+		for(i = 0; i < g->count; ++i){
+			const cfg_block *b = &g->blocks[i];
+			fprintf(out, "%s\n  {\"start\": \"x%04X\", \"end\": \"x%04X\", \"routine\": \"x%04X\", \"next\": [",
+				i ? "," : "", b->start, b->end, b->routine);
+			for(j = 0; j < b->next_count; ++j)
+				fprintf(out, "%s\"x%04X\"", j ? ", " : "", b->next[j]);
+			fprintf(out, "]");
+			if(b->call >= 0)
+				fprintf(out, ", \"call\": \"x%04X\"", (uint16_t) b->call);
+			fprintf(out, "}");
+		}
+		fprintf(out, "\n]}\n");
+	}
+	ok = !ferror(out);
+	if(fclose(out) != 0 || !ok){
+		fprintf(stderr, "Can't write \"%s\"\n", fName);
+		return 0;
+	}
+	return 1;
+}
+
+//A machine of the library interface (lc3sim.h) and how it runs
+struct lc3sim {
+	machine *m;
+	int engine;
+	int failed;	//LC3SIM_ILLEGAL or LC3SIM_BAD_ADRESS once the machine stopped for good, 0 before
+};
+
+//The LC3SIM_ result of a run that ended with the STATUS_ given
+static int simResult(lc3sim *sim, int status){
+	if(status == STATUS_ILLEGAL)
+		sim->failed = LC3SIM_ILLEGAL;
+	else if(status == STATUS_BAD_ADRESS)
+		sim->failed = LC3SIM_BAD_ADRESS;
+	if(sim->failed)
+		return sim->failed;
+	return MCR_POWER(sim->m->mcr) ? LC3SIM_RUNNING : LC3SIM_HALTED;
+}
+
+lc3sim *lc3simCreate(const lc3sim_options *options){
+	lc3sim_options defaults;
+	run_options opts;
+	lc3sim *sim;
+	if(options == NULL){
+		memset(&defaults, 0, sizeof(defaults));
+		options = &defaults;
+	}
+	if(options->engine < 0 || options->engine >= ENGINE_COUNT || (sim = calloc(1, sizeof(lc3sim))) == NULL)
+		return NULL;
+	memset(&opts, 0, sizeof(opts));
+	opts.engine = options->engine;
+	opts.display_latency = options->display_latency;
+	opts.key_latency = options->key_latency;
+	opts.no_fast_forward = options->no_fast_forward;
+	sim->m = newMachine(NULL);
+	init(sim->m);
+	sim->engine = configureMachine(sim->m, &opts);
+	//without an output callback the output is dropped, an illegal instruction's message is kept off stderr
+	sim->m->console.sink = options->io.output;
+	sim->m->console.sink_context = options->io.context;
+	sim->m->console.capture = sim->m->console.discard = options->io.output == NULL;
+	sim->m->keyboard.source = options->io.input;
+	sim->m->keyboard.source_context = options->io.context;
+	return sim;
+}
+
+void lc3simDestroy(lc3sim *sim){
+	if(sim == NULL)
+		return;
+	freeMachine(sim->m);
+	free(sim);
+}
+
+void lc3simReset(lc3sim *sim){
+	machine *m = sim->m;
+	memset(m->memory, 0, MEMORY_BYTES);
+	clearDirty(m);
+	memset(m->regs, 0, sizeof(m->regs));
+	m->pc = 0;
+	m->ir = 0;
+	m->console.out_len = m->console.captured = 0;
+	freeSymbols(&m->symbols);
+	init(m);
+	sim->failed = 0;
+}
+
+int lc3simLoad(lc3sim *sim, const char *fName){
+	return loadFile(sim->m, fName);
+}
+
+int lc3simLoadImage(lc3sim *sim, const void *data, size_t size){
+	return loadImage(sim->m, data, size);
+}
+
+int lc3simAssemble(lc3sim *sim, const char *source, size_t len){
+	return assembleSource(sim->m, source, len, "<source>");
+}
+
+const char *lc3simError(int error){
+	return loadError(error);
+}
+
+int lc3simRun(lc3sim *sim, uint64_t max_cycles){
+	machine *m = sim->m;
+	int status;
+	if(sim->failed || !MCR_POWER(m->mcr))
+		return simResult(sim, 0);
+	setStop(m, max_cycles && max_cycles < UINT64_MAX - m->cycles ? m->cycles + max_cycles : UINT64_MAX);
+	status = runMachine(m, sim->engine);
+	setStop(m, UINT64_MAX);
+	return simResult(sim, status);
+}
+
+int lc3simStep(lc3sim *sim){
+	machine *m = sim->m;
+	int status;
+	if(sim->failed || !MCR_POWER(m->mcr))
+		return simResult(sim, 0);
+	status = step(m) ? STATUS_ILLEGAL : m->fault;
+	setStop(m, UINT64_MAX);
+	consoleFlush(m);
+	return simResult(sim, status);
+}
+
+uint64_t lc3simCycles(const lc3sim *sim){
+	return sim->m->cycles;
+}
+
+int16_t lc3simReadReg(const lc3sim *sim, int reg){
+	if(reg >= 0 && reg < REG_COUNT)
+		return sim->m->regs[reg];
+	switch(reg){
+		case LC3SIM_PC:
+			return sim->m->pc;
+		case LC3SIM_PSR:
+			return readPSR(sim->m);
+		case LC3SIM_IR:
+			return sim->m->ir;
+	}
+	return 0;
+}
+
+void lc3simWriteReg(lc3sim *sim, int reg, int16_t val){
+	if(reg >= 0 && reg < REG_COUNT)
+		sim->m->regs[reg] = val;
+	else if(reg == LC3SIM_PC)
+		sim->m->pc = val;
+	else if(reg == LC3SIM_PSR){
+		writePSR(sim->m, val);
+		updateInterrupts(sim->m);
+	}else if(reg == LC3SIM_IR)
+		sim->m->ir = val;
+}
+
+int16_t lc3simReadMem(const lc3sim *sim, uint16_t adress){
+	return sim->m->memory[adress];
+}
+
+void lc3simWriteMem(lc3sim *sim, uint16_t adress, int16_t val){
+	storeWord(sim->m, adress, val);
+}
+
+int lc3simDirtyPages(const lc3sim *sim, uint64_t bitmap[LC3SIM_PAGE_COUNT / 64]){
+	int page, count = 0;
+	memset(bitmap, 0, LC3SIM_PAGE_COUNT / 8);
+	for(page = 0; page < PAGE_COUNT; ++page)
+		if(sim->m->dirty_pages[page]){
+			bitmap[page / 64] |= (uint64_t) 1 << page % 64;
+			++count;
+		}
+	return count;
+}
+
+void lc3simClearDirty(lc3sim *sim){
+	clearDirty(sim->m);
+}
+
+#if HAVE_THREADS
+//Jobs owned by one worker thread: the owner takes jobs from the front, workers that ran out of their own
+//jobs steal from the back.
+typedef struct {
+	pthread_mutex_t lock;
+	int head, tail;
+} job_queue;
+
+typedef struct {
+	batch_job *jobs;
+	job_queue *queues;
+	int workers;
+	const run_options *opts;
+	const base_image *base;
+} batch_run;
+
+typedef struct {
+	batch_run *run;
+	int id;
+} batch_worker;
+
+//Takes the next job of queue q, from the front for its owner and from the back for a thief. Returns -1 when it's empty.
+static int takeJob(job_queue *q, int steal){
+	int job = -1;
+	pthread_mutex_lock(&q->lock);
+	if(q->head < q->tail)
+		job = steal ? --q->tail : q->head++;
+	pthread_mutex_unlock(&q->lock);
+	return job;
+}
+
+static void *batchWorker(void *arg){
+	batch_worker *w = arg;
+	batch_run *run = w->run;
+	int job, i;
+	for(;;){
+		job = takeJob(&run->queues[w->id], 0);
+		//Jobs are never added, so once every queue came up empty there is nothing left to do.
+		for(i = 1; job < 0 && i < run->workers; ++i)
+			job = takeJob(&run->queues[(w->id + i) % run->workers], 1);
+		if(job < 0)
+			return NULL;
+		runJob(&run->jobs[job], run->opts, run->base);
+	}
+}
+#endif
+
+//Runs the jobs on the number of threads given (0: one per core), one after another where there are no threads
+static void runJobs(batch_job *jobs, int count, int threads, const run_options *opts, const base_image *base){
+	int i;
+#if HAVE_THREADS
+	if(threads <= 0)
+		threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	if(threads > count)
+		threads = count;
+	if(threads > 1){
+		batch_run run;
+		batch_worker *workers = malloc(threads * sizeof(batch_worker));
+		pthread_t *ids = malloc(threads * sizeof(pthread_t));
+		run.jobs = jobs;
+		run.workers = threads;
+		run.opts = opts;
+		run.base = base;
+		run.queues = malloc(threads * sizeof(job_queue));
+		if(workers == NULL || ids == NULL || run.queues == NULL){
+			fprintf(stderr, "Out of memory starting the batch\n");
+			exit(1);
+		}
+		//Every worker starts out owning an equal slice of the manifest.
+		for(i = 0; i < threads; ++i){
+			pthread_mutex_init(&run.queues[i].lock, NULL);
+			run.queues[i].head = (int) ((long long) count * i / threads);
+			run.queues[i].tail = (int) ((long long) count * (i + 1) / threads);
+			workers[i].run = &run;
+			workers[i].id = i;
+		}
+		for(i = 0; i < threads; ++i)
+			if(pthread_create(&ids[i], NULL, batchWorker, &workers[i]) != 0){
+				fprintf(stderr, "Can't start batch worker thread\n");
+				exit(1);
+			}
+		for(i = 0; i < threads; ++i)
+			pthread_join(ids[i], NULL);
+		for(i = 0; i < threads; ++i)
+			pthread_mutex_destroy(&run.queues[i].lock);
+		free(run.queues);
+		free(ids);
+		free(workers);
+	}else
+#else
+	(void) threads;
+#endif
+	for(i = 0; i < count; ++i)
+		runJob(&jobs[i], opts, base);
+}
+
+static int printJobs(const batch_job *, int, const char *, int);
+
+int runBatch(const char *manifest, int threads, const run_options *opts, const char *report){
+	batch_job *jobs = NULL;
+	base_image image, *base = NULL;
+	int count, i, failed = 0;
+
+	count = readManifest(manifest, &jobs);
+	if(count < 0){
+		fprintf(stderr, "Can't read the batch manifest \"%s\"\n", manifest);
+		return 1;
+	}
+	//The OS files the jobs have in common are only loaded once. If one of them can't be read
+	//every job loads its files itself, and reports the error.
+	i = sharedFiles(jobs, count);
+	if(i > 0 && buildBase(&image, jobs[0].files, NULL, i))
+		base = &image;
+	runJobs(jobs, count, threads, opts, base);
+	if(base)
+		freeBase(base);
+
+	failed = printJobs(jobs, count, "job", opts->hash_output);
+	if(report && !writeReport(report, jobs, count))
+		failed = 1;
+	freeManifest(jobs, count);
+	return failed ? 1 : 0;
+}
+
+//Prints the jobs' output in order, each under a "=== job N: file" line (what names them) and with hashes
+//followed by its size and hash, and returns how many failed
+static int printJobs(const batch_job *jobs, int count, const char *what, int hashes){
+	int i, failed = 0;
+	for(i = 0; i < count; ++i){
+		const batch_job *job = &jobs[i];
+		printf("=== %s %d: %s (exit %d, %"PRIu64" instructions)\n", what, i + 1, job->files[job->file_count - 1], job->status, job->cycles);
+		if(job->output_len){
+			fwrite(job->output, 1, job->output_len, stdout);
+			if(job->output[job->output_len - 1] != '\n')
+				putchar('\n');
+		}
+		if(hashes)
+			printf("Output: %"PRIu64" bytes, hash %016"PRIx64"\n", job->output_bytes, job->output_hash);
+		if(job->status != 0)
+			++failed;
+	}
+	fflush(stdout);
+	return failed;
+}
+
+//runMachine() statuses by number, as the report names them
+static const char *const status_names[] = {"halted", "error", "illegal", "cycles", "timeout", "bad_adress", "diverged",
+	"mismatch"};
+
+int writeReport(const char *name, const batch_job *jobs, int count){
+	FILE *out = fopen(name, "w");
+	int i, j, first;
+	if(out == NULL){
+		fprintf(stderr, "Can't write the report \"%s\"\n", name);
+		return 0;
+	}
+	fprintf(out, "{\"jobs\": [");
+	for(i = 0; i < count; ++i){
+		const batch_job *job = &jobs[i];
+		fprintf(out, "%s\n  {\"job\": %d, \"files\": [", i ? "," : "", i + 1);
+		for(j = 0; j < job->file_count; ++j){
+			fprintf(out, "%s", j ? ", " : "");
+			jsonString(out, job->files[j]);
+		}
+		fprintf(out, "]");
+		if(job->input){
+			fprintf(out, ", \"input\": ");
+			jsonString(out, job->input);
+		}
+		if(job->expect){
+			fprintf(out, ", \"expect\": ");
+			jsonString(out, job->expect);
+		}
+		if(job->max_cycles)
+			fprintf(out, ", \"max_cycles\": %"PRIu64, job->max_cycles);
+		fprintf(out, ", \"status\": %d, \"reason\": \"%s\", \"instructions\": %"PRIu64", \"output_bytes\": %"PRIu64
+			", \"output_hash\": \"%016"PRIx64"\"", job->status, job->status >= 0 && job->status <= STATUS_MISMATCH
+			? status_names[job->status] : "unknown", job->cycles, job->output_bytes, job->output_hash);
+		for(j = 0, first = 1; j < 16; ++j)
+			if(job->opcodes[j]){
+				fprintf(out, "%s\"%s\": %"PRIu64, first ? ", \"mix\": {" : ", ", opcode_names[j], job->opcodes[j]);
+				first = 0;
+			}
+		fprintf(out, "%s}", first ? "" : "}");
+	}
+	fprintf(out, "\n]}\n");
+	if(fclose(out) != 0){
+		fprintf(stderr, "Can't write the report \"%s\"\n", name);
+		return 0;
+	}
+	return 1;
+}
+
+int readManifest(const char *name, batch_job **jobs_out){
+	FILE *f = fopen(name, "r");
+	char line[4096];
+	batch_job *jobs = NULL;
+	int count = 0, cap = 0;
+	if(f == NULL)
+		return -1;
+	while(fgets(line, sizeof(line), f)){
+		char *comment = strchr(line, '#'), *p, *end;
+		batch_job *job;
+		if(comment)
+			*comment = '\0';
+		p = line;
+		while(*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+			++p;
+		if(*p == '\0')
+			continue;
+		if(count == cap){
+			cap = cap ? 2 * cap : 64;
+			jobs = realloc(jobs, cap * sizeof(batch_job));
+			if(jobs == NULL){
+				fprintf(stderr, "Out of memory reading the batch manifest\n");
+				exit(1);
+			}
+		}
+		job = &jobs[count++];
+		memset(job, 0, sizeof(*job));
+		//Whitespace separated .obj files and the job's options
+		while(*p){
+			end = p;
+			while(*end && *end != ' ' && *end != '\t' && *end != '\r' && *end != '\n')
+				++end;
+			if(strncmp(p, "--max-cycles=", 13) == 0)
+				job->max_cycles = strtoull(p + 13, NULL, 10);
+			else if(strncmp(p, "--input=", 8) == 0 || strncmp(p, "--expect=", 9) == 0){
+				char **name = p[2] == 'i' ? &job->input : &job->expect;
+				const char *value = strchr(p, '=') + 1;
+				free(*name);
+				*name = malloc(end - value + 1);
+				if(*name == NULL){
+					fprintf(stderr, "Out of memory reading the batch manifest\n");
+					exit(1);
+				}
+				memcpy(*name, value, end - value);
+				(*name)[end - value] = '\0';
+			}else{
+				job->files = realloc(job->files, (job->file_count + 1) * sizeof(char *));
+				job->files[job->file_count] = malloc(end - p + 1);
+				if(job->files == NULL || job->files[job->file_count] == NULL){
+					fprintf(stderr, "Out of memory reading the batch manifest\n");
+					exit(1);
+				}
+				memcpy(job->files[job->file_count], p, end - p);
+				job->files[job->file_count++][end - p] = '\0';
+			}
+			p = end;
+			while(*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+				++p;
+		}
+		if(job->file_count == 0){	//just options, there's nothing to run
+			free(job->input);
+			free(job->expect);
+			--count;
+		}
+	}
+	fclose(f);
+	*jobs_out = jobs;
+	return count;
+}
+
+void freeManifest(batch_job *jobs, int count){
+	int i, j;
+	for(i = 0; i < count; ++i){
+		for(j = 0; j < jobs[i].file_count; ++j)
+			free(jobs[i].files[j]);
+		free(jobs[i].files);
+		free(jobs[i].input);
+		free(jobs[i].expect);
+		free(jobs[i].output);
+	}
+	free(jobs);
+}
+
+int sharedFiles(const batch_job *jobs, int count){
+	int shared = count > 0 ? jobs[0].file_count - 1 : 0, i, j;
+	for(i = 1; i < count && shared > 0; ++i){
+		if(jobs[i].file_count - 1 < shared)
+			shared = jobs[i].file_count - 1;
+		for(j = 0; j < shared; ++j)
+			if(strcmp(jobs[i].files[j], jobs[0].files[j]) != 0)
+				shared = j;
+	}
+	return shared;
+}
+
+//Keys of an input held in memory (a --worker job's), as a keyboard source
+typedef struct {
+	const uint8_t *data;
+	size_t size, pos;
+} memory_keys;
+
+static size_t memoryKeys(void *context, unsigned char *buf, size_t size){
+	memory_keys *keys = context;
+	if(size > keys->size - keys->pos)
+		size = keys->size - keys->pos;
+	memcpy(buf, keys->data + keys->pos, size);
+	keys->pos += size;
+	return size;
+}
+
+void runJob(batch_job *job, const run_options *opts, const base_image *base){
+	machine *m = newMachine(base);
+	run_options job_opts = *opts;
+	memory_keys keys;
+	uint8_t *expected = NULL;
+	int i, load, engine;
+	m->console.capture = 1;
+	job->status = 0;
+	init(m);
+	if(base)
+		setState(m, &base->state);
+	for(i = base ? base->file_count : 0; i < job->file_count; ++i){
+		load = job->data ? loadData(m, job->files[i], job->data[i].data, job->data[i].size) : loadFile(m, job->files[i]);
+		if(load < 0){
+			char message[300];
+			int len = snprintf(message, sizeof(message), "Can't load \"%s\": %s\n", job->files[i], loadError(load));
+			consoleCapture(m, message, len < (int) sizeof(message) ? len : (int) sizeof(message) - 1);
+			job->status = STATUS_ERROR;
+			break;
+		}
+	}
+	if(job->status == 0 && job->input){
+		if(job->data){
+			keys.data = job->data[job->file_count].data;
+			keys.size = job->data[job->file_count].size;
+			keys.pos = 0;
+			m->keyboard.source = memoryKeys;
+			m->keyboard.source_context = &keys;
+		}else if((m->keyboard.in = fopen(job->input, "rb")) == NULL){
+			char message[300];
+			int len = snprintf(message, sizeof(message), "Can't read the input \"%s\"\n", job->input);
+			consoleCapture(m, message, len < (int) sizeof(message) ? len : (int) sizeof(message) - 1);
+			job->status = STATUS_ERROR;
+		}
+	}
+	if(job->status == 0 && job->expect){
+		if(job->data){
+			job_opts.expected = job->data[job->file_count + 1].data;
+			job_opts.expected_len = job->data[job->file_count + 1].size;
+		}else if((job_opts.expected = expected = readWholeFile(job->expect, &job_opts.expected_len)) == NULL){
+			char message[300];
+			int len = snprintf(message, sizeof(message), "Can't read the expected output \"%s\"\n", job->expect);
+			consoleCapture(m, message, len < (int) sizeof(message) ? len : (int) sizeof(message) - 1);
+			job->status = STATUS_ERROR;
+		}
+	}
+	if(job->status == 0){
+		char message[256];
+		int len;
+		if(job->max_cycles)
+			job_opts.max_cycles = job->max_cycles;
+		engine = configureMachine(m, &job_opts);
+		if(opts->profile){	//the profile sees every instruction, on the switch engine
+			engine = ENGINE_SWITCH;
+			m->fast_forward = 0;
+			startProfile(m);
+		}
+		job->status = runMachine(m, engine);
+		if(m->profile)
+			memcpy(job->opcodes, m->profile->opcodes, sizeof(job->opcodes));
+		if((len = stopMessage(m, job->status, message, sizeof(message))) > 0){
+			if(m->console.out_len && m->console.out[m->console.out_len - 1] != '\n')
+				consoleCapture(m, "\n", 1);
+			consoleCapture(m, message, len);
+		}
+	}
+	job->cycles = m->cycles;
+	job->output = m->console.out;
+	job->output_len = m->console.out_len;
+	job->output_bytes = m->output.bytes;
+	job->output_hash = m->output.hash;
+	m->console.out = NULL;
+	if(m->keyboard.in)
+		fclose(m->keyboard.in);
+	freeMachine(m);
+	free(expected);
+}
+
+//--lanes: LANE_COUNT machines running the same program, with their registers and CC kept by lane (a vector
+//register each) so that the lanes at the same PC run its instruction as one vector operation. The lanes at the
+//lowest PC go first, so lanes a branch took apart meet again where the paths join. Memory, the devices and the
+//console stay each machine's own: what a lane can't run in the vector (device adresses, RTI, fast traps, a
+//device event or interrupt due) the machine runs on its own with step().
+#define LANE_COUNT (8)
+
+typedef union {
+#if defined(__SSE2__)
+	__m128i v;
+#endif
+	int16_t lane[LANE_COUNT];
+} lane_vector;
+
+typedef struct {
+	machine *m[LANE_COUNT];
+	lane_vector regs[REG_COUNT];
+	lane_vector cc;		//each machine's cc_value
+	uint16_t pc[LANE_COUNT];
+	int running;		//lanes still running, a bit each
+	int status[LANE_COUNT];	//finishRun()'s, once a lane stopped
+	uint64_t written[0x10000 / 64];	//adresses a lane wrote, a bit each: where the lanes' memory can differ
+} lane_group;
+
+#define LANE_WRITTEN(g, adress) ((g)->written[(adress) >> 6] >> ((adress) & 63) & 1)
+
+static ALWAYS_INLINE lane_vector laneSplat(int16_t x){
+	lane_vector r;
+#if defined(__SSE2__)
+	r.v = _mm_set1_epi16(x);
+#else
+	int l;
+	for(l = 0; l < LANE_COUNT; ++l)
+		r.lane[l] = x;
+#endif
+	return r;
+}
+
+//ADD, AND and NOT of every lane
+static ALWAYS_INLINE lane_vector laneAlu(int opcode, lane_vector a, lane_vector b){
+	lane_vector r;
+#if defined(__SSE2__)
+	r.v = opcode == ADD_OP ? _mm_add_epi16(a.v, b.v) : opcode == AND_OP ? _mm_and_si128(a.v, b.v)
+		: _mm_xor_si128(a.v, _mm_set1_epi16(-1));
+#else
+	int l;
+	for(l = 0; l < LANE_COUNT; ++l)
+		r.lane[l] = opcode == ADD_OP ? a.lane[l] + b.lane[l] : opcode == AND_OP ? a.lane[l] & b.lane[l] : ~a.lane[l];
+#endif
+	return r;
+}
+
+//b in the lanes of mask (a bit each), a in the others
+static ALWAYS_INLINE lane_vector laneSelect(lane_vector a, lane_vector b, int mask){
+	lane_vector r;
+#if defined(__SSE2__)
+	const __m128i bits = _mm_set_epi16(128, 64, 32, 16, 8, 4, 2, 1);
+	__m128i m = _mm_cmpeq_epi16(_mm_and_si128(_mm_set1_epi16(mask), bits), bits);
+	r.v = _mm_or_si128(_mm_and_si128(m, b.v), _mm_andnot_si128(m, a.v));
+#else
+	int l;
+	for(l = 0; l < LANE_COUNT; ++l)
+		r.lane[l] = mask >> l & 1 ? b.lane[l] : a.lane[l];
+#endif
+	return r;
+}
+
+//The lanes (a bit each) whose CC a BR with the nzp bits given takes
+static ALWAYS_INLINE int laneTaken(lane_vector cc, int nzp){
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	__m128i taken = _mm_or_si128(_mm_or_si128(
+		_mm_and_si128(_mm_cmplt_epi16(cc.v, zero), _mm_set1_epi16(nzp & 4 ? -1 : 0)),
+		_mm_and_si128(_mm_cmpeq_epi16(cc.v, zero), _mm_set1_epi16(nzp & 2 ? -1 : 0))),
+		_mm_and_si128(_mm_cmpgt_epi16(cc.v, zero), _mm_set1_epi16(nzp & 1 ? -1 : 0)));
+	return _mm_movemask_epi8(_mm_packs_epi16(taken, zero));
+#else
+	int l, taken = 0;
+	for(l = 0; l < LANE_COUNT; ++l)
+		if(CC_BITS(cc.lane[l]) & nzp)
+			taken |= 1 << l;
+	return taken;
+#endif
+}
+
+//Puts the lane's registers, PC and CC in its machine, and back
+static void laneOut(lane_group *g, int l){
+	machine *m = g->m[l];
+	int r;
+	for(r = 0; r < REG_COUNT; ++r)
+		m->regs[r] = g->regs[r].lane[l];
+	m->pc = g->pc[l];
+	m->cc_value = g->cc.lane[l];
+}
+
+static void laneIn(lane_group *g, int l){
+	const machine *m = g->m[l];
+	int r;
+	for(r = 0; r < REG_COUNT; ++r)
+		g->regs[r].lane[l] = m->regs[r];
+	g->pc[l] = m->pc;
+	g->cc.lane[l] = m->cc_value;
+}
+
+//Marks all of the pages the lane's machine wrote on its own (an interrupt's pushes, a trap routine's stores) as
+//written in the group, the vector's stores mark just their adress. The machine's own map is cleared for the next.
+static void laneWrote(lane_group *g, int l){
+	machine *m = g->m[l];
+	int page;
+	for(page = 0; page < PAGE_COUNT; ++page)
+		if(m->dirty_pages[page]){
+			memset(&g->written[page << PAGE_SHIFT >> 6], 0xFF, (1 << PAGE_SHIFT) / 8);
+			m->dirty_pages[page] = 0;
+		}
+}
+
+//Runs the lane's next instruction on its own machine
+static void laneStep(lane_group *g, int l){
+	machine *m = g->m[l];
+	int illegal;
+	laneOut(g, l);
+	illegal = step(m);
+	laneWrote(g, l);
+	if(illegal || !MCR_POWER(m->mcr)){
+		g->status[l] = finishRun(m, illegal);
+		g->running &= ~(1 << l);
+	}else
+		laneIn(g, l);
+}
+
+//Runs the lanes of mask, all at pc, together in the vector for up to quiet instructions: until a branch takes
+//them apart or the next instruction is one a lane has to run on its own. Returns 0 when that was the first
+//instruction.
+static int laneRun(lane_group *g, int mask, uint16_t pc, uint64_t quiet){
+	const int16_t *code = g->m[__builtin_ctz(mask)]->memory;
+	uint64_t n = 0;
+	int16_t ir = 0, last = 0;	//the instruction looked at, the last one run
+	int l, split = 0;
+	for(; n < quiet && !split; ++n){
+		uint16_t next = pc + 1, adress;
+		lane_vector r;
+		ir = code[pc];
+		if(LANE_WRITTEN(g, pc))	//the lanes' memory is the same image where none of them wrote
+			for(l = 0; l < LANE_COUNT; ++l)
+				if(mask >> l & 1 && g->m[l]->memory[pc] != ir)
+					goto done;
+		switch(OPCODE(ir)){
+			case ADD_OP: case AND_OP: case NOT_OP:
+				r = laneAlu(OPCODE(ir), g->regs[REG2(ir)], IMMBIT(ir) ? laneSplat(IMMVAL(ir)) : g->regs[REG3(ir)]);
+				g->regs[REG1(ir)] = laneSelect(g->regs[REG1(ir)], r, mask);
+				g->cc = laneSelect(g->cc, r, mask);
+				break;
+			case LEA_OP:
+				r = laneSplat(next + PCOFFSET9(ir));
+				g->regs[REG1(ir)] = laneSelect(g->regs[REG1(ir)], r, mask);
+				g->cc = laneSelect(g->cc, r, mask);
+				break;
+			case BR_OP:{
+				int taken = laneTaken(g->cc, ir >> 9 & 7) & mask;
+				if(taken == mask)
+					next += PCOFFSET9(ir);
+				else if(taken){	//apart
+					for(l = 0; l < LANE_COUNT; ++l)
+						if(mask >> l & 1)
+							g->pc[l] = taken >> l & 1 ? next + PCOFFSET9(ir) : next;
+					split = 1;
+				}
+				break;
+			}
+			case JSR_OP: case RET_OP:
+				if(OPCODE(ir) == JSR_OP && ir & 0x0800)
+					next += PCOFFSET11(ir);
+				else{	//JSRR and JMP go where each lane's register points, JSRR R7 to the old R7
+					uint16_t target = next;
+					for(l = 0; l < LANE_COUNT; ++l)
+						if(mask >> l & 1){
+							g->pc[l] = g->regs[REG2(ir)].lane[l];
+							if(target == next)
+								target = g->pc[l];
+							else if(g->pc[l] != target)
+								split = 1;
+						}
+					next = target;
+				}
+				if(OPCODE(ir) == JSR_OP)
+					g->regs[7] = laneSelect(g->regs[7], laneSplat(pc + 1), mask);
+				break;
+			case TRAP_OP:
+				//fast traps run on the machines, guest routines in the vector (where no lane wrote the table)
+				for(l = 0; l < LANE_COUNT; ++l)
+					if(mask >> l & 1 && g->m[l]->trap_service[ir & 0xFF] != TRAP_GUEST)
+						goto done;
+				if(LANE_WRITTEN(g, ir & 0xFF))
+					goto done;
+				g->regs[7] = laneSelect(g->regs[7], laneSplat(next), mask);
+				next = code[ir & 0xFF];
+				break;
+			case LD_OP: case LDI_OP: case LDR_OP: case ST_OP: case STI_OP: case STR_OP:{
+				//each lane's own memory, at the same adress but for LDR/STR and the pointers of LDI/STI. Lanes run
+				//the switch engine, so there is nothing predecoded to drop on a store
+				uint16_t adresses[LANE_COUNT];
+				int store = OPCODE(ir) == ST_OP || OPCODE(ir) == STI_OP || OPCODE(ir) == STR_OP;
+				for(l = 0; l < LANE_COUNT; ++l)
+					if(mask >> l & 1){
+						adress = OPCODE(ir) == LDR_OP || OPCODE(ir) == STR_OP ? g->regs[REG2(ir)].lane[l] + PCOFFSET6(ir)
+							: next + PCOFFSET9(ir);
+						if((OPCODE(ir) == LDI_OP || OPCODE(ir) == STI_OP) && adress < IO_SPACE_START)
+							adress = g->m[l]->memory[adress];
+						if(adress >= IO_SPACE_START)
+							goto done;	//devices are the machines'
+						adresses[l] = adress;
+					}
+				for(l = 0; l < LANE_COUNT; ++l)
+					if(mask >> l & 1){
+						machine *m = g->m[l];
+						if(store){
+							m->memory[adresses[l]] = g->regs[REG1(ir)].lane[l];
+							g->written[adresses[l] >> 6] |= (uint64_t) 1 << (adresses[l] & 63);
+						}else
+							g->regs[REG1(ir)].lane[l] = g->cc.lane[l] = m->memory[adresses[l]];
+					}
+				break;
+			}
+			default:	//RTI and the reserved opcode
+				goto done;
+		}
+		last = ir;
+		pc = next;
+	}
+done:
+	for(l = 0; l < LANE_COUNT; ++l)
+		if(mask >> l & 1){
+			machine *m = g->m[l];
+			m->cycles += n;
+			if(n)
+				m->ir = last;
+			if(!split)
+				g->pc[l] = pc;
+		}
+	return n > 0;
+}
+
+//Runs the group until every lane stopped
+static void runLaneGroup(lane_group *g){
+	while(g->running){
+		uint16_t pc = 0xFFFF;
+		uint64_t quiet = UINT64_MAX;
+		int16_t ir = 0;
+		int mask = 0, l;
+		for(l = 0; l < LANE_COUNT; ++l)
+			if(g->running >> l & 1 && g->pc[l] < pc)
+				pc = g->pc[l];
+		for(l = 0; l < LANE_COUNT; ++l){
+			machine *m = g->m[l];
+			if(!(g->running >> l & 1) || g->pc[l] != pc)
+				continue;
+			if(m->cycles >= m->service_at){	//a device event or interrupt due, or the end of its cycles
+				laneOut(g, l);
+				if(m->cycles >= m->stop_at){
+					g->status[l] = finishRun(m, 0);
+					g->running &= ~(1 << l);
+				}else{
+					serviceMachine(m);
+					laneWrote(g, l);
+					laneIn(g, l);
+				}
+				continue;
+			}
+			//lanes whose memory holds something else there (self-modifying code) run it after these
+			if(mask == 0)
+				ir = m->memory[pc];
+			if(m->memory[pc] == ir){
+				mask |= 1 << l;
+				if(m->service_at - m->cycles < quiet)
+					quiet = m->service_at - m->cycles;
+			}
+		}
+		if(mask && !laneRun(g, mask, pc, quiet))
+			for(l = 0; l < LANE_COUNT; ++l)
+				if(mask >> l & 1)
+					laneStep(g, l);
+	}
+}
+
+int runLanes(const char *list, const char *const *files, int file_count, const run_options *opts){
+	batch_job *runs = NULL;
+	base_image image;
+	run_options lane_opts = *opts;
+	int count = readManifest(list, &runs), i, l, failed;
+	if(count < 0){
+		fprintf(stderr, "Can't read the list of inputs \"%s\"\n", list);
+		return 1;
+	}
+	if(!buildBase(&image, (char *const *) files, NULL, file_count)){
+		freeManifest(runs, count);
+		return 1;
+	}
+	lane_opts.engine = ENGINE_SWITCH;	//the lanes are the engine
+	for(i = 0; i < count; i += LANE_COUNT){
+		uint8_t *expected[LANE_COUNT] = {NULL};	//the inputs' own --expect= outputs
+		lane_group g;
+		memset(&g, 0, sizeof(g));
+		for(l = 0; l < LANE_COUNT && i + l < count; ++l){
+			machine *m = g.m[l] = newMachine(&image);
+			m->console.capture = 1;
+			init(m);
+			setState(m, &image.state);
+			m->keyboard.in = fopen(runs[i + l].files[0], "rb");
+			if(m->keyboard.in == NULL){
+				char message[300];
+				int len = snprintf(message, sizeof(message), "Can't read the input \"%s\"\n", runs[i + l].files[0]);
+				consoleCapture(m, message, len < (int) sizeof(message) ? len : (int) sizeof(message) - 1);
+				g.status[l] = STATUS_ERROR;
+				continue;
+			}
+			configureMachine(m, &lane_opts);
+			if(runs[i + l].expect){
+				if((expected[l] = readWholeFile(runs[i + l].expect, &m->output.expected_len)) == NULL){
+					char message[300];
+					int len = snprintf(message, sizeof(message), "Can't read the expected output \"%s\"\n", runs[i + l].expect);
+					consoleCapture(m, message, len < (int) sizeof(message) ? len : (int) sizeof(message) - 1);
+					g.status[l] = STATUS_ERROR;
+					continue;
+				}
+				m->output.expected = expected[l];
+			}
+			clearDirty(m);	//all lanes start from the same image
+			laneIn(&g, l);
+			g.running |= 1 << l;
+		}
+		runLaneGroup(&g);
+		for(l = 0; l < LANE_COUNT && i + l < count; ++l){
+			machine *m = g.m[l];
+			batch_job *run = &runs[i + l];
+			char message[256];
+			int len;
+			if((len = stopMessage(m, g.status[l], message, sizeof(message))) > 0){
+				if(m->console.out_len && m->console.out[m->console.out_len - 1] != '\n')
+					consoleCapture(m, "\n", 1);
+				consoleCapture(m, message, len);
+			}
+			run->status = g.status[l];
+			run->cycles = m->cycles;
+			run->output = m->console.out;
+			run->output_len = m->console.out_len;
+			run->output_bytes = m->output.bytes;
+			run->output_hash = m->output.hash;
+			m->console.out = NULL;
+			if(m->keyboard.in)
+				fclose(m->keyboard.in);
+			freeMachine(m);
+			free(expected[l]);
+		}
+	}
+	freeBase(&image);
+	failed = printJobs(runs, count, "input", opts->hash_output);
+	freeManifest(runs, count);
+	return failed ? 1 : 0;
+}
+
+//Prints the string as a JSON string literal
+static void jsonString(FILE *out, const char *str){
+	fputc('"', out);
+	for(; *str; ++str){
+		if(*str == '"' || *str == '\\')
+			fprintf(out, "\\%c", *str);
+		else if((unsigned char) *str < 0x20)
+			fprintf(out, "\\u%04x", *str);
+		else
+			fputc(*str, out);
+	}
+	fputc('"', out);
+}
+
+static int compareTimes(const void *a, const void *b){
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return (x > y) - (x < y);
+}
+
+//Loads the job onto a fresh machine for the engine given, with its output discarded.
+//Returns NULL and prints why when a file can't be loaded.
+static machine *benchMachine(const batch_job *job, const run_options *opts, int engine){
+	machine *m = newMachine(NULL);
+	run_options engine_opts = *opts;
+	int i, load;
+	m->console.capture = 1;	//keeps an illegal instruction's message out of the terminal
+	m->console.discard = 1;
+	init(m);
+	for(i = 0; i < job->file_count; ++i)
+		if((load = loadFile(m, job->files[i])) < 0){
+			fprintf(stderr, "Can't load \"%s\": %s\n", job->files[i], loadError(load));
+			freeMachine(m);
+			return NULL;
+		}
+	engine_opts.engine = engine;
+	configureMachine(m, &engine_opts);
+	return m;
+}
+
+int runBench(const char *manifest, const char *const *files, int file_count, const run_options *opts,
+		const uint8_t *engines, int runs, int warmup){
+	batch_job *jobs, single;
+	int count, i, j, e, r, status = 0;
+	//sorted run times of each engine
+	uint64_t *times = malloc(ENGINE_COUNT * runs * sizeof(uint64_t));
+
+	if(times == NULL){
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	if(manifest){
+		count = readManifest(manifest, &jobs);
+		if(count < 0){
+			fprintf(stderr, "Can't read the manifest \"%s\"\n", manifest);
+			free(times);
+			return 1;
+		}
+	}else{
+		memset(&single, 0, sizeof(single));
+		single.files = (char **) files;
+		single.file_count = file_count;
+		jobs = &single;
+		count = 1;
+	}
+
+	printf("{\"runs\": %d, \"warmup\": %d, \"benchmarks\": [", runs, warmup);
+	for(i = 0; i < count; ++i){
+		const batch_job *job = &jobs[i];
+		const char *name = job->file_count ? job->files[job->file_count - 1] : "";
+		uint64_t mix[16] = {0}, instructions = 0;
+		const char *error = NULL;
+		int timed = 0, first;
+		machine *m;
+
+		if(strrchr(name, '/'))
+			name = strrchr(name, '/') + 1;
+
+		//One untimed run on the reference interpreter counts the instructions by opcode
+		m = benchMachine(job, opts, ENGINE_SWITCH);
+		if(m == NULL)
+			error = "can't load the files";
+		else{
+			while(MCR_POWER(m->mcr) && !error){
+				++mix[OPCODE((uint16_t) m->memory[m->pc])];
+				if(step(m))
+					error = "illegal instruction";
+			}
+			instructions = m->cycles;
+			freeMachine(m);
+		}
+		for(e = 0; e < ENGINE_COUNT && !error; ++e){
+			uint64_t *engine_times = times + e * runs;
+			if(!engines[e])
+				continue;
+			for(r = -warmup; r < runs && !error; ++r){
+				uint64_t start;
+				m = benchMachine(job, opts, e);
+				start = nowNs();
+				if(runMachine(m, e) != 0)
+					error = "illegal instruction";
+				else if(m->cycles != instructions)
+					error = "the engines don't agree on the instruction count";
+				else if(r >= 0)
+					engine_times[r] = nowNs() - start;
+				freeMachine(m);
+			}
+			if(!error){
+				qsort(engine_times, runs, sizeof(uint64_t), compareTimes);
+				timed |= 1 << e;
+			}
+		}
+
+		printf("%s\n  {\"name\": ", i ? "," : "");
+		jsonString(stdout, name);
+		printf(", \"files\": [");
+		for(j = 0; j < job->file_count; ++j){
+			printf("%s", j ? ", " : "");
+			jsonString(stdout, job->files[j]);
+		}
+		printf("], \"instructions\": %" PRIu64 ", \"mix\": {", instructions);
+		for(j = 0, first = 1; j < 16; ++j)
+			if(mix[j]){
+				printf("%s\"%s\": %" PRIu64, first ? "" : ", ", opcode_names[j], mix[j]);
+				first = 0;
+			}
+		printf("}, \"engines\": {");
+		for(e = 0, first = 1; e < ENGINE_COUNT; ++e){
+			const uint64_t *engine_times = times + e * runs;
+			uint64_t median;
+			double mips, ns;
+			if(!(timed & 1 << e))
+				continue;
+			median = runs % 2 ? engine_times[runs / 2] : (engine_times[runs / 2 - 1] + engine_times[runs / 2]) / 2;
+			mips = instructions * 1e3 / (median ? median : 1);
+			ns = (double) median / (instructions ? instructions : 1);
+			printf("%s\n    \"%s\": {\"median_ns\": %" PRIu64 ", \"best_ns\": %" PRIu64 ", \"mips\": %.2f, "
+				"\"ns_per_instruction\": %.3f, \"times_ns\": [", first ? "" : ",", engine_names[e], median,
+				engine_times[0], mips, ns);
+			for(r = 0; r < runs; ++r)
+				printf("%s%" PRIu64, r ? ", " : "", engine_times[r]);
+			printf("]}");
+			first = 0;
+			fprintf(stderr, "%-16s %-9s %9.2f MIPS %8.3f ns/instruction  (%" PRIu64 " instructions, median of %d)\n",
+				name, engine_names[e], mips, ns, instructions, runs);
+		}
+		printf("}");
+		if(error){
+			fprintf(stderr, "%-16s %s\n", name, error);
+			printf(", \"error\": ");
+			jsonString(stdout, error);
+			status = 1;
+		}
+		printf("}");
+	}
+	printf("\n]}\n");
+	if(manifest)
+		freeManifest(jobs, count);
+	free(times);
+	return status;
+}
+
+//An .obj file in host memory, mapped when the host has mmap()
+typedef struct {
+	const uint8_t *data;
+	size_t size;
+} object_file;
+
+//One segment of an object file: its origin and length in words, then where its big endian words are
+typedef struct {
+	uint16_t origin;
+	uint32_t length;
+	const uint8_t *words;
+} segment;
+
+static int openObject(object_file *f, const char *fName){
+	struct stat stats;
+	f->data = NULL;
+	f->size = 0;
+#if HAVE_MMAP
+	int fd = open(fName, O_RDONLY);
+	if(fd < 0)
+		return 0;
+	if(fstat(fd, &stats) != 0){
+		close(fd);
+		return 0;
+	}
+	f->size = stats.st_size;
+	if(f->size > 0){
+		void *data = mmap(NULL, f->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(data == MAP_FAILED){
+			close(fd);
+			return 0;
+		}
+		f->data = data;
+	}
+	close(fd);
+	return 1;
+#else
+	FILE *infile;
+	if(stat(fName, &stats) != 0 || (infile = fopen(fName, "rb")) == NULL)
+		return 0;
+	f->size = stats.st_size;
+	uint8_t *data = malloc(f->size ? f->size : 1);
+	if(data == NULL || fread(data, 1, f->size, infile) != f->size){
+		free(data);
+		fclose(infile);
+		return 0;
+	}
+	fclose(infile);
+	f->data = data;
+	return 1;
+#endif
+}
+
+static void closeObject(object_file *f){
+#if HAVE_MMAP
+	if(f->data)
+		munmap((void *) f->data, f->size);
+#else
+	free((void *) f->data);
+#endif
+}
+
+//Splits the file into its segments and checks every one fits in memory. Returns the segment count
+//(segments is malloc'd then) or a LOAD_ error.
+static int splitObject(const object_file *f, segment **segments){
+	const uint8_t *p = f->data, *end = f->data + f->size;
+	int count = 1, error = 0, i;
+	int container = f->size >= CONTAINER_MAGIC_LEN + 2 && memcmp(p, CONTAINER_MAGIC, CONTAINER_MAGIC_LEN) == 0;
+
+	*segments = NULL;
+	if(container){
+		count = bigEndian(p + CONTAINER_MAGIC_LEN);
+		p += CONTAINER_MAGIC_LEN + 2;
+		if(count == 0)
+			return LOAD_BAD_CONTAINER;
+	}else if(f->size < 2 || f->size % 2)
+		return LOAD_TRUNCATED;
+	*segments = malloc(count * sizeof(segment));
+	if(*segments == NULL)
+		return LOAD_CANT_READ;
+	for(i = 0; i < count && !error; ++i){
+		segment *seg = *segments + i;
+		if(!container){	//plain .obj, everything after the origin is the segment
+			seg->origin = bigEndian(p);
+			seg->length = (f->size - 2) / 2;
+			p += 2;
+		}else if(end - p < 4){
+			error = LOAD_TRUNCATED;
+			break;
+		}else{
+			seg->origin = bigEndian(p);
+			seg->length = bigEndian(p + 2);
+			p += 4;
+			if((size_t) (end - p) < seg->length * 2)
+				error = LOAD_TRUNCATED;
+		}
+		seg->words = p;
+		p += seg->length * 2;
+		if(!error && seg->origin + seg->length > 0x10000)
+			error = LOAD_OUT_OF_RANGE;
+	}
+	if(!error && p != end)
+		error = LOAD_BAD_CONTAINER;
+	if(error){
+		free(*segments);
+		*segments = NULL;
+		return error;
+	}
+	return count;
+}
+
+//Copies count big endian words from src to dst in host order
+static void swapWords(int16_t *dst, const uint8_t *src, size_t count){
+	size_t i = 0;
+#if defined(__SSE2__)
+	for(; i + 8 <= count; i += 8){
+		__m128i w = _mm_loadu_si128((const __m128i *) (src + 2 * i));
+		_mm_storeu_si128((__m128i *) (dst + i), _mm_or_si128(_mm_slli_epi16(w, 8), _mm_srli_epi16(w, 8)));
+	}
+#elif defined(__ARM_NEON)
+	for(; i + 8 <= count; i += 8)
+		vst1q_s16(dst + i, vreinterpretq_s16_u8(vrev16q_u8(vld1q_u8(src + 2 * i))));
+#endif
+	for(; i < count; ++i)
+		dst[i] = (int16_t) bigEndian(src + 2 * i);
+}
+
+//Reads the machine_state of a snapshot header
+static void readSnapshotState(const uint8_t *p, machine_state *state){
+	int i;
+	p += SNAPSHOT_MAGIC_LEN;
+	state->cycles = 0;
+	for(i = 0; i < 4; ++i)
+		state->cycles = state->cycles << 16 | bigEndian(p + 2 * i);
+	state->display_busy = (uint32_t) bigEndian(p + 8) << 16 | bigEndian(p + 10);
+	p += 12;
+	for(i = 0; i < REG_COUNT; ++i, p += 2)
+		state->regs[i] = bigEndian(p);
+	state->pc = bigEndian(p);
+	state->ir = bigEndian(p + 2);
+	state->psr = bigEndian(p + 4);
+	state->cc_value = bigEndian(p + 6);
+	state->mcr = bigEndian(p + 8);
+	state->display_status = bigEndian(p + 10);
+	state->display_data = bigEndian(p + 12);
+	state->saved_usp = bigEndian(p + 14);
+	state->saved_ssp = bigEndian(p + 16);
+	state->keyboard_status = bigEndian(p + 18);
+	state->keyboard_data = bigEndian(p + 20);
+	state->timer_status = bigEndian(p + 22);
+	state->timer_interval = bigEndian(p + 24);
+	state->timer_busy = bigEndian(p + 26);
+}
+
+//Forgets the labels from adress from up to to (exclusive), when something else is loaded there
+static void dropSymbols(symbol_table *table, uint16_t from, uint32_t to){
+	size_t i, kept = 0;
+	for(i = 0; i < table->count; ++i){
+		symbol s = table->entries[i];
+		if(s.adress >= from && s.adress < to)
+			continue;
+		if(s.adress < from && s.limit > from)
+			s.limit = from;
+		table->entries[kept++] = s;
+	}
+	table->count = kept;
+}
+
+int loadFile(machine *m, const char* fName){
+	object_file f;
+	int status;
+
+	if(!openObject(&f, fName))
+		return LOAD_CANT_READ;
+	status = loadData(m, fName, f.data, f.size);
+	closeObject(&f);
+	return status;
+}
+
+uint8_t *readWholeFile(const char *fName, size_t *len){
+	FILE *infile = fopen(fName, "rb");
+	uint8_t *data = NULL;
+	size_t cap = 0, got;
+	if(infile == NULL)
+		return NULL;
+	*len = 0;
+	do{
+		if(*len == cap){
+			uint8_t *more = realloc(data, cap = cap ? 2 * cap : 4096);
+			if(more == NULL){
+				fprintf(stderr, "Out of memory reading \"%s\"\n", fName);
+				exit(1);
+			}
+			data = more;
+		}
+		got = fread(data + *len, 1, cap - *len, infile);
+		*len += got;
+	}while(got > 0);
+	if(ferror(infile)){
+		free(data);
+		data = NULL;
+	}
+	fclose(infile);
+	return data;
+}
+
+int loadData(machine *m, const char *fName, const void *data, size_t size){
+	size_t len = strlen(fName);
+	if(len > 4 && fName[len - 4] == '.' && tolower((unsigned char) fName[len - 3]) == 'a'
+		&& tolower((unsigned char) fName[len - 2]) == 's' && tolower((unsigned char) fName[len - 1]) == 'm')
+		return assembleSource(m, (const char *) data, size, fName);
+	return loadImage(m, data, size);
+}
+
+int loadImage(machine *m, const void *data, size_t size){
+	object_file f, image;
+	segment *segments;
+	int count, i, snapshot;
+
+	f.data = data;
+	f.size = size;
+	//a snapshot's memory is the container after its header
+	snapshot = f.size >= SNAPSHOT_MAGIC_LEN && memcmp(f.data, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN - 1) == 0;
+	image = f;
+	if(snapshot){
+		image.data += SNAPSHOT_HEADER_LEN;
+		image.size -= SNAPSHOT_HEADER_LEN;
+		if(f.size < SNAPSHOT_HEADER_LEN + CONTAINER_MAGIC_LEN || f.data[SNAPSHOT_MAGIC_LEN - 1] != SNAPSHOT_MAGIC[SNAPSHOT_MAGIC_LEN - 1]
+			|| memcmp(image.data, CONTAINER_MAGIC, CONTAINER_MAGIC_LEN) != 0)
+			return LOAD_BAD_SNAPSHOT;
+	}
+	count = splitObject(&image, &segments);
+	if(count > 0){
+		if(snapshot){
+			memset(m->memory, 0, MEMORY_BYTES);
+			markDirty(m, 0, 0x10000);
+			dropSymbols(&m->symbols, 0, 0x10000);
+		}
+		for(i = 0; i < count; ++i){
+			swapWords(m->memory + segments[i].origin, segments[i].words, segments[i].length);
+			markDirty(m, segments[i].origin, segments[i].length);
+			dropSymbols(&m->symbols, segments[i].origin, segments[i].origin + segments[i].length);
+		}
+		m->pc = segments[count - 1].origin;
+		if(snapshot){
+			machine_state state;
+			readSnapshotState(f.data, &state);
+			setState(m, &state);
+		}
+		free(segments);
+	}
+	return count > 0 ? m->pc : snapshot ? LOAD_BAD_SNAPSHOT : count;
+}
+
+const char *loadError(int error){
+	switch(error){
+		case LOAD_CANT_READ:
+			return "can't open or read the file";
+		case LOAD_TRUNCATED:
+			return "the file ends in the middle of a word or segment";
+		case LOAD_OUT_OF_RANGE:
+			return "the code runs past xFFFF";
+		case LOAD_BAD_CONTAINER:
+			return "malformed segment container";
+		case LOAD_BAD_SNAPSHOT:
+			return "malformed snapshot or one from another version";
+		case LOAD_BAD_ASSEMBLY:
+			return "the source has errors (listed above)";
+	}
+	return "unknown error";
+}
+
+//The assembler. Pass 1 collects the labels and the length of each .ORIG segment, pass 2 encodes the words into
+//a buffer of that size and reports the errors, in line order. Memory gets the words only when there are none.
+
+//Tokens a source line can have: label, opcode and at most three operands, the rest is there to catch extra ones
+#define ASM_MAX_TOKENS (8)
+
+//Operands of each kind of line, by asm_ops[] format
+#define ASM_FIXED (0)	//none, the word is the instruction (RET, RTI, the TRAP aliases)
+#define ASM_ADD (1)	//DR, SR1, SR2 or imm5
+#define ASM_NOT (2)	//DR, SR
+#define ASM_BR (3)	//PCoffset9
+#define ASM_PC9 (4)	//R, PCoffset9
+#define ASM_BASE (5)	//R, BaseR, offset6
+#define ASM_JSR (6)	//PCoffset11
+#define ASM_JMP (7)	//BaseR
+#define ASM_TRAP (8)	//trapvect8
+#define ASM_ORIG (9)	//the directives
+#define ASM_FILL (10)
+#define ASM_BLKW (11)
+#define ASM_STRINGZ (12)
+#define ASM_END (13)
+
+static const int asm_operands[] = {0, 3, 2, 1, 2, 3, 1, 1, 1, 1, 1, 1, 1, 0};
+
+//Opcodes and directives with what they assemble from, BR is matched apart (its nzp suffix)
+static const struct {
+	const char *name;
+	uint16_t word;
+	int format;
+} asm_ops[] = {
+	{"ADD", 0x1000, ASM_ADD}, {"AND", 0x5000, ASM_ADD}, {"NOT", 0x903F, ASM_NOT},
+	{"LD", 0x2000, ASM_PC9}, {"LDI", 0xA000, ASM_PC9}, {"LEA", 0xE000, ASM_PC9},
+	{"ST", 0x3000, ASM_PC9}, {"STI", 0xB000, ASM_PC9}, {"LDR", 0x6000, ASM_BASE}, {"STR", 0x7000, ASM_BASE},
+	{"JSR", 0x4800, ASM_JSR}, {"JSRR", 0x4000, ASM_JMP}, {"JMP", 0xC000, ASM_JMP}, {"RET", 0xC1C0, ASM_FIXED},
+	{"RTI", 0x8000, ASM_FIXED}, {"TRAP", 0xF000, ASM_TRAP}, {"GETC", 0xF020, ASM_FIXED},
+	{"OUT", 0xF021, ASM_FIXED}, {"PUTS", 0xF022, ASM_FIXED}, {"IN", 0xF023, ASM_FIXED},
+	{"PUTSP", 0xF024, ASM_FIXED}, {"HALT", 0xF025, ASM_FIXED},
+	{".ORIG", 0, ASM_ORIG}, {".FILL", 0, ASM_FILL}, {".BLKW", 0, ASM_BLKW}, {".STRINGZ", 0, ASM_STRINGZ},
+	{".END", 0, ASM_END}
+};
+
+//A token of a source line. A .STRINGZ literal is a string token of what's between its quotes.
+typedef struct {
+	const char *text;
+	int len;
+	int string;
+} asm_token;
+
+typedef struct {
+	const char *name;	//in the source, NULL for an empty slot
+	int len;
+	uint16_t adress;
+	int segment;		//index of its .ORIG segment
+	int line;		//where it's defined
+} asm_label;
+
+typedef struct {
+	uint16_t origin;
+	uint32_t length;
+} asm_segment;
+
+typedef struct {
+	const char *name;	//of the source, for the messages
+	int pass, line, errors;
+	asm_label *labels;	//open adressing on the name's hash, label_cap is a power of 2
+	size_t label_count, label_cap;
+	asm_segment *segments;	//pass 1 adds them, pass 2 fills them
+	int segment_count, segment_cap;
+	int segment;		//index of the current one, -1 before the first .ORIG
+	int open;		//between .ORIG and .END
+	int overflow;		//the segment ran past xFFFF (reported once)
+	uint32_t pc;		//adress of the next word
+	int16_t *words;		//pass 2's output, the segments one after the other
+	size_t word_count;
+} assembler;
+
+//Reports an error of the current line, in pass 2 only (pass 1 doesn't know every label yet)
+static void asmError(assembler *as, const char *format, ...){
+	va_list args;
+	if(as->pass != 2)
+		return;
+	va_start(args, format);
+	fprintf(stderr, "%s:%d: ", as->name, as->line);
+	vfprintf(stderr, format, args);
+	fputc('\n', stderr);
+	va_end(args);
+	++as->errors;
+}
+
+//Splits the line into tokens at whitespace and commas, up to a ';' comment. Returns the token count, -1 for an
+//unterminated string and -2 for too many tokens.
+static int splitLine(const char *p, const char *end, asm_token *tokens){
+	int n = 0;
+	while(p < end && *p != ';'){
+		const char *start = p;
+		if(isspace((unsigned char) *p) || *p == ','){
+			++p;
+			continue;
+		}
+		if(n == ASM_MAX_TOKENS)
+			return -2;
+		tokens[n].string = *p == '"';
+		if(tokens[n].string){
+			for(++p; p < end && *p != '"'; ++p)
+				if(*p == '\\' && p + 1 < end)
+					++p;
+			if(p == end)
+				return -1;
+			tokens[n].text = start + 1;
+			tokens[n].len = p++ - start - 1;
+		}else{
+			while(p < end && !isspace((unsigned char) *p) && *p != ',' && *p != ';' && *p != '"')
+				++p;
+			tokens[n].text = start;
+			tokens[n].len = p - start;
+		}
+		++n;
+	}
+	return n;
+}
+
+//Case insensitive match of the token and word
+static int tokenIs(const asm_token *t, const char *word){
+	int i;
+	for(i = 0; i < t->len; ++i)
+		if(word[i] == '\0' || toupper((unsigned char) t->text[i]) != word[i])
+			return 0;
+	return word[i] == '\0' && !t->string;
+}
+
+//Format of the opcode or directive the token names (its word in *word), -1 when it isn't one
+static int findOp(const asm_token *t, uint16_t *word){
+	size_t i;
+	if(!t->string && t->len >= 2 && toupper((unsigned char) t->text[0]) == 'B' && toupper((unsigned char) t->text[1]) == 'R'){
+		//BR, then any of n, z and p in that order (none is all three)
+		int mask = 0, flag = 0, j;
+		for(j = 2; j < t->len; ++j){
+			int c = tolower((unsigned char) t->text[j]);
+			while(flag < 3 && c != "nzp"[flag])
+				++flag;
+			if(flag == 3)
+				break;
+			mask |= 4 >> flag++;
+		}
+		if(j == t->len){
+			*word = (mask ? mask : 7) << 9;
+			return ASM_BR;
+		}
+	}
+	for(i = 0; i < sizeof(asm_ops) / sizeof(asm_ops[0]); ++i)
+		if(tokenIs(t, asm_ops[i].name)){
+			*word = asm_ops[i].word;
+			return asm_ops[i].format;
+		}
+	return -1;
+}
+
+//Register number of an R0-R7 token, -1 for other tokens
+static int registerNumber(const asm_token *t){
+	if(t->string || t->len != 2 || toupper((unsigned char) t->text[0]) != 'R' || t->text[1] < '0' || t->text[1] > '7')
+		return -1;
+	return t->text[1] - '0';
+}
+
+//A label starts with a letter or '_' and goes on with letters, digits and '_'; a register name isn't one
+static int isLabel(const asm_token *t){
+	int i;
+	if(t->string || t->len == 0 || !(isalpha((unsigned char) t->text[0]) || t->text[0] == '_') || registerNumber(t) >= 0)
+		return 0;
+	for(i = 1; i < t->len; ++i)
+		if(!isalnum((unsigned char) t->text[i]) && t->text[i] != '_')
+			return 0;
+	return 1;
+}
+
+//Reads a number token: x1F (hex), #-5 or -5 (decimal). Returns 0 when the token isn't one.
+static int parseNumber(const asm_token *t, long *value){
+	const char *p = t->text, *end = t->text + t->len;
+	int base = 10, negative = 0;
+	long v = 0;
+	if(t->string || p == end)
+		return 0;
+	if(*p == 'x' || *p == 'X'){
+		base = 16;
+		++p;
+	}else if(*p == '#')
+		++p;
+	if(p < end && *p == '-'){
+		negative = 1;
+		++p;
+	}
+	if(p == end)
+		return 0;
+	for(; p < end; ++p){
+		int digit = isdigit((unsigned char) *p) ? *p - '0'
+			: base == 16 && isxdigit((unsigned char) *p) ? tolower((unsigned char) *p) - 'a' + 10 : -1;
+		if(digit < 0)
+			return 0;
+		if(v < 0x100000)	//past every range, without overflowing
+			v = v * base + digit;
+	}
+	*value = negative ? -v : v;
+	return 1;
+}
+
+static uint32_t labelHash(const char *name, int len){
+	uint32_t hash = 2166136261u;	//FNV-1a
+	int i;
+	for(i = 0; i < len; ++i)
+		hash = (hash ^ (uint8_t) name[i]) * 16777619u;
+	return hash;
+}
+
+//Slot of the label with the name given, the empty slot it would go in when there's none
+static asm_label *labelSlot(assembler *as, const char *name, int len){
+	size_t i = labelHash(name, len) & (as->label_cap - 1);
+	while(as->labels[i].name && (as->labels[i].len != len || memcmp(as->labels[i].name, name, len) != 0))
+		i = (i + 1) & (as->label_cap - 1);
+	return &as->labels[i];
+}
+
+static const asm_label *findLabel(assembler *as, const asm_token *t){
+	const asm_label *l = as->label_cap ? labelSlot(as, t->text, t->len) : NULL;
+	return l && l->name ? l : NULL;
+}
+
+//Defines the label at the pc (pass 1), growing the table once it's half full. Returns 0 when out of memory.
+static int addLabel(assembler *as, const asm_token *t){
+	asm_label *l;
+	if(2 * (as->label_count + 1) > as->label_cap){
+		asm_label *old = as->labels;
+		size_t i, old_cap = as->label_cap;
+		as->label_cap = old_cap ? 2 * old_cap : 64;
+		as->labels = calloc(as->label_cap, sizeof(asm_label));
+		if(as->labels == NULL){
+			as->labels = old;
+			as->label_cap = old_cap;
+			return 0;
+		}
+		for(i = 0; i < old_cap; ++i)
+			if(old[i].name)
+				*labelSlot(as, old[i].name, old[i].len) = old[i];
+		free(old);
+	}
+	l = labelSlot(as, t->text, t->len);
+	if(l->name == NULL){	//a duplicate keeps the first, pass 2 reports it
+		l->name = t->text;
+		l->len = t->len;
+		l->adress = as->pc;
+		l->segment = as->segment;
+		l->line = as->line;
+		++as->label_count;
+	}
+	return 1;
+}
+
+//Puts count copies of the word at the pc
+static void asmEmit(assembler *as, int16_t word, uint32_t count){
+	if(!as->open){
+		asmError(as, "code outside .ORIG/.END");
+		return;
+	}
+	if(as->pc + count > 0x10000){
+		if(!as->overflow)
+			asmError(as, "the code runs past xFFFF");
+		as->overflow = 1;
+		return;
+	}
+	if(as->pass == 1)
+		as->segments[as->segment].length += count;
+	else{
+		uint32_t i;
+		for(i = 0; i < count; ++i)
+			as->words[as->word_count++] = word;
+	}
+	as->pc += count;
+}
+
+//Register operand, 0 after reporting an error
+static int asmRegister(assembler *as, const asm_token *t){
+	int reg = registerNumber(t);
+	if(reg < 0){
+		asmError(as, "expected a register (R0-R7), not \"%.*s\"", t->len, t->text);
+		return 0;
+	}
+	return reg;
+}
+
+//Number operand from min to max, min after reporting an error
+static long asmNumber(assembler *as, const asm_token *t, long min, long max){
+	long value;
+	if(!parseNumber(t, &value)){
+		asmError(as, "expected a number, not \"%.*s\"", t->len, t->text);
+		return min;
+	}
+	if(value < min || value > max){
+		asmError(as, "%ld is out of range (%ld to %ld)", value, min, max);
+		return min;
+	}
+	return value;
+}
+
+//PC relative operand of the bits given: a label, or a number that is the offset itself
+static uint16_t asmOffset(assembler *as, const asm_token *t, int bits){
+	long value, range = 1L << (bits - 1);
+	if(!parseNumber(t, &value)){
+		const asm_label *l = findLabel(as, t);
+		if(l == NULL){
+			asmError(as, isLabel(t) ? "undefined label \"%.*s\"" : "expected a label, not \"%.*s\"", t->len, t->text);
+			return 0;
+		}
+		value = (long) l->adress - (long) (as->pc + 1);
+	}
+	if(value < -range || value >= range){
+		asmError(as, "\"%.*s\" is %ld words away, out of range for a %d bit offset", t->len, t->text, value, bits);
+		return 0;
+	}
+	return value & ((1 << bits) - 1);
+}
+
+//Puts a .STRINGZ's characters and its terminating zero at the pc, turning the escapes into what they stand for
+static void asmString(assembler *as, const asm_token *t){
+	int i;
+	for(i = 0; i < t->len; ++i){
+		char c = t->text[i];
+		if(c == '\\' && i + 1 < t->len){
+			c = t->text[++i];
+			switch(c){
+				case 'n': c = '\n'; break;
+				case 't': c = '\t'; break;
+				case 'r': c = '\r'; break;
+				case '0': c = '\0'; break;
+				case '\\': case '"': break;
+				default:
+					asmError(as, "unknown escape \"\\%c\"", c);
+			}
+		}
+		asmEmit(as, (uint8_t) c, 1);
+	}
+	asmEmit(as, 0, 1);
+}
+
+//Assembles one line in the current pass
+static void assembleLine(assembler *as, const char *p, const char *end){
+	asm_token tokens[ASM_MAX_TOKENS], *t = tokens, label = {NULL, 0, 0};
+	int n = splitLine(p, end, tokens), format;
+	uint16_t word;
+
+	if(n < 0){
+		asmError(as, n == -1 ? "unterminated string" : "too many operands");
+		return;
+	}
+	if(n == 0)
+		return;
+	format = findOp(t, &word);
+	if(format < 0){	//a label, on its own it's the adress of the next word
+		label = *t;
+		if(label.len > 1 && label.text[label.len - 1] == ':')
+			--label.len;
+		if(!isLabel(&label)){
+			asmError(as, "\"%.*s\" is neither an instruction nor a label", t->len, t->text);
+			return;
+		}
+		++t;
+		--n;
+		format = n ? findOp(t, &word) : -1;
+		if(format == ASM_ORIG){
+			asmError(as, ".ORIG can't have a label");
+			return;
+		}
+		if(as->pass == 1){
+			if(!addLabel(as, &label)){
+				fprintf(stderr, "%s:%d: out of memory\n", as->name, as->line);
+				++as->errors;
+			}
+		}else if(!as->open)
+			asmError(as, "label \"%.*s\" outside .ORIG/.END", label.len, label.text);
+		else{
+			const asm_label *l = findLabel(as, &label);
+			if(l && l->line != as->line)
+				asmError(as, "label \"%.*s\" is already defined on line %d", label.len, label.text, l->line);
+		}
+		if(n == 0)
+			return;
+		if(format < 0){
+			asmError(as, "unknown instruction \"%.*s\"", t->len, t->text);
+			return;
+		}
+	}
+	if(n - 1 != asm_operands[format]){
+		asmError(as, "%.*s takes %d operand%s", t->len, t->text, asm_operands[format], asm_operands[format] == 1 ? "" : "s");
+		return;
+	}
+	switch(format){
+		case ASM_ADD:
+			word |= asmRegister(as, t + 1) << 9 | asmRegister(as, t + 2) << 6;
+			if(registerNumber(t + 3) >= 0)
+				word |= registerNumber(t + 3);
+			else
+				word |= 0x20 | (asmNumber(as, t + 3, -16, 15) & 0x1F);
+			break;
+		case ASM_NOT:
+			word |= asmRegister(as, t + 1) << 9 | asmRegister(as, t + 2) << 6;
+			break;
+		case ASM_BR:
+			word |= asmOffset(as, t + 1, 9);
+			break;
+		case ASM_PC9:
+			word |= asmRegister(as, t + 1) << 9 | asmOffset(as, t + 2, 9);
+			break;
+		case ASM_BASE:
+			word |= asmRegister(as, t + 1) << 9 | asmRegister(as, t + 2) << 6 | (asmNumber(as, t + 3, -32, 31) & 0x3F);
+			break;
+		case ASM_JSR:
+			word |= asmOffset(as, t + 1, 11);
+			break;
+		case ASM_JMP:
+			word |= asmRegister(as, t + 1) << 6;
+			break;
+		case ASM_TRAP:
+			word |= asmNumber(as, t + 1, 0, 255);
+			break;
+		case ASM_ORIG:
+			++as->segment;
+			if(as->pass == 1){
+				if(as->segment == as->segment_cap){
+					asm_segment *grown = realloc(as->segments, (as->segment_cap ? 2 * as->segment_cap : 8) * sizeof(asm_segment));
+					if(grown == NULL){
+						fprintf(stderr, "%s:%d: out of memory\n", as->name, as->line);
+						++as->errors;
+						--as->segment;
+						return;
+					}
+					as->segments = grown;
+					as->segment_cap = as->segment_cap ? 2 * as->segment_cap : 8;
+				}
+				as->segments[as->segment].length = 0;
+				as->segment_count = as->segment + 1;
+			}
+			as->pc = as->segments[as->segment].origin = asmNumber(as, t + 1, 0, 0xFFFF);
+			as->open = 1;
+			as->overflow = 0;
+			return;
+		case ASM_FILL:{
+			long value = 0;
+			if(parseNumber(t + 1, &value) || !isLabel(t + 1))
+				value = asmNumber(as, t + 1, -32768, 65535);
+			else{
+				const asm_label *l = findLabel(as, t + 1);
+				if(l)
+					value = l->adress;
+				else
+					asmError(as, "undefined label \"%.*s\"", t[1].len, t[1].text);
+			}
+			asmEmit(as, (int16_t) value, 1);
+			return;
+		}
+		case ASM_BLKW:
+			asmEmit(as, 0, asmNumber(as, t + 1, 0, 65536));
+			return;
+		case ASM_STRINGZ:
+			if(!t[1].string){
+				asmError(as, ".STRINGZ needs a string in quotes");
+				return;
+			}
+			asmString(as, t + 1);
+			return;
+		case ASM_END:
+			if(!as->open)
+				asmError(as, ".END without .ORIG");
+			as->open = 0;
+			return;
+	}
+	asmEmit(as, word, 1);
+}
+
+static int compareSymbols(const void *a, const void *b){
+	const symbol *x = a, *y = b;
+	if(x->adress != y->adress)
+		return x->adress < y->adress ? -1 : 1;
+	return (x->name > y->name) - (x->name < y->name);	//the first defined first
+}
+
+//Adds the assembler's labels to the table. Returns 0 when out of memory.
+static int addSymbols(symbol_table *table, const assembler *as){
+	size_t i, names_len = table->names_len;
+	symbol *entries = realloc(table->entries, (table->count + as->label_count + 1) * sizeof(symbol));
+	char *names;
+	if(entries == NULL)
+		return 0;
+	table->entries = entries;
+	for(i = 0; i < as->label_cap; ++i)
+		if(as->labels[i].name)
+			names_len += as->labels[i].len + 1;
+	names = realloc(table->names, names_len + 1);
+	if(names == NULL)
+		return 0;
+	table->names = names;
+	for(i = 0; i < as->label_cap; ++i){
+		const asm_label *l = &as->labels[i];
+		const asm_segment *seg = &as->segments[l->segment < 0 ? 0 : l->segment];
+		symbol *s = &table->entries[table->count];
+		if(l->name == NULL)
+			continue;
+		++table->count;
+		s->adress = l->adress;
+		s->limit = seg->origin + seg->length;
+		s->name = table->names_len;
+		memcpy(table->names + table->names_len, l->name, l->len);
+		table->names[table->names_len + l->len] = '\0';
+		table->names_len += l->len + 1;
+	}
+	qsort(table->entries, table->count, sizeof(symbol), compareSymbols);
+	return 1;
+}
+
+int assembleSource(machine *m, const char *source, size_t len, const char *name){
+	const char *end = source + len, *p, *next;
+	assembler as;
+	size_t total = 0;
+	int i;
+
+	memset(&as, 0, sizeof(as));
+	as.name = name;
+	for(as.pass = 1; as.pass <= 2 && as.errors == 0; ++as.pass){
+		if(as.pass == 2){
+			for(i = 0; i < as.segment_count; ++i)
+				total += as.segments[i].length;
+			as.words = malloc(total ? total * sizeof(int16_t) : 1);
+			if(as.segment_count == 0 || as.words == NULL){
+				fprintf(stderr, as.words ? "%s: no .ORIG, nothing to assemble\n" : "%s: out of memory\n", name);
+				++as.errors;
+				break;
+			}
+		}
+		as.segment = -1;
+		as.open = 0;
+		as.line = 0;
+		for(p = source; p < end; p = next){
+			const char *line_end = memchr(p, '\n', end - p);
+			if(line_end == NULL)
+				line_end = end;
+			next = line_end + 1;
+			++as.line;
+			assembleLine(&as, p, line_end);
+		}
+	}
+	if(as.errors == 0){
+		int16_t *words = as.words;
+		for(i = 0; i < as.segment_count; words += as.segments[i++].length){
+			memcpy(m->memory + as.segments[i].origin, words, as.segments[i].length * sizeof(int16_t));
+			markDirty(m, as.segments[i].origin, as.segments[i].length);
+			dropSymbols(&m->symbols, as.segments[i].origin, as.segments[i].origin + as.segments[i].length);
+		}
+		m->pc = as.segments[as.segment_count - 1].origin;
+		if(!addSymbols(&m->symbols, &as))
+			fprintf(stderr, "%s: out of memory, its labels are left out\n", name);
+	}
+	free(as.words);
+	free(as.labels);
+	free(as.segments);
+	return as.errors ? LOAD_BAD_ASSEMBLY : m->pc;
+}
+
+int symbolize(const symbol_table *table, uint16_t adress, char *text, size_t size){
+	size_t low = 0, high = table->count;
+	const symbol *s;
+	//the last label at or before the adress, the first defined of those at its adress
+	while(low < high){
+		size_t mid = low + (high - low) / 2;
+		if(table->entries[mid].adress <= adress)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	if(low == 0 || adress >= table->entries[low - 1].limit){
+		if(size)
+			*text = '\0';
+		return 0;
+	}
+	s = &table->entries[low - 1];
+	while(s > table->entries && s[-1].adress == s->adress)
+		--s;
+	if(s->adress == adress)
+		snprintf(text, size, "%s", table->names + s->name);
+	else
+		snprintf(text, size, "%s+%u", table->names + s->name, (unsigned int) (adress - s->adress));
+	return 1;
+}
+
+void freeSymbols(symbol_table *table){
+	free(table->entries);
+	free(table->names);
+	memset(table, 0, sizeof(*table));
+}
+
+//Writes a segment (and its words) to a container, in two pieces when it's a whole memory image
+static int writeSegment(FILE *outfile, const segment *seg){
+	uint8_t header[4];
+	uint32_t left = seg->length;
+	int ok;
+	do{	//the top half goes first, so the container still starts at its origin
+		uint32_t start = left > 0xFFFF ? left / 2 : 0;
+		putBigEndian(header, seg->origin + start);
+		putBigEndian(header + 2, left - start);
+		ok = fwrite(header, 4, 1, outfile) == 1
+			&& (left == start || fwrite(seg->words + start * 2, (left - start) * 2, 1, outfile) == 1);
+		left = start;
+	}while(left > 0 && ok);
+	return ok;
+}
+
+int packFiles(const char *out, const char *const *files, int file_count){
+	object_file *objects = calloc(file_count, sizeof(object_file));
+	segment **segments = calloc(file_count, sizeof(segment *));
+	int *counts = calloc(file_count, sizeof(int));
+	uint8_t header[CONTAINER_MAGIC_LEN + 2];
+	long total = 0;
+	int i, j, ok = objects && segments && counts;
+	FILE *outfile = NULL;
+
+	for(i = 0; i < file_count && ok; ++i){
+		if(!openObject(&objects[i], files[i]))
+			counts[i] = LOAD_CANT_READ;
+		else
+			counts[i] = splitObject(&objects[i], &segments[i]);
+		if(counts[i] < 0){
+			fprintf(stderr, "Can't load \"%s\": %s\n", files[i], loadError(counts[i]));
+			ok = 0;
+		}
+		//a segment holds at most xFFFF words, a whole memory image takes two
+		for(j = 0; ok && j < counts[i]; ++j)
+			total += 1 + (segments[i][j].length > 0xFFFF);
+	}
+	if(ok && total > 0xFFFF){
+		fprintf(stderr, "Too many segments for one container\n");
+		ok = 0;
+	}
+	if(ok && (outfile = fopen(out, "wb")) == NULL){
+		fprintf(stderr, "Can't write \"%s\"\n", out);
+		ok = 0;
+	}
+	if(ok){
+		memcpy(header, CONTAINER_MAGIC, CONTAINER_MAGIC_LEN);
+		putBigEndian(header + CONTAINER_MAGIC_LEN, total);
+		ok = fwrite(header, sizeof(header), 1, outfile) == 1;
+	}
+	for(i = 0; i < file_count && ok; ++i)
+		for(j = 0; j < counts[i] && ok; ++j)
+			ok = writeSegment(outfile, &segments[i][j]);
+	if(outfile && fclose(outfile) != 0)
+		ok = 0;
+	if(outfile && !ok)
+		fprintf(stderr, "Can't write \"%s\"\n", out);
+	for(i = 0; i < file_count; ++i){
+		if(objects && objects[i].data)
+			closeObject(&objects[i]);
+		if(segments)
+			free(segments[i]);
+	}
+	free(objects);
+	free(segments);
+	free(counts);
+	return ok;
+}
+
+static uint16_t swap16(uint16_t val){
+	return (uint16_t) (val << 8 | val >> 8);
+}
+
+static int decodeRawTrace(const object_file *f, const char *fName, const symbol_table *symbols, FILE *out){
+	const uint8_t *p;
+	uint16_t header[2];
+	int swap;
+	size_t i, count;
+	char text[40];
+
+	if(f->size >= TRACE_MAGIC_LEN + sizeof(header))
+		memcpy(header, f->data + TRACE_MAGIC_LEN, sizeof(header));
+	swap = f->size >= TRACE_MAGIC_LEN + sizeof(header) && header[0] == swap16(TRACE_BYTE_ORDER);
+	if(f->size < TRACE_MAGIC_LEN + sizeof(header) || (header[0] != TRACE_BYTE_ORDER && !swap)
+		|| (swap ? swap16(header[1]) : header[1]) != sizeof(trace_record)){
+		fprintf(stderr, "\"%s\" isn't a trace from this version\n", fName);
+		return 0;
+	}
+	p = f->data + TRACE_MAGIC_LEN + sizeof(header);
+	count = (f->size - TRACE_MAGIC_LEN - sizeof(header)) / sizeof(trace_record);
+	for(i = 0; i < count; ++i, p += sizeof(trace_record)){
+		trace_record r;
+		memcpy(&r, p, sizeof(r));
+		if(swap){
+			r.pc = swap16(r.pc);
+			r.ir = swap16(r.ir);
+			r.value = swap16(r.value);
+		}
+		disassemble(r.ir, text, sizeof(text));
+		fprintf(out, "x%04X", r.pc);
+		printSymbol(out, symbols, r.pc);
+		fprintf(out, "\t%s", text);
+		if(r.reg != TRACE_NO_REG)
+			fprintf(out, "\t; R%d = x%04hX", r.reg, (uint16_t) r.value);
+		fprintf(out, "%s%s%s%s\n", r.reg != TRACE_NO_REG ? ", " : "\t; ", r.cc & 4 ? "n" : "", r.cc & 2 ? "z" : "", r.cc & 1 ? "p" : "");
+	}
+	return 1;
+}
+
+//Offset of the last block of a delta trace starting at or before cycle from, found with the index. Returns 0
+//when the trace has none (the caller then reads the blocks from the first).
+static uint64_t seekDeltaTrace(const object_file *f, uint64_t from){
+	const uint8_t *trailer = f->data + f->size - 16;
+	uint64_t index_offset, count, low = 0, high;
+	if(f->size < TRACE_MAGIC_LEN + 24 || memcmp(trailer + 8, DELTA_INDEX_MAGIC, 8) != 0)
+		return 0;
+	index_offset = bigEndian64(trailer);
+	if(index_offset < TRACE_MAGIC_LEN || index_offset > f->size - 24)
+		return 0;
+	count = bigEndian64(f->data + index_offset);
+	if(count == 0 || count > (f->size - 24 - index_offset) / 16)
+		return 0;
+	//last entry with a first cycle <= from
+	high = count;
+	while(high - low > 1){
+		uint64_t mid = low + (high - low) / 2;
+		if(bigEndian64(f->data + index_offset + 8 + 16 * mid) <= from)
+			low = mid;
+		else
+			high = mid;
+	}
+	return bigEndian64(f->data + index_offset + 8 + 16 * low + 8);
+}
+
+//Prints a delta trace's records from cycle from on, up to the last whole block of one cut short. Returns 0
+//when it's corrupt.
+static int decodeDeltaTrace(const object_file *f, const char *fName, uint64_t from, const symbol_table *symbols, FILE *out){
+	uint8_t *records = malloc(TRACE_BLOCK_BYTES);
+	uint64_t offset = seekDeltaTrace(f, from);
+	int ok = records != NULL;
+
+	if(offset < TRACE_MAGIC_LEN || offset > f->size)
+		offset = TRACE_MAGIC_LEN;
+	while(ok && offset + DELTA_HEADER_LEN <= f->size){
+		const uint8_t *header = f->data + offset;
+		uint32_t packed_len = bigEndian32(header), raw_len = bigEndian32(header + 4), len = packed_len & ~DELTA_STORED;
+		uint64_t cycle = bigEndian64(header + 8), next = offset + DELTA_HEADER_LEN + len;
+		uint16_t pc = bigEndian(header + 16);
+		const uint8_t *p, *end;
+		long unpacked;
+
+		if(packed_len == 0)	//end of the blocks
+			break;
+		if(raw_len > TRACE_BLOCK_BYTES){
+			ok = 0;
+			break;
+		}
+		if(next > f->size){
+			fprintf(stderr, "The trace \"%s\" is cut short\n", fName);
+			break;
+		}
+		//skip blocks that end before from (all there are without an index) by their successor's keyframe
+		if(next + DELTA_HEADER_LEN <= f->size && bigEndian32(f->data + next) != 0 && bigEndian64(f->data + next + 8) <= from){
+			offset = next;
+			continue;
+		}
+		if(packed_len & DELTA_STORED){
+			if(len != raw_len){
+				ok = 0;
+				break;
+			}
+			memcpy(records, header + DELTA_HEADER_LEN, len);
+			unpacked = len;
+		}else
+			unpacked = lzUnpack(header + DELTA_HEADER_LEN, len, records, raw_len);
+		if(unpacked != (long) raw_len){
+			ok = 0;
+			break;
+		}
+		for(p = records, end = records + raw_len; p < end; ++cycle){
+			uint8_t tag = *p++, cc = tag >> DELTA_CC_SHIFT & 7;
+			int reg = -1;
+			uint16_t value = 0, adress = 0, stored = 0;
+			if(end - p < (tag & DELTA_PC ? 2 : 0) + (tag & DELTA_REG ? 3 : 0) + (tag & DELTA_MEM ? 4 : 0)){
+				ok = 0;
+				break;
+			}
+			if(tag & DELTA_PC){
+				pc = bigEndian(p);
+				p += 2;
+			}
+			if(tag & DELTA_REG){
+				reg = p[0] & 7;
+				value = bigEndian(p + 1);
+				p += 3;
+			}
+			if(tag & DELTA_MEM){
+				adress = bigEndian(p);
+				stored = bigEndian(p + 2);
+				p += 4;
+			}
+			if(cycle >= from){
+				fprintf(out, "%"PRIu64"\tx%04X", cycle, pc);
+				printSymbol(out, symbols, pc);
+				fputs("\t; ", out);
+				if(reg >= 0)
+					fprintf(out, "R%d = x%04X, ", reg, value);
+				if(tag & DELTA_MEM)
+					fprintf(out, "[x%04X] = x%04X, ", adress, stored);
+				fprintf(out, "%s%s%s\n", cc & 4 ? "n" : "", cc & 2 ? "z" : "", cc & 1 ? "p" : "");
+			}
+			++pc;
+		}
+		offset = next;
+	}
+	if(!ok)
+		fprintf(stderr, "The trace \"%s\" is corrupt\n", fName);
+	free(records);
+	return ok;
+}
+
+int decodeTrace(const char *fName, uint64_t from, const symbol_table *symbols, FILE *out){
+	object_file f;
+	int ok = 1;
+
+	if(!openObject(&f, fName)){
+		fprintf(stderr, "Can't read the trace \"%s\"\n", fName);
+		return 0;
+	}
+	if(f.size >= TRACE_MAGIC_LEN && memcmp(f.data, DELTA_MAGIC, TRACE_MAGIC_LEN) == 0)
+		ok = decodeDeltaTrace(&f, fName, from, symbols, out);
+	else if(f.size >= TRACE_MAGIC_LEN && memcmp(f.data, TRACE_MAGIC, TRACE_MAGIC_LEN) == 0)
+		ok = decodeRawTrace(&f, fName, symbols, out);
+	else{
+		fprintf(stderr, "\"%s\" isn't a trace from this version\n", fName);
+		ok = 0;
+	}
+	closeObject(&f);
+	return ok;
+}
+
+//--coordinator and --worker talk in messages of a type byte and a 32 bit big endian length, then that many
+//bytes. Numbers in them are 64 bit big endian, names and file contents their length then their bytes.
+#define WIRE_MAGIC "LC3-WORKER-1"
+#define WIRE_OPTIONS ('O')	//to a worker: the run options and the files every job starts with
+#define WIRE_REQUEST ('R')	//from a worker: how many jobs it takes next
+#define WIRE_JOBS ('J')		//to a worker, one for each request: up to that many jobs, none once they're all done
+#define WIRE_RESULTS ('D')	//from a worker: what the jobs it ran produced
+#define WIRE_MAX_LEN (1u << 30)	//longest message a side takes
+
+//Jobs a worker asks for per thread. It asks for the next ones while running these, so the threads don't wait
+//for the coordinator.
+#define WORKER_BATCH (4)
+
+//Coordinator's owners of the jobs that aren't running on a worker
+#define JOB_WAITING (-1)
+#define JOB_DONE (-2)
+
+#if HAVE_SOCKETS
+#if !defined(MSG_NOSIGNAL)
+#define MSG_NOSIGNAL (0)
+#endif
 
-#define REG_COUNT (8)
-#define ADD_OP (1)
-#define AND_OP (5)
-#define LD_OP (2)
-#define LDI_OP (10)
-#define LDR_OP (6)
-#define BR_OP (0)
-#define ST_OP (3)
-#define STI_OP (11)
-#define STR_OP (7)
-#define LEA_OP (14)
-#define JSR_OP (4)
-#define RET_OP (12)
-#define TRAP_OP (15)
+//A message being built, or the last one received
+typedef struct {
+	uint8_t *data;
+	size_t len, cap;
+} wire_buffer;
 
-#define DSR ((int16_t) 0xFE04)
-#define DISPLAY_READY (0x8000)
-#define DISPLAY_SET (0x0000)
-#define DDR ((int16_t) 0xFE06)
+static void wireReserve(wire_buffer *b, size_t len){
+	if(len <= b->cap)
+		return;
+	b->cap = len > 2 * b->cap ? len : 2 * b->cap;
+	b->data = realloc(b->data, b->cap);
+	if(b->data == NULL){
+		fprintf(stderr, "Out of memory building a message\n");
+		exit(1);
+	}
+}
 
-#define MCR_ADRESS ((int16_t) 0xFFFE)
-#define MCR_POWER(mcr) (((mcr) & 0x8000) >> 15)
+static void wirePut(wire_buffer *b, const void *bytes, size_t len){
+	wireReserve(b, b->len + len);
+	if(len)
+		memcpy(b->data + b->len, bytes, len);
+	b->len += len;
+}
 
-//Machine Control Register. When mcr[15] == 0b machine turns off.
-int16_t mcr;
+static void wireNumber(wire_buffer *b, uint64_t n){
+	uint8_t bytes[8];
+	int i;
+	for(i = 0; i < 8; ++i)
+		bytes[i] = n >> (56 - 8 * i);
+	wirePut(b, bytes, 8);
+}
 
-int16_t  memory[65536];
-int16_t regs[REG_COUNT];
-int16_t pc, ir;
+static void wireBytes(wire_buffer *b, const void *bytes, size_t len){
+	wireNumber(b, len);
+	wirePut(b, bytes, len);
+}
 
-struct {
-    int junk:13;
-    unsigned int p:1;
-    unsigned int n:1;
-    unsigned int z:1;
-} psr;   // process status register
+//Reads a received message, bad is set once it ran past its end
+typedef struct {
+	const uint8_t *p, *end;
+	int bad;
+} wire_reader;
 
-struct {
-	int16_t status;		//ready bit at status[15]
-	int16_t data;		//char to display
-} display;	//display io
+static uint64_t wireGetNumber(wire_reader *r){
+	uint64_t n = 0;
+	int i;
+	if(r->end - r->p < 8){
+		r->bad = 1;
+		return 0;
+	}
+	for(i = 0; i < 8; ++i)
+		n = n << 8 | *r->p++;
+	return n;
+}
 
-//Loads the file with the given name to LC3 mem and sets the pc to the starting adress given.
-//Returns the starting adress provided.
-int16_t loadFile(const char*);
+//Returns where the bytes are in the message, which keeps them
+static const uint8_t *wireGetBytes(wire_reader *r, size_t *len){
+	uint64_t n = wireGetNumber(r);
+	const uint8_t *bytes = r->p;
+	if(r->bad || n > (uint64_t) (r->end - r->p)){
+		r->bad = 1;
+		*len = 0;
+		return r->p;
+	}
+	r->p += n;
+	*len = n;
+	return bytes;
+}
 
-//initializes LC3
-void init();
+//A malloc'd copy of a name
+static char *wireGetString(wire_reader *r){
+	size_t len;
+	const uint8_t *bytes = wireGetBytes(r, &len);
+	char *str = malloc(len + 1);
+	if(str == NULL){
+		fprintf(stderr, "Out of memory reading a message\n");
+		exit(1);
+	}
+	memcpy(str, bytes, len);
+	str[len] = '\0';
+	return str;
+}
 
-//Prints LC3 state such as: registers, PC, PSR, CC
-void printState(void);
+static int sendAll(int fd, const uint8_t *p, size_t len){
+	while(len){
+		ssize_t sent = send(fd, p, len, MSG_NOSIGNAL);
+		if(sent <= 0)
+			return 0;
+		p += sent;
+		len -= sent;
+	}
+	return 1;
+}
 
-//Prints memory from memory[arg1](inclusive) to memory[arg2](exclusive)
-void printMemory(int16_t, int16_t);
+static int receiveAll(int fd, uint8_t *p, size_t len){
+	while(len){
+		ssize_t got = recv(fd, p, len, 0);
+		if(got <= 0)
+			return 0;
+		p += got;
+		len -= got;
+	}
+	return 1;
+}
 
-//Updates the psr's CC using the sign of the value passed
-void updatePSR_CC(int16_t);
+static int wireSend(int fd, int type, const wire_buffer *b){
+	uint8_t header[5];
+	header[0] = type;
+	header[1] = b->len >> 24;
+	header[2] = b->len >> 16;
+	header[3] = b->len >> 8;
+	header[4] = b->len;
+	return sendAll(fd, header, sizeof(header)) && sendAll(fd, b->data, b->len);
+}
 
-//These perform the specified instruction:
-void addImm();
-void addRegs();
-void andImm();
-void andRegs();
-void not();
-void br();
-void ld();
-void ldi();
-void ldr();
-void st();
-void sti();
-void str();
-void lea();
-void jsr();
-void ret();
-void trap();
+//Receives the next message into b. Returns its type, -1 when the connection is gone.
+static int wireReceive(int fd, wire_buffer *b, wire_reader *r){
+	uint8_t header[5];
+	uint32_t len;
+	if(!receiveAll(fd, header, sizeof(header)))
+		return -1;
+	len = (uint32_t) header[1] << 24 | header[2] << 16 | header[3] << 8 | header[4];
+	if(len > WIRE_MAX_LEN)
+		return -1;
+	wireReserve(b, len);
+	if(!receiveAll(fd, b->data, len))
+		return -1;
+	b->len = len;
+	r->p = b->data;
+	r->end = b->data + len;
+	r->bad = 0;
+	return header[0];
+}
 
-int main(int argc, const char* argv[]) {
-	const char* fName;
-	int16_t load_start_addr;
+//The run options a worker runs its jobs with, everything of the command line's but --stats
+static void wireOptions(wire_buffer *b, const run_options *opts){
+	wireNumber(b, opts->engine);
+	wireNumber(b, opts->display_latency);
+	wireNumber(b, opts->key_latency);
+	wireNumber(b, opts->no_fast_forward);
+	wireNumber(b, opts->flush_interval);
+	wireNumber(b, opts->max_cycles);
+	wireNumber(b, opts->timeout_ns);
+	wireNumber(b, opts->lockstep);
+	wireNumber(b, opts->prewarm);
+	wireNumber(b, opts->fast_traps);
+	wireNumber(b, opts->profile);
+	wireNumber(b, opts->hash_output);
+	wireNumber(b, opts->capture_limit);
+	wirePut(b, opts->guest_traps, sizeof(opts->guest_traps));
+}
 
-	if(argc >= 2){  //File specified as console arg
-		int i;
-		for(i = 1; i < argc; ++i){
-			fName = argv[i];
-			load_start_addr = loadFile(fName);
-			if(PRINT_ON) printf("Loaded file \"%s\" starting at x%04hX\n", fName, load_start_addr);
+static void wireGetOptions(wire_reader *r, run_options *opts){
+	memset(opts, 0, sizeof(*opts));
+	opts->engine = (int) wireGetNumber(r);
+	opts->display_latency = (unsigned int) wireGetNumber(r);
+	opts->key_latency = (unsigned int) wireGetNumber(r);
+	opts->no_fast_forward = (int) wireGetNumber(r);
+	opts->flush_interval = wireGetNumber(r);
+	opts->max_cycles = wireGetNumber(r);
+	opts->timeout_ns = wireGetNumber(r);
+	opts->lockstep = wireGetNumber(r);
+	opts->prewarm = (int) wireGetNumber(r);
+	opts->fast_traps = (int) wireGetNumber(r);
+	opts->profile = (int) wireGetNumber(r);
+	opts->hash_output = (int) wireGetNumber(r);
+	opts->capture_limit = wireGetNumber(r);
+	if(r->end - r->p < (ptrdiff_t) sizeof(opts->guest_traps) || opts->engine < 0 || opts->engine >= ENGINE_COUNT)
+		r->bad = 1;
+	else{
+		memcpy(opts->guest_traps, r->p, sizeof(opts->guest_traps));
+		r->p += sizeof(opts->guest_traps);
+	}
+}
+
+//Adds a file, its name then what it holds. Returns 0 (adding nothing) when it can't be read.
+static int wireFile(wire_buffer *b, const char *name){
+	object_file f;
+	if(!openObject(&f, name))
+		return 0;
+	wireBytes(b, name, strlen(name));
+	wireBytes(b, f.data, f.size);
+	closeObject(&f);
+	return 1;
+}
+
+//Adds a job: its number, budget, files past the shared ones, then its input and expected output (the run's
+//when it has none). Returns 0 (adding nothing) when the coordinator can't read one of them.
+static int wireJob(wire_buffer *b, const batch_job *job, int id, int shared, const char *expect){
+	size_t start = b->len;
+	int i;
+	wireNumber(b, id);
+	wireNumber(b, job->max_cycles);
+	wireNumber(b, job->file_count - shared);
+	for(i = shared; i < job->file_count; ++i)
+		if(!wireFile(b, job->files[i])){
+			b->len = start;
+			return 0;
 		}
-	}else{  //Default file to run
-		printf("Please provide at least 1 .obj file using commmand line arguments\n");
+	wireNumber(b, job->input != NULL);
+	if(job->input && !wireFile(b, job->input)){
+		b->len = start;
+		return 0;
+	}
+	if(job->expect)
+		expect = job->expect;
+	wireNumber(b, expect != NULL);
+	if(expect && !wireFile(b, expect)){
+		b->len = start;
+		return 0;
+	}
+	return 1;
+}
+
+//A worker connected to the coordinator
+typedef struct {
+	int fd;
+	int wanted;	//jobs it asked for, 0 while it has none asked for
+} coordinator_worker;
+
+typedef struct {
+	batch_job *jobs;
+	int count;
+	int *owner;	//worker running each job, JOB_WAITING or JOB_DONE
+	int *queue;	//jobs waiting to be handed out, the next one last
+	int queued, done;
+	coordinator_worker *workers;
+	int worker_count;
+	int shared;	//leading files of each job the workers got with the options
+	const run_options *opts;
+	wire_buffer message;
+} coordinator;
+
+//Closes the connection of the worker, its jobs go back to the queue
+static void dropWorker(coordinator *c, int w){
+	int last = c->worker_count - 1, i, lost = 0;
+	for(i = c->count - 1; i >= 0; --i)
+		if(c->owner[i] == w){
+			c->owner[i] = JOB_WAITING;
+			c->queue[c->queued++] = i;
+			++lost;
+		}else if(c->owner[i] == last)
+			c->owner[i] = w;
+	if(lost)
+		fprintf(stderr, "A worker went away, its %d jobs go to the others\n", lost);
+	close(c->workers[w].fd);
+	c->workers[w] = c->workers[last];
+	--c->worker_count;
+}
+
+//Takes the results of a worker's message. Returns 0 when they're not for jobs it's running.
+static int takeResults(coordinator *c, int w, wire_reader *r){
+	uint64_t n = wireGetNumber(r), id;
+	int i;
+	for(; n > 0 && !r->bad; --n){
+		batch_job *job;
+		const uint8_t *output;
+		id = wireGetNumber(r);
+		if(id >= (uint64_t) c->count || c->owner[id] != w)
+			return 0;
+		job = &c->jobs[id];
+		job->status = (int) wireGetNumber(r);
+		job->cycles = wireGetNumber(r);
+		for(i = 0; i < 16; ++i)
+			job->opcodes[i] = wireGetNumber(r);
+		job->output_bytes = wireGetNumber(r);
+		job->output_hash = wireGetNumber(r);
+		output = wireGetBytes(r, &job->output_len);
+		if(r->bad)
+			return 0;
+		job->output = malloc(job->output_len ? job->output_len : 1);
+		if(job->output == NULL){
+			fprintf(stderr, "Out of memory taking the results\n");
+			exit(1);
+		}
+		memcpy(job->output, output, job->output_len);
+		c->owner[id] = JOB_DONE;
+		++c->done;
+	}
+	return !r->bad;
+}
+
+//Answers the worker's request with the next jobs of the queue, at most its share of them so that the last
+//ones are spread over the workers. Jobs with files the coordinator can't read run here, to report the error.
+//Returns 0 when the worker can't be sent the jobs.
+static int handOut(coordinator *c, int w){
+	coordinator_worker *worker = &c->workers[w];
+	int share = (c->queued + c->worker_count - 1) / c->worker_count, given = 0, i, job;
+	if(share > worker->wanted)
+		share = worker->wanted;
+	c->message.len = 0;
+	wireNumber(&c->message, 0);	//the count, once it's known
+	while(given < share && c->queued){
+		job = c->queue[--c->queued];
+		if(wireJob(&c->message, &c->jobs[job], job, c->shared, c->opts->expect)){
+			c->owner[job] = w;
+			++given;
+		}else{
+			runJob(&c->jobs[job], c->opts, NULL);
+			c->owner[job] = JOB_DONE;
+			++c->done;
+		}
+	}
+	if(given == 0 && c->done < c->count)
+		return 1;	//the request waits for jobs, or for the others to finish
+	for(i = 0; i < 8; ++i)
+		c->message.data[i] = (uint64_t) given >> (56 - 8 * i);
+	worker->wanted = 0;
+	return wireSend(worker->fd, WIRE_JOBS, &c->message);
+}
+#endif
+
+int runCoordinator(const char *manifest, int port, const run_options *opts, const char *report){
+#if HAVE_SOCKETS
+	coordinator c;
+	wire_buffer options = {NULL, 0, 0};
+	wire_reader r;
+	struct sockaddr_in adress;
+	struct pollfd *polls = NULL;
+	int listener, one = 1, i, w, failed;
+
+	memset(&c, 0, sizeof(c));
+	c.opts = opts;
+	c.count = readManifest(manifest, &c.jobs);
+	if(c.count < 0){
+		fprintf(stderr, "Can't read the batch manifest \"%s\"\n", manifest);
 		return 1;
 	}
+	c.owner = malloc((c.count + 1) * sizeof(int));
+	c.queue = malloc((c.count + 1) * sizeof(int));
+	if(c.owner == NULL || c.queue == NULL){
+		fprintf(stderr, "Out of memory starting the coordinator\n");
+		exit(1);
+	}
+	for(i = 0; i < c.count; ++i){
+		c.owner[i] = JOB_WAITING;
+		c.queue[i] = c.count - 1 - i;
+	}
+	c.queued = c.count;
+	//The OS files the jobs have in common go to each worker once. If one of them can't be read every job
+	//sends all of its files, and the coordinator runs the jobs to report the error.
+	c.shared = sharedFiles(c.jobs, c.count);
+	for(;;){
+		options.len = 0;
+		wirePut(&options, WIRE_MAGIC, sizeof(WIRE_MAGIC));
+		wireOptions(&options, opts);
+		wireNumber(&options, c.shared);
+		for(i = 0; i < c.shared && wireFile(&options, c.jobs[0].files[i]); ++i)
+			;
+		if(i == c.shared)
+			break;
+		c.shared = 0;
+	}
 
-	//Initialize LC3:
-	init();
-	
-	// main loop for fetching and executing instructions
-	   
-	while (MCR_POWER(mcr)) {   // one instruction executed on each rep.
-		if(display.status == DISPLAY_SET){
-				printf("%c", (unsigned char) (0x00FF & display.data));
-				display.status = DISPLAY_READY;
-		}
-		ir = memory[pc]; //fetched the instruction
-		pc++; 
-
-		int16_t opcode = OPCODE(ir);
-
-		switch(opcode) {
-			case ADD_OP:  // add instruction
-				if(IMMBIT(ir)){ //ADD immediate
-					addImm();
-				}else{  //ADD two regs
-					addRegs();
-				}
-				break;
-			case AND_OP:
-				if(IMMBIT(ir)){ //ADD immediate
-					andImm();
-				}else{  //ADD two regs
-					andRegs();
+	listener = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&adress, 0, sizeof(adress));
+	adress.sin_family = AF_INET;
+	adress.sin_addr.s_addr = htonl(INADDR_ANY);
+	adress.sin_port = htons(port);
+	if(listener >= 0)
+		setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if(listener < 0 || bind(listener, (struct sockaddr *) &adress, sizeof(adress)) < 0 || listen(listener, 16) < 0){
+		fprintf(stderr, "Can't listen for workers on port %d\n", port);
+		if(listener >= 0)
+			close(listener);
+		freeManifest(c.jobs, c.count);
+		free(c.owner);
+		free(c.queue);
+		free(options.data);
+		return 1;
+	}
+	fprintf(stderr, "Waiting for workers on port %d\n", port);
+	while(c.done < c.count){
+		polls = realloc(polls, (c.worker_count + 1) * sizeof(struct pollfd));
+		if(polls == NULL){
+			fprintf(stderr, "Out of memory polling the workers\n");
+			exit(1);
+		}
+		polls[0].fd = listener;
+		polls[0].events = POLLIN;
+		for(w = 0; w < c.worker_count; ++w){
+			polls[w + 1].fd = c.workers[w].fd;
+			polls[w + 1].events = POLLIN;
+		}
+		if(poll(polls, c.worker_count + 1, -1) < 0)
+			continue;	//interrupted
+		//from the last, as dropping a worker moves the last one to its place
+		for(w = c.worker_count - 1; w >= 0; --w){
+			int type, ok;
+			if(!polls[w + 1].revents)
+				continue;
+			type = wireReceive(c.workers[w].fd, &c.message, &r);
+			if(type == WIRE_REQUEST){
+				c.workers[w].wanted = (int) wireGetNumber(&r);
+				ok = !r.bad && c.workers[w].wanted > 0;
+			}else
+				ok = type == WIRE_RESULTS && takeResults(&c, w, &r);
+			if(!ok)
+				dropWorker(&c, w);
+		}
+		if(polls[0].revents & POLLIN){
+			int fd = accept(listener, NULL, NULL);
+			if(fd >= 0){
+				setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+				if(!wireSend(fd, WIRE_OPTIONS, &options))
+					close(fd);
+				else{
+					c.workers = realloc(c.workers, (c.worker_count + 1) * sizeof(coordinator_worker));
+					if(c.workers == NULL){
+						fprintf(stderr, "Out of memory taking a worker\n");
+						exit(1);
+					}
+					c.workers[c.worker_count].fd = fd;
+					c.workers[c.worker_count++].wanted = 0;
 				}
-				break; 
-			case LD_OP:
-				ld();
-				break;
-			case LDI_OP:
-				ldi();
-				break;
-			case LDR_OP:
-				ldr();
-				break;
-			case BR_OP:
-				br();
+			}
+		}
+		for(w = c.worker_count - 1; w >= 0; --w)
+			if(c.workers[w].wanted && !handOut(&c, w))
+				dropWorker(&c, w);
+	}
+	//every job is done: the requests waiting get no jobs, which sends the workers home
+	for(w = 0; w < c.worker_count; ++w){
+		if(c.workers[w].wanted)
+			handOut(&c, w);
+		close(c.workers[w].fd);
+	}
+	close(listener);
+	free(polls);
+	free(c.workers);
+	free(c.message.data);
+	free(options.data);
+	free(c.owner);
+	free(c.queue);
+
+	failed = printJobs(c.jobs, c.count, "job", opts->hash_output);
+	if(report && !writeReport(report, c.jobs, c.count))
+		failed = 1;
+	freeManifest(c.jobs, c.count);
+	return failed ? 1 : 0;
+#else
+	(void) manifest;
+	(void) opts;
+	(void) report;
+	fprintf(stderr, "--coordinator needs BSD sockets, which this host doesn't have (port %d)\n", port);
+	return 1;
+#endif
+}
+
+int runWorker(const char *where, int threads){
+#if HAVE_SOCKETS
+	const char *colon = strrchr(where, ':');
+	char host[256], **names = NULL;
+	struct addrinfo hints, *found = NULL, *a;
+	wire_buffer options = {NULL, 0, 0}, message = {NULL, 0, 0}, request = {NULL, 0, 0};
+	wire_reader r;
+	file_data *shared_data = NULL;
+	base_image image, *base = NULL;
+	run_options opts;
+	uint64_t shared = 0, n, k;
+	int fd = -1, one = 1, status = 1, i;
+
+	if(colon == NULL || colon == where || (size_t) (colon - where) >= sizeof(host)){
+		fprintf(stderr, "--worker needs the coordinator as host:port\n");
+		return 1;
+	}
+	memcpy(host, where, colon - where);
+	host[colon - where] = '\0';
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if(getaddrinfo(host, colon + 1, &hints, &found) != 0){
+		fprintf(stderr, "Can't find the coordinator \"%s\"\n", where);
+		return 1;
+	}
+	for(a = found; a && fd < 0; a = a->ai_next){
+		fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+		if(fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) != 0){
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(found);
+	if(fd < 0){
+		fprintf(stderr, "Can't connect to the coordinator \"%s\"\n", where);
+		return 1;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	//The options and the files every job starts with, which stay in the options message
+	if(wireReceive(fd, &options, &r) != WIRE_OPTIONS || r.end - r.p < (ptrdiff_t) sizeof(WIRE_MAGIC)
+		|| memcmp(r.p, WIRE_MAGIC, sizeof(WIRE_MAGIC)) != 0){
+		fprintf(stderr, "\"%s\" isn't a coordinator of this version\n", where);
+		goto done;
+	}
+	r.p += sizeof(WIRE_MAGIC);
+	wireGetOptions(&r, &opts);
+	shared = wireGetNumber(&r);
+	if(r.bad || shared > (uint64_t) (r.end - r.p))
+		goto bad;
+	names = calloc(shared + 1, sizeof(char *));
+	shared_data = calloc(shared + 1, sizeof(file_data));
+	if(names == NULL || shared_data == NULL){
+		fprintf(stderr, "Out of memory starting the worker\n");
+		exit(1);
+	}
+	for(k = 0; k < shared; ++k){
+		names[k] = wireGetString(&r);
+		shared_data[k].data = wireGetBytes(&r, &shared_data[k].size);
+	}
+	if(r.bad)
+		goto bad;
+	if(shared && buildBase(&image, names, shared_data, (int) shared))
+		base = &image;
+#if HAVE_THREADS
+	if(threads <= 0)
+		threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if(threads <= 0)
+		threads = 1;
+	wireNumber(&request, (uint64_t) threads * WORKER_BATCH);
+	if(!wireSend(fd, WIRE_REQUEST, &request))
+		goto gone;
+
+	for(;;){
+		batch_job *jobs;
+		uint64_t *ids;
+		int ok;
+		if(wireReceive(fd, &message, &r) != WIRE_JOBS)
+			goto gone;
+		n = wireGetNumber(&r);
+		if(n == 0){
+			status = 0;
+			break;
+		}
+		if(r.bad || n > (uint64_t) (r.end - r.p) / 24)
+			goto bad;
+		jobs = calloc(n, sizeof(batch_job));
+		ids = malloc(n * sizeof(uint64_t));
+		if(jobs == NULL || ids == NULL){
+			fprintf(stderr, "Out of memory taking jobs\n");
+			exit(1);
+		}
+		for(k = 0; k < n && !r.bad; ++k){
+			batch_job *job = &jobs[k];
+			file_data *data;
+			uint64_t own, count;
+			ids[k] = wireGetNumber(&r);
+			job->max_cycles = wireGetNumber(&r);
+			own = wireGetNumber(&r);
+			if(r.bad || own == 0 || own > (uint64_t) (r.end - r.p)){
+				r.bad = 1;
 				break;
-			case ST_OP:
-				st();
+			}
+			//the shared files' names and contents are the options message's
+			count = shared + own;
+			job->files = calloc(count, sizeof(char *));
+			job->data = data = calloc(count + 2, sizeof(file_data));
+			if(job->files == NULL || data == NULL){
+				fprintf(stderr, "Out of memory taking jobs\n");
+				exit(1);
+			}
+			for(i = 0; i < (int) shared; ++i){
+				job->files[i] = names[i];
+				data[i] = shared_data[i];
+			}
+			for(job->file_count = (int) shared; (uint64_t) job->file_count < count; ++job->file_count){
+				job->files[job->file_count] = wireGetString(&r);
+				data[job->file_count].data = wireGetBytes(&r, &data[job->file_count].size);
+			}
+			if(wireGetNumber(&r)){
+				job->input = wireGetString(&r);
+				data[count].data = wireGetBytes(&r, &data[count].size);
+			}
+			if(wireGetNumber(&r)){
+				job->expect = wireGetString(&r);
+				data[count + 1].data = wireGetBytes(&r, &data[count + 1].size);
+			}
+		}
+		//the next jobs come while these run
+		ok = !r.bad && wireSend(fd, WIRE_REQUEST, &request);
+		if(ok){
+			runJobs(jobs, (int) n, threads, &opts, base);
+			message.len = 0;
+			wireNumber(&message, n);
+			for(k = 0; k < n; ++k){
+				wireNumber(&message, ids[k]);
+				wireNumber(&message, jobs[k].status);
+				wireNumber(&message, jobs[k].cycles);
+				for(i = 0; i < 16; ++i)
+					wireNumber(&message, jobs[k].opcodes[i]);
+				wireNumber(&message, jobs[k].output_bytes);
+				wireNumber(&message, jobs[k].output_hash);
+				wireBytes(&message, jobs[k].output, jobs[k].output_len);
+			}
+			ok = wireSend(fd, WIRE_RESULTS, &message);
+		}
+		for(k = 0; k < n; ++k){
+			for(i = (int) shared; i < jobs[k].file_count; ++i)
+				free(jobs[k].files[i]);
+			free(jobs[k].files);
+			free((void *) jobs[k].data);
+			free(jobs[k].input);
+			free(jobs[k].expect);
+			free(jobs[k].output);
+		}
+		free(jobs);
+		free(ids);
+		if(!ok){
+			if(r.bad)
+				goto bad;
+			goto gone;
+		}
+	}
+	goto done;
+bad:
+	fprintf(stderr, "The coordinator sent a malformed message\n");
+	goto done;
+gone:
+	fprintf(stderr, "Lost the connection to the coordinator\n");
+done:
+	close(fd);
+	if(base)
+		freeBase(base);
+	for(k = 0; names && k < shared; ++k)
+		free(names[k]);
+	free(names);
+	free(shared_data);
+	free(options.data);
+	free(message.data);
+	free(request.data);
+	return status;
+#else
+	(void) threads;
+	fprintf(stderr, "--worker needs BSD sockets, which this host doesn't have (%s)\n", where);
+	return 1;
+#endif
+}
+
+void getState(const machine *m, machine_state *state){
+	memcpy(state->regs, m->regs, sizeof(state->regs));
+	state->pc = m->pc;
+	state->ir = m->ir;
+	state->psr = m->psr.user << 15 | m->psr.priority << 8;
+	state->cc_value = m->cc_value;
+	state->mcr = m->mcr;
+	state->display_status = m->display.status;
+	state->display_data = m->display.data;
+	state->saved_usp = m->saved_usp;
+	state->saved_ssp = m->saved_ssp;
+	state->keyboard_status = m->keyboard.status;
+	state->keyboard_data = m->keyboard.data;
+	state->timer_status = m->timer.status;
+	state->timer_interval = m->timer.interval;
+	state->timer_busy = 0;
+	if(eventTime(m, EVENT_TIMER) != UINT64_MAX)
+		state->timer_busy = eventTime(m, EVENT_TIMER) - m->cycles;
+	state->display_busy = 0;
+	if(eventTime(m, EVENT_DISPLAY) != UINT64_MAX)
+		state->display_busy = eventTime(m, EVENT_DISPLAY) - m->cycles;
+	state->cycles = m->cycles;
+}
+
+void setState(machine *m, const machine_state *state){
+	memcpy(m->regs, state->regs, sizeof(m->regs));
+	m->pc = state->pc;
+	m->ir = state->ir;
+	writePSR(m, state->psr);
+	m->cc_value = state->cc_value;
+	m->mcr = state->mcr;
+	m->display.status = state->display_status;
+	m->display.data = state->display_data;
+	m->saved_usp = state->saved_usp;
+	m->saved_ssp = state->saved_ssp;
+	m->cycles = m->console.flushed_at = state->cycles;
+	cancelEvent(m, EVENT_DISPLAY);
+	if(state->display_busy)
+		scheduleEvent(m, EVENT_DISPLAY, m->cycles + state->display_busy);
+	//a key that was waiting is kept, the ones after it come from this run's input
+	m->keyboard.status = state->keyboard_status;
+	m->keyboard.data = state->keyboard_data;
+	m->keyboard.primed = (m->keyboard.status & KEYBOARD_READY) != 0;
+	m->timer.status = state->timer_status;
+	m->timer.interval = state->timer_interval;
+	cancelEvent(m, EVENT_TIMER);
+	if(m->timer.interval)
+		scheduleEvent(m, EVENT_TIMER, m->cycles + (state->timer_busy ? state->timer_busy : m->timer.interval));
+	updateInterrupts(m);
+}
+
+int saveSnapshot(machine *m, const char *fName){
+	uint8_t header[SNAPSHOT_HEADER_LEN + CONTAINER_MAGIC_LEN + 2], *p = header + SNAPSHOT_MAGIC_LEN;
+	uint8_t *words = malloc(MEMORY_BYTES);
+	segment *runs = malloc(0x8000 * sizeof(segment));
+	machine_state state;
+	int count = 0, pieces = 0, i, ok = words && runs;
+	uint32_t adress = 0, end, gap;
+	FILE *outfile = NULL;
+
+	consoleFlush(m);
+	if(ok){
+		//memory goes in as its runs of non-zero words, short gaps of zeros are cheaper to keep than a new run
+		for(i = 0; i < 65536; ++i)
+			putBigEndian(words + 2 * i, m->memory[i]);
+		while(adress < 0x10000){
+			while(adress < 0x10000 && m->memory[adress] == 0)
+				++adress;
+			if(adress == 0x10000)
 				break;
-			case STI_OP:
-				sti();
+			end = adress;
+			for(gap = 0; end + gap < 0x10000 && gap <= SNAPSHOT_MAX_GAP; ){
+				if(m->memory[end + gap] != 0){
+					end += gap + 1;
+					gap = 0;
+				}else
+					++gap;
+			}
+			runs[count].origin = adress;
+			runs[count].length = end - adress;
+			runs[count].words = words + 2 * adress;
+			++count;
+			adress = end;
+		}
+		if(count == 0){	//containers have at least one segment
+			runs[0].origin = 0;
+			runs[0].length = 0;
+			runs[0].words = words;
+			count = 1;
+		}
+	}
+
+	getState(m, &state);
+	memcpy(header, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN);
+	for(i = 0; i < 4; ++i, p += 2)
+		putBigEndian(p, state.cycles >> (48 - 16 * i));
+	putBigEndian(p, state.display_busy >> 16);
+	putBigEndian(p + 2, state.display_busy);
+	p += 4;
+	for(i = 0; i < REG_COUNT; ++i, p += 2)
+		putBigEndian(p, state.regs[i]);
+	putBigEndian(p, state.pc);
+	putBigEndian(p + 2, state.ir);
+	putBigEndian(p + 4, state.psr);
+	putBigEndian(p + 6, state.cc_value);
+	putBigEndian(p + 8, state.mcr);
+	putBigEndian(p + 10, state.display_status);
+	putBigEndian(p + 12, state.display_data);
+	putBigEndian(p + 14, state.saved_usp);
+	putBigEndian(p + 16, state.saved_ssp);
+	putBigEndian(p + 18, state.keyboard_status);
+	putBigEndian(p + 20, state.keyboard_data);
+	putBigEndian(p + 22, state.timer_status);
+	putBigEndian(p + 24, state.timer_interval);
+	putBigEndian(p + 26, state.timer_busy);
+	memcpy(header + SNAPSHOT_HEADER_LEN, CONTAINER_MAGIC, CONTAINER_MAGIC_LEN);
+	for(i = 0; i < count; ++i)	//only a whole memory image takes two segments
+		pieces += 1 + (runs[i].length > 0xFFFF);
+	putBigEndian(header + SNAPSHOT_HEADER_LEN + CONTAINER_MAGIC_LEN, pieces);
+
+	if(ok && (outfile = fopen(fName, "wb")) == NULL)
+		ok = 0;
+	if(ok)
+		ok = fwrite(header, sizeof(header), 1, outfile) == 1;
+	for(i = 0; ok && i < count; ++i)
+		ok = writeSegment(outfile, &runs[i]);
+	if(outfile && fclose(outfile) != 0)
+		ok = 0;
+	if(!ok)
+		fprintf(stderr, "Can't write the snapshot \"%s\"\n", fName);
+	free(words);
+	free(runs);
+	return ok;
+}
+
+int runUntil(machine *m, uint64_t cycles){
+	int status = 0;
+	uint64_t stop_at = m->stop_at;
+	if(cycles < stop_at)
+		setStop(m, cycles);
+	while(MCR_POWER(m->mcr) && m->cycles < m->stop_at)
+		if(step(m)){
+			status = STATUS_ILLEGAL;
+			break;
+		}
+	if(!m->fault)	//a machine stopped stays stopped
+		setStop(m, stop_at);
+	return status;
+}
+
+void setStop(machine *m, uint64_t cycles){
+	m->stop_at = cycles;
+	m->service_at = SERVICE_TIME(m);
+}
+
+void stopMachine(machine *m, int status){
+	m->fault = status;
+	setStop(m, m->cycles);
+}
+
+int stopMessage(const machine *m, int status, char *text, size_t size){
+	int len = 0;
+	if(status == STATUS_CYCLES)
+		len = snprintf(text, size, "Stopped after %"PRIu64" instructions (--max-cycles), PC = x%04hX", m->cycles, m->pc);
+	else if(status == STATUS_TIMEOUT)
+		len = snprintf(text, size, "Stopped by the watchdog (--timeout) after %"PRIu64" instructions, PC = x%04hX",
+			m->cycles, m->pc);
+	else if(status == STATUS_BAD_ADRESS)
+		len = snprintf(text, size, "Stopped after an access to x%04hX, which has no device, PC = x%04hX",
+			m->fault_adress, m->pc);
+	else if(status == STATUS_DIVERGED)
+		len = snprintf(text, size, "Stopped after %"PRIu64" instructions (--lockstep): %s, the last match was after %"PRIu64,
+			m->cycles, m->lockstep->report, m->lockstep->agreed_at);
+	else if(status == STATUS_MISMATCH && m->output.differs)
+		len = snprintf(text, size, "Stopped at byte %"PRIu64" of the output, which isn't the expected one (--expect), PC = x%04hX",
+			m->output.differs_at, m->pc);
+	else if(status == STATUS_MISMATCH)
+		len = snprintf(text, size, "The output ended after %"PRIu64" bytes, %"PRIu64" were expected (--expect)",
+			m->output.bytes, (uint64_t) m->output.expected_len);
+	else if(size)
+		*text = 0;
+	return len < (int) size ? len : (int) size - 1;
+}
+
+void init(machine *m){
+	m->output.hash = FNV_OFFSET;
+	m->output.bytes = 0;
+	m->output.differs = 0;
+	m->display.status = 0x8000;
+	m->display.data = 0x0000;
+	m->keyboard.status = 0;
+	m->keyboard.data = 0;
+	m->keyboard.primed = 0;
+	m->keyboard.len = m->keyboard.pos = 0;
+	m->timer.status = 0;
+	m->timer.interval = 0;
+	m->event_count = 0;
+	m->next_event = UINT64_MAX;
+	m->psr.user = 0;
+	m->psr.priority = 0;
+	m->saved_usp = 0;
+	m->saved_ssp = INITIAL_SSP;
+	m->irq_vector = -1;
+	m->service_at = UINT64_MAX;
+	m->waiting = 0;
+	m->cycles = 0;
+	m->stop_at = UINT64_MAX;
+	m->skipped = 0;
+	m->fault = 0;
+	forgetCode(m);	//memory gets loaded again
+	m->console.len = 0;
+	m->console.flushed_at = 0;
+	m->cc_value = 0;	//CC starts out as z
+	m->mcr = 0x8000;
+	registerDevice(m, KBSR, keyboardRead, keyboardWrite);
+	registerDevice(m, KBDR, keyboardRead, keyboardWrite);
+	registerDevice(m, DSR, displayRead, displayWrite);
+	registerDevice(m, DDR, displayRead, displayWrite);
+	registerDevice(m, TMR, timerRead, timerWrite);
+	registerDevice(m, TMI, timerRead, timerWrite);
+	registerDevice(m, MCR_ADRESS, mcrRead, mcrWrite);
+}
+
+void updatePSR_CC(machine *m, int16_t val){
+	m->cc_value = val;
+}
+
+int16_t readPSR(machine *m){
+	return m->psr.user << 15 | m->psr.priority << 8 | CC_BITS(m->cc_value);
+}
+
+void writePSR(machine *m, int16_t val){
+	m->psr.user = val >> 15 & 1;
+	m->psr.priority = val >> 8 & 7;
+	m->cc_value = val & 4 ? -1 : val & 1 ? 1 : 0;
+}
+
+void updateInterrupts(machine *m){
+	int vector = -1, priority = m->psr.priority;
+	if((m->timer.status & (TIMER_FIRED | INTERRUPT_ENABLE)) == (TIMER_FIRED | INTERRUPT_ENABLE) && TIMER_PRIORITY > priority){
+		vector = TIMER_VECTOR;
+		priority = TIMER_PRIORITY;
+	}
+	if((m->keyboard.status & (KEYBOARD_READY | INTERRUPT_ENABLE)) == (KEYBOARD_READY | INTERRUPT_ENABLE) && KEYBOARD_PRIORITY > priority){
+		vector = KEYBOARD_VECTOR;
+		priority = KEYBOARD_PRIORITY;
+	}
+	if((m->display.status & (DISPLAY_READY | INTERRUPT_ENABLE)) == (DISPLAY_READY | INTERRUPT_ENABLE) && DISPLAY_PRIORITY > priority){
+		vector = DISPLAY_VECTOR;
+		priority = DISPLAY_PRIORITY;
+	}
+	m->irq_vector = vector;
+	m->irq_priority = priority;
+	m->service_at = SERVICE_TIME(m);
+}
+
+void serviceMachine(machine *m){
+	if(m->cycles >= m->next_event)
+		runEvents(m, 1);
+	if(m->irq_vector >= 0)
+		interrupt(m, m->irq_vector, m->irq_priority);
+}
+
+void interrupt(machine *m, uint8_t vector, int priority){
+	int16_t psr = readPSR(m);
+	if(m->psr.user){
+		m->saved_usp = m->regs[6];
+		m->regs[6] = m->saved_ssp;
+	}
+	writeMemory(m, --m->regs[6], psr);
+	writeMemory(m, --m->regs[6], m->pc);
+	if(m->history){
+		logWrite(m, m->regs[6] + 1, m->pc, 1);
+		logWrite(m, m->regs[6], m->pc, 1);
+	}
+	m->psr.user = 0;
+	if(priority >= 0)
+		m->psr.priority = priority;
+	m->pc = m->memory[INTERRUPT_TABLE + vector];
+	updateInterrupts(m);
+}
+
+int16_t readMemory(machine *m, uint16_t adress){
+	const device_register *io = m->io_pages[adress >> PAGE_SHIFT];
+	if(io){
+		if(!io[adress % PAGE_SIZE].read){
+			m->fault_adress = adress;
+			stopMachine(m, STATUS_BAD_ADRESS);
+			return 0;
+		}
+		if(m->cycles >= m->next_event)
+			runEvents(m, 0);
+		return io[adress % PAGE_SIZE].read(m, adress);
+	}
+	return m->memory[adress];
+}
+
+void writeMemory(machine *m, uint16_t adress, int16_t val){
+	const device_register *io = m->io_pages[adress >> PAGE_SHIFT];
+	if(io){
+		if(!io[adress % PAGE_SIZE].write){
+			m->fault_adress = adress;
+			stopMachine(m, STATUS_BAD_ADRESS);
+			return;
+		}
+		if(m->cycles >= m->next_event)
+			runEvents(m, 0);
+		io[adress % PAGE_SIZE].write(m, adress, val);
+		return;
+	}
+	storeWord(m, adress, val);	//self-modifying code: the word has to be decoded again before it runs
+}
+
+void markDirty(machine *m, uint16_t adress, uint32_t len){
+	uint32_t page;
+	if(len)
+		for(page = adress >> PAGE_SHIFT; page <= (adress + len - 1) >> PAGE_SHIFT && page < PAGE_COUNT; ++page){
+			m->dirty_pages[page] = 1;
+			redecodePage(m, page);
+			invalidatePage(m, page);
+		}
+}
+
+void clearDirty(machine *m){
+	if(m->decoded_ready && m->jit_enabled)	//runThreaded() would miss the JIT's stores then
+		redecodeDirty(m);
+	memset(m->dirty_pages, 0, sizeof(m->dirty_pages));
+}
+
+int registerDevice(machine *m, uint16_t adress, int16_t (*read)(machine *, uint16_t), void (*write)(machine *, uint16_t, int16_t)){
+	//The JIT only leaves native code for accesses at or above IO_SPACE_START, so devices can't live below it.
+	if(adress < IO_SPACE_START)
+		return 0;
+	unsigned int page = adress >> PAGE_SHIFT;
+	if(!m->io_pages[page])
+		m->io_pages[page] = &m->io_registers[(page << PAGE_SHIFT) - IO_SPACE_START];
+	m->io_pages[page][adress % PAGE_SIZE].read = read;
+	m->io_pages[page][adress % PAGE_SIZE].write = write;
+	return 1;
+}
+
+static void swapEvents(machine *m, int i, int j){
+	uint64_t at = m->events[i].at;
+	int kind = m->events[i].kind;
+	m->events[i] = m->events[j];
+	m->events[j].at = at;
+	m->events[j].kind = kind;
+}
+
+//Removes the event at position i of the heap
+static void removeEvent(machine *m, int i){
+	int child;
+	swapEvents(m, i, --m->event_count);
+	while(i > 0 && m->events[i].at < m->events[(i - 1) / 2].at){
+		swapEvents(m, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+	while((child = 2 * i + 1) < m->event_count){
+		if(child + 1 < m->event_count && m->events[child + 1].at < m->events[child].at)
+			++child;
+		if(m->events[i].at <= m->events[child].at)
+			break;
+		swapEvents(m, i, child);
+		i = child;
+	}
+	m->next_event = m->event_count ? m->events[0].at : UINT64_MAX;
+	m->service_at = SERVICE_TIME(m);
+}
+
+void cancelEvent(machine *m, int kind){
+	int i;
+	for(i = 0; i < m->event_count; ++i)
+		if(m->events[i].kind == kind){
+			removeEvent(m, i);
+			return;
+		}
+}
+
+void scheduleEvent(machine *m, int kind, uint64_t at){
+	int i;
+	cancelEvent(m, kind);
+	i = m->event_count++;
+	m->events[i].at = at;
+	m->events[i].kind = kind;
+	while(i > 0 && m->events[i].at < m->events[(i - 1) / 2].at){
+		swapEvents(m, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+	m->next_event = m->events[0].at;
+	m->service_at = SERVICE_TIME(m);
+}
+
+uint64_t eventTime(const machine *m, int kind){
+	int i;
+	for(i = 0; i < m->event_count; ++i)
+		if(m->events[i].kind == kind)
+			return m->events[i].at;
+	return UINT64_MAX;
+}
+
+//Puts the next key of the input in KBDR, or leaves the keyboard not ready when the input is over
+size_t readKeys(FILE *in, unsigned char *buf, size_t size){
+#if HAVE_MMAP
+	//read() returns what there is, a line at a time from a terminal, where fread() would wait for a full buffer
+	ssize_t len = in ? read(fileno(in), buf, size) : 0;
+	return len > 0 ? len : 0;
+#else
+	return in ? fread(buf, 1, size, in) : 0;
+#endif
+}
+
+static void nextKey(machine *m){
+	if(m->keyboard.pos == m->keyboard.len && m->keyboard.source){
+		m->keyboard.len = m->keyboard.source(m->keyboard.source_context, m->keyboard.buf, KEYBOARD_BUF_SIZE);
+		m->keyboard.pos = 0;
+	}else if(m->keyboard.pos == m->keyboard.len && m->keyboard.in){
+		m->keyboard.len = readKeys(m->keyboard.in, m->keyboard.buf, KEYBOARD_BUF_SIZE);
+		m->keyboard.pos = 0;
+	}
+	if(m->keyboard.pos < m->keyboard.len){
+		m->keyboard.data = m->keyboard.buf[m->keyboard.pos++];
+		m->keyboard.status |= KEYBOARD_READY;
+	}
+}
+
+void runEvents(machine *m, int between){
+	while(m->event_count && m->events[0].at <= m->cycles){
+		uint64_t at = m->events[0].at;
+		int kind = m->events[0].kind;
+		removeEvent(m, 0);
+		switch(kind){
+			case EVENT_DISPLAY:
+				m->display.status |= DISPLAY_READY;
 				break;
-			case STR_OP:
-				str();
+			case EVENT_KEYBOARD:
+				nextKey(m);
 				break;
-			case LEA_OP:
-				lea();
+			case EVENT_TIMER:
+				m->timer.status |= TIMER_FIRED;
+				//the intervals that are over already (polling was skipped) fire together
+				scheduleEvent(m, EVENT_TIMER, at + m->timer.interval * ((m->cycles - at) / m->timer.interval + 1));
 				break;
-			case JSR_OP:
-				jsr();
+			case EVENT_WATCHDOG:
+				if(nowNs() >= m->deadline)
+					stopMachine(m, STATUS_TIMEOUT);
+				else
+					scheduleEvent(m, EVENT_WATCHDOG, m->cycles + WATCHDOG_INTERVAL);
 				break;
-			case RET_OP:
-				ret();
+			case EVENT_GDB:
+				if(gdbInterrupted(m)){
+					m->gdb->stop = GDB_STOP_INTERRUPT;
+					setStop(m, m->cycles);
+				}
+				scheduleEvent(m, EVENT_GDB, m->cycles + GDB_POLL_INTERVAL);
 				break;
-			case TRAP_OP:
-				trap();
-				break;			
-			default:
-				fprintf(stderr, "\nUnrecognized instruction /w opcode %"PRId16"\nPC = x%04hX\nExiting...", opcode, pc);
-				getchar();
-				return 1;
+			case EVENT_LOCKSTEP:
+				if(!between)	//the registers are halfway through the instruction, compare after it
+					scheduleEvent(m, EVENT_LOCKSTEP, m->cycles + 1);
+				else if(lockstepCheck(m, 0))
+					scheduleEvent(m, EVENT_LOCKSTEP, m->cycles + m->lockstep->interval);
+				else
+					stopMachine(m, STATUS_DIVERGED);
 				break;
-		} // switch ends
+		}
 	}
-	if(PRINT_ON){
-		printState();
-		printf("Execution completed.\n");
-		printMemory(load_start_addr, pc);
+	updateInterrupts(m);
+}
 
-		printf("Print the next 20 memory locations? (Y/N)\n");
-		char c;
-		if((c = getchar()) == 'y' || c == 'Y')
-			printMemory(pc, pc + 20);
+//The actual memory adresses are completely inaccessible, mem[KBSR/KBDR/DSR/DDR/TMR/TMI/mcr] maps us to our
+//devices.
+int16_t keyboardRead(machine *m, uint16_t adress){
+	int16_t data;
+	if(!m->keyboard.primed){	//input is only read once the program looks for it
+		m->keyboard.primed = 1;
+		nextKey(m);
 	}
-	return 0;
+	data = m->keyboard.data;	//the key KBDR holds, before the next one comes in
+	if(adress == KBSR){
+		m->waiting = !(m->keyboard.status & KEYBOARD_READY);
+		return m->keyboard.status;
+	}
+	if(m->keyboard.status & KEYBOARD_READY){
+		m->keyboard.status &= ~KEYBOARD_READY;
+		if(m->key_latency)
+			scheduleEvent(m, EVENT_KEYBOARD, m->cycles + m->key_latency);
+		else
+			nextKey(m);
+		updateInterrupts(m);
+	}
+	return data;
 }
 
-int16_t loadFile(const char* fName){
-	// how big is the input file?
-	struct stat stats;
-	stat(fName, &stats);
-	int size_in_bytes = stats.st_size;
-	   
-	FILE *infile = fopen(fName, "r");
-	int16_t load_start_addr;
-
-	// read in first two bytes to find out starting address of machine code
-	//int words_read = 
-	fread(&load_start_addr,sizeof(int16_t), 1, infile);
-	// printf("Words read from input = %d,  value read = %hu\n", words_read, load_start_addr);
-	char *cptr = (char *)&load_start_addr;
-	char temp;
-
-	// switch order of bytes
-	temp = *cptr;
-	*cptr = *(cptr+1);
-	*(cptr+1) = temp;
+void keyboardWrite(machine *m, uint16_t adress, int16_t val){
+	if(adress != KBSR)
+		return;
+	//only the interrupt enable bit can be written, and enabling it has the input looked at
+	m->keyboard.status = (m->keyboard.status & KEYBOARD_READY) | (val & INTERRUPT_ENABLE);
+	if(!m->keyboard.primed && (val & INTERRUPT_ENABLE)){
+		m->keyboard.primed = 1;
+		nextKey(m);
+	}
+	updateInterrupts(m);
+}
 
-	// printf("After switching bytes, value read = %hx\n", load_start_addr);   
-	pc = load_start_addr;
+int16_t displayRead(machine *m, uint16_t adress){
+	if(adress == DDR)
+		return m->display.data;
+	m->waiting = m->display.status >= 0;
+	return m->display.status;
+}
 
+int16_t timerRead(machine *m, uint16_t adress){
+	int16_t status = m->timer.status;
+	if(adress == TMI)
+		return m->timer.interval;
+	m->timer.status &= ~TIMER_FIRED;
+	m->waiting = !(status & TIMER_FIRED);
+	if(status & TIMER_FIRED)
+		updateInterrupts(m);
+	return status;
+}
 
-	// now read in the remaining bytes of the object file
-	int instrs_to_load = (size_in_bytes-2)/2;
+void timerWrite(machine *m, uint16_t adress, int16_t val){
+	if(adress == TMR){	//only the interrupt enable bit can be written
+		m->timer.status = (m->timer.status & TIMER_FIRED) | (val & INTERRUPT_ENABLE);
+		updateInterrupts(m);
+		return;
+	}
+	m->timer.interval = val;
+	if(m->timer.interval)
+		scheduleEvent(m, EVENT_TIMER, m->cycles + m->timer.interval);
+	else
+		cancelEvent(m, EVENT_TIMER);
+}
 
-	// words_read = 
-	fread(&memory[load_start_addr], sizeof(int16_t),instrs_to_load, infile);
-	// printf("Words read from input = %d\n", words_read);
+void skipPolling(machine *m, uint16_t pc){
+	int16_t ldi = m->memory[pc], br = m->memory[(uint16_t) (pc + 1)], status = m->regs[REG1(ldi)];
+	uint16_t adress = m->memory[(uint16_t) (pc + 1 + PCOFFSET9(ldi))];
+	int kind = adress == DSR ? EVENT_DISPLAY : adress == KBSR ? EVENT_KEYBOARD : adress == TMR ? EVENT_TIMER : -1;
+	uint64_t at, iterations;
+	m->waiting = 0;
+	if(!m->fast_forward || OPCODE(ldi) != LDI_OP || kind < 0 || OPCODE(br) != BR_OP || PCOFFSET9(br) != -2
+		|| !(br & (status < 0 ? 0x0800 : status == 0 ? 0x0400 : 0x0200)))
+		return;
+	at = eventTime(m, kind);
+	//Any earlier event may raise an interrupt, which has to be taken on time, and the run may stop before
+	if(at > m->service_at)
+		at = m->service_at;
+	if(at == UINT64_MAX || at <= m->cycles)
+		return;
+	//The loop's LDIs read at 2, 4... cycles from now, the first one at or after at sees the event
+	iterations = (at - m->cycles - 1) / 2;
+	m->cycles += 2 * iterations;
+	m->skipped += 2 * iterations;
+}
 
-	// again switch the bytes 
-	int i;
-	cptr = (char *)&memory[load_start_addr]; 
-	for (i = 0; i < instrs_to_load; i++) {
-		temp = *cptr;
-		*cptr = *(cptr+1);
-		*(cptr+1) = temp;
-		cptr += 2;  // next pair
+void displayWrite(machine *m, uint16_t adress, int16_t val){
+	if(adress == DSR){	//only the interrupt enable bit can be written
+		m->display.status = (m->display.status & DISPLAY_READY) | (val & INTERRUPT_ENABLE);
+		updateInterrupts(m);
+		return;
+	}
+	m->display.data = val;
+	consolePut(m, (char) (0x00FF & val));
+	if(m->display_latency){
+		m->display.status &= ~DISPLAY_READY;
+		scheduleEvent(m, EVENT_DISPLAY, m->cycles + m->display_latency);
+		updateInterrupts(m);
 	}
-	return load_start_addr;
 }
 
-void init(){
-	display.status = 0x8000;
-	display.data = 0x0000;
-	psr.z = 1;
-	mcr = 0x8000;
+int16_t mcrRead(machine *m, uint16_t adress){
+	(void) adress;
+	return m->mcr;
 }
 
-void updatePSR_CC(int16_t val){
-	if(val < 0) {psr.z = 0; psr.n = 1; psr.p = 0;}			//n
-	else if(val == 0) {psr.z = 1; psr.n = 0; psr.p = 0;}	//z
-	else if(val > 0) {psr.z = 0; psr.n = 0; psr.p = 1;}		//p
+void mcrWrite(machine *m, uint16_t adress, int16_t val){
+	(void) adress;
+	m->mcr = val;
+	if(!MCR_POWER(m->mcr))
+		consoleFlush(m);	//HALT
 }
 
-void printState(){
+void printState(machine *m){
 	int i;
 	for(i = 0; i < REG_COUNT; ++i)
-		printf("Reg[%d]\t0x%04hX\t#%"PRId16"\n", i, regs[i] & 0xffff, regs[i]);
-	printf("PC\t0x%04hX\n", pc & 0xffff);
-	printf("PSR\t0x%04hX\n", ((psr.junk << 3) + (psr.n << 2) + (psr.z << 1) + psr.p) & 0xffff);
-	printf("IR\t0x%04hX\n", ir & 0xffff);
-	printf("CC\t%c\n", psr.n ? 'N' : psr.z ? 'Z' : psr.p ? 'P' : ' ');
+		printf("Reg[%d]\t0x%04hX\t#%"PRId16"\n", i, m->regs[i] & 0xffff, m->regs[i]);
+	printf("PC\t0x%04hX\n", m->pc & 0xffff);
+	printf("PSR\t0x%04hX\n", readPSR(m));
+	printf("IR\t0x%04hX\n", m->ir & 0xffff);
+	printf("CC\t%c\n", m->cc_value < 0 ? 'N' : m->cc_value == 0 ? 'Z' : 'P');
 }
 
-void printMemory(int16_t from, int16_t to){
+void printMemory(machine *m, uint32_t from, uint32_t to){
 	printf("Memory Contents:\n");
-	for(; from < to; ++from) printf("%04hX\t0x%04X\n", from & 0xffff, memory[from] & 0xffff);
-}
-
-void addImm(){
-	int16_t dest_reg = REG1(ir),
-		src_reg = REG2(ir),
-		imm_val = IMMVAL(ir);
-	if(PRINT_ON)	printf("ADD\tR%"PRId16"\tR%"PRId16"\t%d\n", dest_reg, src_reg, imm_val);
-	regs[dest_reg] = regs[src_reg] + imm_val;
-	updatePSR_CC(regs[dest_reg]);
-}
-
-void addRegs(){
-	int16_t dest_reg = REG1(ir),
-		src_reg1 = REG2(ir),
-		src_reg2 = REG3(ir);
-	if(PRINT_ON)	printf("ADD\tR%"PRId16"\tR%"PRId16"\tR%"PRId16"\n", dest_reg, src_reg1, src_reg2);
-	regs[dest_reg] = regs[src_reg1] + regs[src_reg2];
-	updatePSR_CC(regs[dest_reg]);
-}
-
-void andImm(){
-	int16_t dest_reg = REG1(ir),
-		src_reg1 = REG2(ir),
-		imm_val = IMMVAL(ir);
-	if(PRINT_ON)	printf("AND\tR%"PRId16"\tR%"PRId16"\t%"PRId16"\n", dest_reg, src_reg1, imm_val);
-	regs[dest_reg] = regs[src_reg1] & imm_val;
-	updatePSR_CC(regs[dest_reg]);
-}
-
-void andRegs(){
-	if(PRINT_ON)	printf("AND R%"PRId16"\n", 0);
-	int16_t dest_reg = REG1(ir),
-		src_reg1 = REG2(ir),
-		src_reg2 = REG3(ir);
-	if(PRINT_ON)	printf("AND\tR%"PRId16"\tR%"PRId16"\tR%"PRId16"\n", dest_reg, src_reg1, src_reg2);
-	regs[dest_reg] = regs[src_reg1] & regs[src_reg2];
-	updatePSR_CC(regs[dest_reg]);
-}
-
-void not(){
-	int16_t dest_reg = REG1(ir),
-		src_reg = REG2(ir);
-	if(PRINT_ON)	printf("NOT\tR%"PRId16"\tR%"PRId16"\n", dest_reg, src_reg);
-	regs[dest_reg] = ~regs[src_reg];
-	updatePSR_CC(regs[dest_reg]);
-}
-
-void br(){
-	int16_t n = BRN(ir),
-		z = BRZ(ir),
-		p = BRP(ir),
-		pcoffset = PCOFFSET9(ir);
-	if(PRINT_ON)	printf("BR\t%c%c%c\t%"PRId16"\n", n ? 'n' : ' ', z ? 'z' : ' ', p ? 'p' : ' ', pcoffset);
-	if((psr.n & n) | (psr.z & z) | (psr.p & p))
-		pc += pcoffset;
-}
-
-void ld(){
-	int16_t dest_reg = REG1(ir),
-		pcoffset = PCOFFSET9(ir);
-	if(PRINT_ON)	printf("LD\tR%"PRId16"\t%"PRId16"\n", dest_reg, pcoffset);
-	int16_t src_adress = pc + pcoffset;
-
-	//Memory mapping should go both ways(loads and stores).
-	//The actual memory adresses are completely inaccessible, mem[DSR/DDR/mcr] maps us to our display device.
-	if(src_adress == DSR)
-		regs[dest_reg] = display.status;
-	else if(src_adress == DDR)
-		regs[dest_reg] = display.data;
-	else if(src_adress == MCR_ADRESS
-	)
-		regs[dest_reg] = mcr;
-	else
-		regs[dest_reg] = memory[src_adress];
-
-	// regs[dest_reg] = memory[pc + pcoffset];
-	updatePSR_CC(regs[dest_reg]);
-}
-
-void ldi(){
-	int16_t dest_reg = REG1(ir),
-		pcoffset = PCOFFSET9(ir);
-	if(PRINT_ON)	printf("LDI\tR%"PRId16"\t%"PRId16"\n", dest_reg, pcoffset);
-	int16_t src_adress1 = pc + pcoffset, src_adress2;
-
-	//Memory mapping should go both ways(loads and stores).
-	//The actual memory adresses are completely inaccessible, mem[DSR/DDR/mcr] maps us to our display device.
-	if(src_adress1 == DSR)
-		src_adress2 = display.status;
-	else if(src_adress1 == DDR)
-		src_adress2 = display.data;
-	else if(src_adress1 == MCR_ADRESS
-	)
-		src_adress2 = mcr;
-	else
-		src_adress2 = memory[src_adress1];
-
-	if(src_adress2 == DSR)
-		regs[dest_reg] = display.status;
-	else if(src_adress2 == DDR)
-		regs[dest_reg] = display.data;
-	else if(src_adress2 == MCR_ADRESS
-	)
-		regs[dest_reg] = mcr;
-	else
-		regs[dest_reg] = memory[src_adress2];
-	// regs[dest_reg] = memory[memory[pc + pcoffset]];
-	updatePSR_CC(regs[dest_reg]);
-}
-
-void ldr(){
-	int16_t dest_reg = REG1(ir),
-		base_reg = REG2(ir),
-		pcoffset = PCOFFSET6(ir);
-	if(PRINT_ON)	printf("LDR\tR%"PRId16"\tR%"PRId16"\t%"PRId16"\n", dest_reg, base_reg, pcoffset);
-	int16_t scr_adress = regs[base_reg] + pcoffset;
-
-	//Memory mapping should go both ways(loads and stores).
-	//The actual memory adresses are completely inaccessible, mem[DSR/DDR/mcr] maps us to our display device.
-	if(scr_adress == DSR)
-		regs[dest_reg] = display.status;
-	else if(scr_adress == DDR)
-		regs[dest_reg] = display.data;
-	else if(scr_adress == MCR_ADRESS
-	)
-		regs[dest_reg] = mcr;
-	else
-		regs[dest_reg] = memory[scr_adress];
-
-	// regs[dest_reg] = memory[regs[base_reg] + pcoffset];
-	updatePSR_CC(regs[dest_reg]);
-}
-
-void st(){
-	int16_t src_reg = REG1(ir),
-		pcoffset = PCOFFSET9(ir);
-	if(PRINT_ON)	printf("ST\tR%"PRId16"\t%"PRId16"\n", src_reg, pcoffset);
-	int16_t dest_adress = pc + pcoffset;
-
-	if(dest_adress == DSR)
-		display.status = regs[src_reg];
-	else if(dest_adress == DDR){
-		display.data = regs[src_reg];
-		display.status = DISPLAY_SET;
-	}else if(dest_adress == MCR_ADRESS
-	)
-		mcr = regs[src_reg];
-	else
-		memory[dest_adress] = regs[src_reg];
+	for(; from < to && from < 0x10000; ++from) printf("%04X\t0x%04X\n", (unsigned int) from, m->memory[from] & 0xffff);
+}
+
+void printWritten(const machine *m){
+	int page = 0, end, count = 0;
+	printf("Memory written:");
+	while(page < PAGE_COUNT){
+		if(!m->dirty_pages[page]){
+			++page;
+			continue;
+		}
+		for(end = page; end < PAGE_COUNT && m->dirty_pages[end]; ++end)
+			;
+		printf("%s x%04X-x%04X", count++ ? "," : "", page << PAGE_SHIFT, (end << PAGE_SHIFT) - 1);
+		page = end;
+	}
+	printf(count ? "\n" : " none\n");
+}
+
+void addImm(machine *m){
+	int16_t dest_reg = REG1(m->ir),
+		src_reg = REG2(m->ir),
+		imm_val = IMMVAL(m->ir);
+	m->regs[dest_reg] = m->regs[src_reg] + imm_val;
+	updatePSR_CC(m, m->regs[dest_reg]);
+}
+
+void addRegs(machine *m){
+	int16_t dest_reg = REG1(m->ir),
+		src_reg1 = REG2(m->ir),
+		src_reg2 = REG3(m->ir);
+	m->regs[dest_reg] = m->regs[src_reg1] + m->regs[src_reg2];
+	updatePSR_CC(m, m->regs[dest_reg]);
+}
+
+void andImm(machine *m){
+	int16_t dest_reg = REG1(m->ir),
+		src_reg1 = REG2(m->ir),
+		imm_val = IMMVAL(m->ir);
+	m->regs[dest_reg] = m->regs[src_reg1] & imm_val;
+	updatePSR_CC(m, m->regs[dest_reg]);
+}
+
+void andRegs(machine *m){
+	int16_t dest_reg = REG1(m->ir),
+		src_reg1 = REG2(m->ir),
+		src_reg2 = REG3(m->ir);
+	m->regs[dest_reg] = m->regs[src_reg1] & m->regs[src_reg2];
+	updatePSR_CC(m, m->regs[dest_reg]);
+}
+
+void not(machine *m){
+	int16_t dest_reg = REG1(m->ir),
+		src_reg = REG2(m->ir);
+	m->regs[dest_reg] = ~m->regs[src_reg];
+	updatePSR_CC(m, m->regs[dest_reg]);
+}
+
+void br(machine *m){
+	int16_t n = BRN(m->ir),
+		z = BRZ(m->ir),
+		p = BRP(m->ir),
+		pcoffset = PCOFFSET9(m->ir);
+	if(CC_BITS(m->cc_value) & ((n << 2) | (z << 1) | p))
+		m->pc += pcoffset;
+}
+
+void ld(machine *m){
+	int16_t dest_reg = REG1(m->ir),
+		pcoffset = PCOFFSET9(m->ir);
+	m->regs[dest_reg] = readMemory(m, m->pc + pcoffset);
+	updatePSR_CC(m, m->regs[dest_reg]);
+}
 
-	// memory[pc + pcoffset] = regs[src_reg];
+void ldi(machine *m){
+	int16_t dest_reg = REG1(m->ir),
+		pcoffset = PCOFFSET9(m->ir);
+	m->regs[dest_reg] = readMemory(m, readMemory(m, m->pc + pcoffset));
+	updatePSR_CC(m, m->regs[dest_reg]);
+	if(m->waiting)
+		skipPolling(m, m->pc - 1);
 }
 
-void sti(){
-	int16_t src_reg = REG1(ir),
-		pcoffset = PCOFFSET9(ir);
-	if(PRINT_ON)	printf("STI\tR%"PRId16"\t%"PRId16"\n", src_reg, pcoffset);
+void ldr(machine *m){
+	int16_t dest_reg = REG1(m->ir),
+		base_reg = REG2(m->ir),
+		pcoffset = PCOFFSET6(m->ir);
+	m->regs[dest_reg] = readMemory(m, m->regs[base_reg] + pcoffset);
+	updatePSR_CC(m, m->regs[dest_reg]);
+}
 
-	int16_t dest_adress1 = pc + pcoffset, dest_adress2;
+void st(machine *m){
+	int16_t src_reg = REG1(m->ir),
+		pcoffset = PCOFFSET9(m->ir);
+	writeMemory(m, m->pc + pcoffset, m->regs[src_reg]);
+}
 
+void sti(machine *m){
+	int16_t src_reg = REG1(m->ir),
+		pcoffset = PCOFFSET9(m->ir);
 	//Although it wouldn't make sense to do it, the client is allowed to
 	//treat DSR/DDR as a pointer and they are both memory mapped which means
 	//they should not be accessed from memory but from the display device's data/status
 	//Same goes for mcr(memory mapped)
-	if(dest_adress1 == DSR)
-		dest_adress2 = display.status;
-	else if(dest_adress1 == DDR)
-		dest_adress2 = display.data;
-	else if(dest_adress1 == MCR_ADRESS
-	)
-		dest_adress2 = mcr;
-	else
-		dest_adress2 = memory[dest_adress1];
-
-	if(dest_adress2 == DSR)
-		display.status = regs[src_reg];
-	else if(dest_adress2 == DDR){
-		display.data = regs[src_reg];
-		display.status = DISPLAY_SET;;
-	}else if(dest_adress2 == MCR_ADRESS
-	)
-		mcr = regs[src_reg];
-	else
-		memory[dest_adress2] = regs[src_reg];
-
-	// memory[memory[pc + pcoffset]] = regs[src_reg];
-}
-
-void str(){
-	int16_t src_reg = REG1(ir),
-		base_reg = REG2(ir),
-		pcoffset = PCOFFSET6(ir);
-	if(PRINT_ON)	printf("LDR\tR%"PRId16"\tR%"PRId16"\t%"PRId16"\n", src_reg, base_reg, pcoffset);
-	int16_t dest_adress = regs[base_reg] + pcoffset;
-
-	if(dest_adress == DSR)
-		display.status = regs[src_reg];
-	else if(dest_adress == DDR){
-		display.data = regs[src_reg];
-		display.status = DISPLAY_SET;
-	}else if(dest_adress == MCR_ADRESS
-	)
-		mcr = regs[src_reg];
-	else
-		memory[dest_adress] = regs[src_reg];
-	// memory[regs[base_reg] + pcoffset] = regs[src_reg];
+	writeMemory(m, readMemory(m, m->pc + pcoffset), m->regs[src_reg]);
+}
+
+void str(machine *m){
+	int16_t src_reg = REG1(m->ir),
+		base_reg = REG2(m->ir),
+		pcoffset = PCOFFSET6(m->ir);
+	writeMemory(m, m->regs[base_reg] + pcoffset, m->regs[src_reg]);
+}
+
+void lea(machine *m){
+	int16_t dest_reg = REG1(m->ir),
+		pcoffset = PCOFFSET9(m->ir);
+	m->regs[dest_reg] = m->pc + pcoffset;
+	updatePSR_CC(m, m->regs[dest_reg]); //AFFECTS CC!
 }
 
-void lea(){
-	int16_t dest_reg = REG1(ir),
-		pcoffset = PCOFFSET9(ir);
-	if(PRINT_ON) printf("LEA\tR%"PRId16"\t%"PRId16"\n", dest_reg, pcoffset);
-	regs[dest_reg] = pc + pcoffset;
-	updatePSR_CC(regs[dest_reg]); //AFFECTS CC!
+void jsr(machine *m){
+	int16_t pcoffset = PCOFFSET11(m->ir);
+	uint16_t target = m->ir & 0x0800 ? m->pc + pcoffset : m->regs[REG2(m->ir)];	//JSR or JSRR
+	m->regs[7] = m->pc;	//Save PC into R7:
+	m->pc = target;
 }
 
-void jsr(){
-	int16_t pcoffset = PCOFFSET11(ir);
-	if(PRINT_ON) printf("JSR\t%"PRId16"\n", pcoffset);
-	regs[7] = pc;	//Save PC into R7:
-	pc += pcoffset;
+void ret(machine *m){
+	m->pc = m->regs[REG2(m->ir)];	//JMP, RET is JMP R7
 }
 
-void ret(){
-	if(PRINT_ON) printf("RET\n");
-	pc = regs[7];
+void rti(machine *m){
+	if(m->psr.user){
+		interrupt(m, PRIVILEGE_VECTOR, -1);
+		return;
+	}
+	m->pc = readMemory(m, m->regs[6]++);
+	writePSR(m, readMemory(m, m->regs[6]++));
+	if(m->psr.user){
+		m->saved_ssp = m->regs[6];
+		m->regs[6] = m->saved_usp;
+	}
+	updateInterrupts(m);
+}
+
+void trap(machine *m){
+	uint16_t vect = TRPVECT8(m->ir);
+	m->regs[7] = m->pc;	//Save PC into R7:
+	if(!fastTrap(m, vect))
+		m->pc = m->memory[vect];
 }
 
-void trap(){
-	int16_t vect = TRPVECT8(ir);
-	if(PRINT_ON) printf("TRAP\tx%04hX\n", vect);
-	regs[7] = pc;	//Save PC into R7:
-	pc = memory[vect];
+void enableFastTraps(machine *m, const uint8_t *guest){
+	static const struct {
+		uint8_t vect;
+		uint8_t service;
+	} known[] = {
+		{0x21, TRAP_OUT}, {0x22, TRAP_PUTS}, {0x25, TRAP_HALT},	//LC3 OS
+		{0x40, TRAP_OUT}, {0x48, TRAP_PUTS}, {0x50, TRAP_HALT}	//SampleLC3_Code's out/puts/halt
+	};
+	unsigned int i;
+	for(i = 0; i < sizeof(known) / sizeof(known[0]); ++i)
+		if(!guest[known[i].vect])
+			m->trap_service[known[i].vect] = known[i].service;
+}
+
+int fastTrap(machine *m, uint16_t vect){
+	static const char halt_message[] = "----- Halting the processor -----\n";
+	uint16_t adress;
+	int16_t c;
+	const char *s;
+	switch(m->trap_service[vect]){
+		case TRAP_OUT:
+			consolePut(m, (char) (0x00FF & m->regs[0]));
+			updatePSR_CC(m, m->regs[7]);	//the guest routine ends restoring R7
+			return 1;
+		case TRAP_PUTS:
+			for(adress = m->regs[0]; (c = readMemory(m, adress)) != 0; ++adress)
+				consolePut(m, (char) (0x00FF & c));
+			updatePSR_CC(m, m->regs[7]);
+			return 1;
+		case TRAP_HALT:
+			for(s = halt_message; *s; ++s)
+				consolePut(m, *s);
+			m->regs[1] = readMemory(m, MCR_ADRESS);
+			m->regs[0] = m->regs[1] & 0x7FFF;
+			updatePSR_CC(m, m->regs[0]);
+			writeMemory(m, MCR_ADRESS, m->regs[0]);
+			return 1;
+	}
+	return 0;
 }
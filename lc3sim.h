@@ -0,0 +1,113 @@
+/*
+	liblc3sim: the LC3 simulator as a library, for running machines in-process.
+	Build LC3.c with -DLC3SIM_LIBRARY to leave out its main(), e.g.
+	"cc -O2 -shared -fPIC -fvisibility=hidden -DLC3SIM_LIBRARY -pthread -o liblc3sim.so LC3.c".
+	Machines don't share any state, so different threads can run different machines.
+*/
+#ifndef LC3SIM_H
+#define LC3SIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+#define LC3SIM_API __attribute__((visibility("default")))
+#else
+#define LC3SIM_API
+#endif
+
+typedef struct lc3sim lc3sim;
+
+//Engines, as the simulator's --engine= numbers them
+#define LC3SIM_ENGINE_SWITCH (0)
+#define LC3SIM_ENGINE_THREADED (1)
+#define LC3SIM_ENGINE_BLOCK (2)
+#define LC3SIM_ENGINE_JIT (3)
+
+//Console and keyboard of a machine. output gets what the program writes to DDR, a line (or a full console
+//buffer) at a time. input puts up to size keys in buf and returns how many it put there, 0 when there are no
+//more. Without output the program's output is dropped, without input the keyboard never gets a key.
+typedef struct {
+	void (*output)(void *context, const char *bytes, size_t len);
+	size_t (*input)(void *context, unsigned char *buf, size_t size);
+	void *context;
+} lc3sim_io;
+
+//lc3simCreate() options. Zeroed, they are the simulator's defaults.
+typedef struct {
+	int engine;			//LC3SIM_ENGINE_
+	unsigned int display_latency;	//cycles the display is busy after each character
+	unsigned int key_latency;	//cycles from a key being read to the next one coming in
+	int no_fast_forward;		//run device polling loops instruction by instruction
+	lc3sim_io io;
+} lc3sim_options;
+
+//lc3simRun() and lc3simStep() results
+#define LC3SIM_HALTED (0)	//the machine is turned off
+#define LC3SIM_RUNNING (1)	//it ran the cycles asked for and can go on
+#define LC3SIM_ILLEGAL (2)	//it ran into an illegal instruction and stopped for good
+#define LC3SIM_BAD_ADRESS (3)	//it accessed an adress of the device space (xFE00-xFFFF) without a device and
+				//stopped for good
+
+//lc3simReadReg() registers besides R0-R7
+#define LC3SIM_PC (8)
+#define LC3SIM_PSR (9)
+#define LC3SIM_IR (10)
+
+//Makes an initialized machine with empty memory (NULL options for the defaults). Returns NULL when the engine
+//isn't one of LC3SIM_ENGINE_; out of memory the process exits, as the simulator does. lc3simDestroy() frees it.
+//The threaded, block and JIT engines keep the words they decoded, the blocks they built and the native code
+//from one run to the next, so running in short slices costs about what one long run does.
+LC3SIM_API lc3sim *lc3simCreate(const lc3sim_options *);
+LC3SIM_API void lc3simDestroy(lc3sim *);
+
+//Clears memory and initializes the machine again, so a machine can be reused for the next program. The words
+//the engines decoded and the blocks they built are dropped, which costs what of the last program ran, not
+//all of memory.
+LC3SIM_API void lc3simReset(lc3sim *);
+
+//Loads an .obj file, segment container or snapshot (from a file, or from the bytes given) like the simulator's
+//command line does: the pc starts at its origin. Returns the origin, or a negative error lc3simError() describes.
+LC3SIM_API int lc3simLoad(lc3sim *, const char *);
+LC3SIM_API int lc3simLoadImage(lc3sim *, const void *, size_t);
+LC3SIM_API const char *lc3simError(int);
+
+//Assembles LC3 source text of len bytes into memory, as lc3simLoad() does for an .asm file. The errors are
+//reported on stderr. Returns the starting adress (the last .ORIG), or a negative error lc3simError() describes.
+LC3SIM_API int lc3simAssemble(lc3sim *, const char *, size_t);
+
+//Runs the machine until it's turned off or has run max_cycles more instructions (0 for no limit).
+//lc3simStep() runs one instruction. Both return an LC3SIM_ result.
+LC3SIM_API int lc3simRun(lc3sim *, uint64_t);
+LC3SIM_API int lc3simStep(lc3sim *);
+
+//Instructions executed since the machine was made or reset
+LC3SIM_API uint64_t lc3simCycles(const lc3sim *);
+
+//Reads R0-R7 or one of LC3SIM_PC/PSR/IR (0 for other numbers).
+LC3SIM_API int16_t lc3simReadReg(const lc3sim *, int);
+LC3SIM_API void lc3simWriteReg(lc3sim *, int, int16_t);
+
+//Reads and writes memory. The device registers aren't accessed, so reading one has no side effects.
+LC3SIM_API int16_t lc3simReadMem(const lc3sim *, uint16_t);
+LC3SIM_API void lc3simWriteMem(lc3sim *, uint16_t, int16_t);
+
+//Pages of memory, LC3SIM_PAGE_WORDS words each (page p from adress p * LC3SIM_PAGE_WORDS on)
+#define LC3SIM_PAGE_WORDS (256)
+#define LC3SIM_PAGE_COUNT (256)
+
+//Sets bit p % 64 of bitmap[p / 64] for each page p written since the machine was made, reset or cleared
+//(by its stores and interrupts, loading, lc3simWriteMem()) and returns how many there are. A page not set
+//holds what it held then, so incremental snapshots and diffs only need to look at the pages set.
+LC3SIM_API int lc3simDirtyPages(const lc3sim *, uint64_t bitmap[LC3SIM_PAGE_COUNT / 64]);
+LC3SIM_API void lc3simClearDirty(lc3sim *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif